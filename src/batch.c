@@ -0,0 +1,328 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BATCH_X86 1
+#endif
+
+#include "include/batch.h"
+#include "include/functions.h"
+#include "include/mem.h"
+#include "include/vm.h"
+
+/* Widest vector in doubles. Blocks are padded to a multiple of it so the
+ * kernels never need a scalar tail. */
+#define BATCH_MIN_LANES 4
+/* Upper bound for the register columns of a block, in doubles. Programs
+ * with many registers get shorter blocks instead. */
+#define BATCH_MAX_WORKING_SET (128 * 1024)
+
+typedef void (*unary_kernel)(double *dst, const double *a, size_t n);
+typedef void (*binary_kernel)(double *dst, const double *a, const double *b,
+                              size_t n);
+
+/* Opcodes without a kernel run through `run_scalar()` */
+struct batch_kernels {
+  const char *isa;
+  unary_kernel unary[N_OPCODES];
+  binary_kernel binary[N_OPCODES];
+};
+
+static const struct batch_kernels kernels_scalar = {.isa = "scalar"};
+
+#ifdef BATCH_X86
+
+#define UNARY_KERNEL(__isa, __name, __width, __load, __store, __op)            \
+  __attribute__((target(#__isa))) static void __name##_##__isa(                \
+      double *dst, const double *a, size_t n) {                                \
+    for (size_t i = 0; i < n; i += (__width)) {                                \
+      __store(dst + i, __op(__load(a + i)));                                   \
+    }                                                                          \
+    KERNEL_LEAVE_##__isa();                                                    \
+  }
+
+#define BINARY_KERNEL(__isa, __name, __width, __load, __store, __op)           \
+  __attribute__((target(#__isa))) static void __name##_##__isa(                \
+      double *dst, const double *a, const double *b, size_t n) {               \
+    for (size_t i = 0; i < n; i += (__width)) {                                \
+      __store(dst + i, __op(__load(a + i), __load(b + i)));                    \
+    }                                                                          \
+    KERNEL_LEAVE_##__isa();                                                    \
+  }
+
+/* Leaving the upper halves of the ymm registers dirty makes every SSE
+ * instruction in libm slow afterwards. The compiler only clears them on its
+ * own when optimizing. */
+#define KERNEL_LEAVE_sse2()
+#define KERNEL_LEAVE_avx2() _mm256_zeroupper()
+
+/* minpd/maxpd return the second operand when either one is NaN, fmin() and
+ * fmax() return the one that is a number */
+__attribute__((target("sse2"))) static inline __m128d fmin_pd(__m128d a,
+                                                              __m128d b) {
+  __m128d b_nan = _mm_cmpunord_pd(b, b);
+  return _mm_or_pd(_mm_and_pd(b_nan, a),
+                   _mm_andnot_pd(b_nan, _mm_min_pd(a, b)));
+}
+
+__attribute__((target("sse2"))) static inline __m128d fmax_pd(__m128d a,
+                                                              __m128d b) {
+  __m128d b_nan = _mm_cmpunord_pd(b, b);
+  return _mm_or_pd(_mm_and_pd(b_nan, a),
+                   _mm_andnot_pd(b_nan, _mm_max_pd(a, b)));
+}
+
+__attribute__((target("sse2"))) static inline __m128d neg_pd(__m128d a) {
+  return _mm_xor_pd(a, _mm_set1_pd(-0.0));
+}
+
+__attribute__((target("sse2"))) static inline __m128d abs_pd(__m128d a) {
+  return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+}
+
+BINARY_KERNEL(sse2, add, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd)
+BINARY_KERNEL(sse2, sub, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd)
+BINARY_KERNEL(sse2, mul, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd)
+BINARY_KERNEL(sse2, div, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd)
+BINARY_KERNEL(sse2, min, 2, _mm_loadu_pd, _mm_storeu_pd, fmin_pd)
+BINARY_KERNEL(sse2, max, 2, _mm_loadu_pd, _mm_storeu_pd, fmax_pd)
+UNARY_KERNEL(sse2, neg, 2, _mm_loadu_pd, _mm_storeu_pd, neg_pd)
+UNARY_KERNEL(sse2, abs, 2, _mm_loadu_pd, _mm_storeu_pd, abs_pd)
+UNARY_KERNEL(sse2, sqrt, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sqrt_pd)
+
+__attribute__((target("avx2"))) static inline __m256d fmin_pd256(__m256d a,
+                                                                 __m256d b) {
+  return _mm256_blendv_pd(_mm256_min_pd(a, b), a,
+                          _mm256_cmp_pd(b, b, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx2"))) static inline __m256d fmax_pd256(__m256d a,
+                                                                 __m256d b) {
+  return _mm256_blendv_pd(_mm256_max_pd(a, b), a,
+                          _mm256_cmp_pd(b, b, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx2"))) static inline __m256d neg_pd256(__m256d a) {
+  return _mm256_xor_pd(a, _mm256_set1_pd(-0.0));
+}
+
+__attribute__((target("avx2"))) static inline __m256d abs_pd256(__m256d a) {
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+}
+
+__attribute__((target("avx2"))) static inline __m256d trunc_pd256(__m256d a) {
+  return _mm256_round_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+}
+
+BINARY_KERNEL(avx2, add, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd)
+BINARY_KERNEL(avx2, sub, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd)
+BINARY_KERNEL(avx2, mul, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd)
+BINARY_KERNEL(avx2, div, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd)
+BINARY_KERNEL(avx2, min, 4, _mm256_loadu_pd, _mm256_storeu_pd, fmin_pd256)
+BINARY_KERNEL(avx2, max, 4, _mm256_loadu_pd, _mm256_storeu_pd, fmax_pd256)
+UNARY_KERNEL(avx2, neg, 4, _mm256_loadu_pd, _mm256_storeu_pd, neg_pd256)
+UNARY_KERNEL(avx2, abs, 4, _mm256_loadu_pd, _mm256_storeu_pd, abs_pd256)
+UNARY_KERNEL(avx2, sqrt, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sqrt_pd)
+UNARY_KERNEL(avx2, floor, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+             _mm256_floor_pd)
+UNARY_KERNEL(avx2, ceil, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_ceil_pd)
+UNARY_KERNEL(avx2, trunc, 4, _mm256_loadu_pd, _mm256_storeu_pd, trunc_pd256)
+
+static const struct batch_kernels kernels_sse2 = {
+    .isa = "sse2",
+    .unary =
+        {
+            [OP_NEG] = neg_sse2,
+            [OP_TT_ABS] = abs_sse2,
+            [OP_TT_SQRT] = sqrt_sse2,
+        },
+    .binary =
+        {
+            [OP_ADD] = add_sse2,
+            [OP_SUB] = sub_sse2,
+            [OP_MUL] = mul_sse2,
+            [OP_DIV] = div_sse2,
+            [OP_TT_MIN] = min_sse2,
+            [OP_TT_MAX] = max_sse2,
+        },
+};
+
+static const struct batch_kernels kernels_avx2 = {
+    .isa = "avx2",
+    .unary =
+        {
+            [OP_NEG] = neg_avx2,
+            [OP_TT_ABS] = abs_avx2,
+            [OP_TT_SQRT] = sqrt_avx2,
+            [OP_TT_FLOOR] = floor_avx2,
+            [OP_TT_CEIL] = ceil_avx2,
+            [OP_TT_TRUNC] = trunc_avx2,
+        },
+    .binary =
+        {
+            [OP_ADD] = add_avx2,
+            [OP_SUB] = sub_avx2,
+            [OP_MUL] = mul_avx2,
+            [OP_DIV] = div_avx2,
+            [OP_TT_MIN] = min_avx2,
+            [OP_TT_MAX] = max_avx2,
+        },
+};
+
+#endif /* BATCH_X86 */
+
+static const struct batch_kernels *select_kernels(void) {
+#ifdef BATCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &kernels_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &kernels_sse2;
+  }
+#endif
+  return &kernels_scalar;
+}
+
+static const struct batch_kernels *get_kernels(void) {
+  static const struct batch_kernels *selected = NULL;
+  const struct batch_kernels *kernels =
+      __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+  if (kernels == NULL) {
+    kernels = select_kernels();
+    __atomic_store_n(&selected, kernels, __ATOMIC_RELEASE);
+  }
+  return kernels;
+}
+
+const char *batch_isa(void) { return get_kernels()->isa; }
+
+static void run_scalar(const Instruction *insn, double *dst, const double *lhs,
+                       const double *rhs, size_t n) {
+  switch (insn->op) {
+  case OP_NEG:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = -lhs[i];
+    }
+    break;
+  case OP_ADD:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = lhs[i] + rhs[i];
+    }
+    break;
+  case OP_SUB:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = lhs[i] - rhs[i];
+    }
+    break;
+  case OP_MUL:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = lhs[i] * rhs[i];
+    }
+    break;
+  case OP_DIV:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = lhs[i] / rhs[i];
+    }
+    break;
+  case OP_POW:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = pow(lhs[i], rhs[i]);
+    }
+    break;
+#define FUNCTION(__name, __tt, __arity, __expr)                                \
+  case OP_##__tt:                                                              \
+    for (size_t i = 0; i < n; i++) {                                           \
+      const double a = lhs[i];                                                 \
+      const double b = rhs[i];                                                 \
+      (void)b;                                                                 \
+      dst[i] = (__expr);                                                       \
+    }                                                                          \
+    break;
+#include "include/functions.def"
+#undef FUNCTION
+  case OP_RET:
+  default:
+    break;
+  }
+}
+
+static void run_block(const struct vm_program *program,
+                      const struct batch_kernels *kernels, double **regs,
+                      size_t n) {
+  /* The last instruction is always the RET */
+  for (size_t i = 0; i + 1 < program->len; i++) {
+    const Instruction *insn = &program->code[i];
+    if (kernels->binary[insn->op] != NULL) {
+      kernels->binary[insn->op](regs[insn->dst], regs[insn->a], regs[insn->b],
+                                n);
+    } else if (kernels->unary[insn->op] != NULL) {
+      kernels->unary[insn->op](regs[insn->dst], regs[insn->a], n);
+    } else {
+      run_scalar(insn, regs[insn->dst], regs[insn->a], regs[insn->b], n);
+    }
+  }
+}
+
+void evaluate_batch(const struct vm_program *program, const double *xs,
+                    double *out, size_t n) {
+  if (program->len == 0) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = NAN;
+    }
+    return;
+  }
+  if (n == 0) {
+    return;
+  }
+
+  const struct batch_kernels *kernels = get_kernels();
+
+  size_t lanes = BATCH_LANES;
+  while (lanes > BATCH_MIN_LANES &&
+         (program->n_regs + 1) * lanes > BATCH_MAX_WORKING_SET) {
+    lanes /= 2;
+  }
+
+  /* One column per register plus one to pad the last block of `xs` */
+  MemTag tag = mem_tag_swap(MT_EVALUATOR);
+  double **regs = malloc_checked(program->n_regs * sizeof(double *));
+  double *columns =
+      malloc_checked((program->n_regs + 1) * lanes * sizeof(double));
+  mem_tag_swap(tag);
+  for (size_t r = 0; r < program->n_regs; r++) {
+    regs[r] = columns + r * lanes;
+  }
+  double *x_tail = columns + program->n_regs * lanes;
+
+  for (size_t c = 0; c < program->n_consts; c++) {
+    for (size_t i = 0; i < lanes; i++) {
+      regs[c][i] = program->consts[c];
+    }
+  }
+
+  const uint16_t ret = program->code[program->len - 1].a;
+  for (size_t offset = 0; offset < n; offset += lanes) {
+    size_t count = n - offset < lanes ? n - offset : lanes;
+    size_t padded = (count + BATCH_MIN_LANES - 1) & ~(BATCH_MIN_LANES - 1);
+
+    if (program->n_vars > 0) {
+      if (count == padded) {
+        /* Variable registers are only ever read, so `xs` is used in place */
+        regs[program->n_consts] = (double *)(xs + offset);
+      } else {
+        memcpy(x_tail, xs + offset, count * sizeof(double));
+        memset(x_tail + count, 0, (padded - count) * sizeof(double));
+        regs[program->n_consts] = x_tail;
+      }
+    }
+
+    run_block(program, kernels, regs, padded);
+    memcpy(out + offset, regs[ret], count * sizeof(double));
+  }
+
+  free_checked(columns);
+  free_checked(regs);
+}
@@ -0,0 +1,724 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/batch.h"
+#include "include/bignum.h"
+#include "include/conversion.h"
+#include "include/evaluator.h"
+#include "include/gnuplot.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/parser.h"
+#include "include/pipe_reader.h"
+#include "include/plot.h"
+#include "include/vector.h"
+#include "include/vm.h"
+
+/* A round has to take at least this long to be measured, the best of
+ * BENCH_ROUNDS rounds is reported */
+#define BENCH_MIN_ROUND_NS 20e6
+#define BENCH_ROUNDS 5
+#define BENCH_MAX_RESULTS 128
+/* Slowdown past which a result counts as a regression */
+#define BENCH_DEFAULT_THRESHOLD 0.15
+
+/* Runs the benchmarked operation `iterations` times */
+typedef void (*bench_fn)(void *ctx, size_t iterations);
+
+struct bench_result {
+  char name[64];
+  size_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+};
+
+static struct {
+  struct bench_result results[BENCH_MAX_RESULTS];
+  size_t len;
+  const char *filter;
+} suite;
+
+/* Every heap allocation made while benchmarking, whichever thread makes it.
+ * glibc lets the program replace malloc, so the counting versions below
+ * forward to its own. */
+static size_t allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+#define BENCH_COUNTS_ALLOCATIONS 1
+#else
+#define BENCH_COUNTS_ALLOCATIONS 0
+#endif
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double run_round(bench_fn fn, void *ctx, size_t iterations) {
+  double start = now_ns();
+  fn(ctx, iterations);
+  return now_ns() - start;
+}
+
+static bool selected(const char *name) {
+  return suite.filter == NULL || strstr(name, suite.filter) != NULL;
+}
+
+/* `bytes_per_op` is the input processed by one operation, 0 if a byte rate
+ * doesn't make sense for it */
+static void bench(const char *name, bench_fn fn, void *ctx,
+                  size_t bytes_per_op) {
+  if (!selected(name)) {
+    return;
+  }
+  if (suite.len == BENCH_MAX_RESULTS) {
+    fprintf(stderr, "Too many benchmarks, skipping `%s`\n", name);
+    return;
+  }
+
+  /* Warms up the caches and calibrates the round size at the same time */
+  size_t iterations = 1;
+  while (run_round(fn, ctx, iterations) < BENCH_MIN_ROUND_NS) {
+    iterations *= 2;
+  }
+
+  double best = INFINITY;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    best = fmin(best, run_round(fn, ctx, iterations));
+  }
+
+  size_t before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  fn(ctx, iterations);
+  size_t after = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+
+  struct bench_result *r = &suite.results[suite.len++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->iterations = iterations;
+  r->ns_per_op = best / iterations;
+  r->allocs_per_op =
+      BENCH_COUNTS_ALLOCATIONS ? (double)(after - before) / iterations : -1;
+  r->bytes_per_op = bytes_per_op;
+}
+
+/* Keeps the compiler from optimizing the benchmarked calls away */
+static volatile double sink;
+
+struct expr_bench {
+  char *expr;
+  struct rpn_program rpn;
+  struct vm_program program;
+};
+
+static void expr_bench_init(struct expr_bench *b, char *expr) {
+  ParseError parse_error = PE_OK;
+  size_t error_index = 0;
+  b->expr = expr;
+  parse_math(expr, NULL, &b->rpn, &parse_error, &error_index);
+  if (parse_error != PE_OK || vm_compile(&b->rpn, NULL, &b->program) != ER_OK) {
+    fprintf(stderr, "Failed to compile benchmark expression `%s`\n", expr);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void expr_bench_free(struct expr_bench *b) {
+  vm_program_free(&b->program);
+  rpn_program_free(&b->rpn);
+}
+
+static void run_parse(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  for (size_t i = 0; i < iterations; i++) {
+    ParseError parse_error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math(b->expr, NULL, &rpn, &parse_error, &error_index);
+    rpn_program_free(&rpn);
+  }
+}
+
+static void run_evaluate(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  EvaluatorResult er;
+  for (size_t i = 0; i < iterations; i++) {
+    sink = evaluate(&b->rpn, NULL, &er);
+  }
+}
+
+static void run_evaluate_int(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  int64_t result = 0;
+  bool overflow = false;
+  for (size_t i = 0; i < iterations; i++) {
+    evaluate_int(&b->rpn, &result, &overflow);
+  }
+  sink = (double)result;
+}
+
+static void run_evaluate_exact(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  struct bigrat result;
+  bigrat_init(&result);
+  for (size_t i = 0; i < iterations; i++) {
+    evaluate_exact(&b->rpn, b->expr, &result);
+  }
+  sink = (double)bignum_bits(&result.num);
+  bigrat_free(&result);
+}
+
+static void run_vm_compile(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  for (size_t i = 0; i < iterations; i++) {
+    struct vm_program program;
+    vm_compile(&b->rpn, NULL, &program);
+    vm_program_free(&program);
+  }
+}
+
+static void run_vm_execute(void *ctx, size_t iterations) {
+  struct expr_bench *b = ctx;
+  for (size_t i = 0; i < iterations; i++) {
+    sink = vm_execute(&b->program, NULL);
+  }
+}
+
+static void bench_expression(const char *corpus, char *expr) {
+  struct expr_bench b;
+  expr_bench_init(&b, expr);
+  char name[64];
+  snprintf(name, sizeof(name), "parse/%s", corpus);
+  bench(name, run_parse, &b, strlen(expr));
+  snprintf(name, sizeof(name), "evaluate/%s", corpus);
+  bench(name, run_evaluate, &b, 0);
+  int64_t exact;
+  bool overflow;
+  if (evaluate_int(&b.rpn, &exact, &overflow)) {
+    snprintf(name, sizeof(name), "evaluate_int/%s", corpus);
+    bench(name, run_evaluate_int, &b, 0);
+  } else {
+    struct bigrat q;
+    bigrat_init(&q);
+    if (evaluate_exact(&b.rpn, expr, &q)) {
+      snprintf(name, sizeof(name), "evaluate_exact/%s", corpus);
+      bench(name, run_evaluate_exact, &b, 0);
+    }
+    bigrat_free(&q);
+  }
+  snprintf(name, sizeof(name), "vm_compile/%s", corpus);
+  bench(name, run_vm_compile, &b, 0);
+  snprintf(name, sizeof(name), "vm_execute/%s", corpus);
+  bench(name, run_vm_execute, &b, 0);
+  expr_bench_free(&b);
+}
+
+#define BATCH_POINTS 4096
+
+struct batch_bench {
+  struct expr_bench expr;
+  double xs[BATCH_POINTS];
+  double out[BATCH_POINTS];
+};
+
+/* One operation is one point */
+static void run_batch(void *ctx, size_t iterations) {
+  struct batch_bench *b = ctx;
+  for (size_t done = 0; done < iterations; done += BATCH_POINTS) {
+    size_t n = iterations - done < BATCH_POINTS ? iterations - done
+                                                : BATCH_POINTS;
+    evaluate_batch(&b->expr.program, b->xs, b->out, n);
+  }
+  sink = b->out[0];
+}
+
+static void bench_batch(const char *name, char *expr) {
+  struct batch_bench *b = malloc(sizeof(struct batch_bench));
+  expr_bench_init(&b->expr, expr);
+  for (size_t i = 0; i < BATCH_POINTS; i++) {
+    b->xs[i] = -10.0 + 20.0 * (double)i / BATCH_POINTS;
+  }
+  bench(name, run_batch, b, 0);
+  expr_bench_free(&b->expr);
+  free(b);
+}
+
+static const long long conversion_inputs[] = {
+    0, 1, -42, 255, 65535, 1234567, -987654321, 0x7fffffffffffLL};
+#define N_CONVERSION_INPUTS                                                    \
+  (sizeof(conversion_inputs) / sizeof(conversion_inputs[0]))
+#define CONVERSION_BIG_DIGITS 10000
+
+struct conversion_bench {
+  struct bignum *inputs;
+  size_t len;
+  unsigned base;
+};
+
+static void run_to_string(void *ctx, size_t iterations) {
+  struct conversion_bench *b = ctx;
+  struct vector_char out;
+  vector_init_char(&out);
+  for (size_t i = 0; i < iterations; i++) {
+    vector_clear_char(&out);
+    convert_to_base(&b->inputs[i % b->len], b->base, &out);
+  }
+  vector_free_char(&out);
+}
+
+static void run_from_string(void *ctx, size_t iterations) {
+  char *str = ctx;
+  size_t len = strlen(str);
+  struct bignum num;
+  bignum_init(&num);
+  for (size_t i = 0; i < iterations; i++) {
+    enum ConversionError error;
+    convert_from_string(str, len, &num, &error);
+  }
+  sink = (double)bignum_bits(&num);
+  bignum_free(&num);
+}
+
+static void bench_conversion(void) {
+  struct bignum small[N_CONVERSION_INPUTS];
+  for (size_t i = 0; i < N_CONVERSION_INPUTS; i++) {
+    bignum_init(&small[i]);
+    bignum_set_i64(&small[i], conversion_inputs[i]);
+  }
+  struct conversion_bench b = {small, N_CONVERSION_INPUTS, 2};
+  bench("convert/to_bin", run_to_string, &b, 0);
+  b.base = 16;
+  bench("convert/to_hex", run_to_string, &b, 0);
+  for (size_t i = 0; i < N_CONVERSION_INPUTS; i++) {
+    bignum_free(&small[i]);
+  }
+
+  char dec[] = "-123456789012";
+  char hex[] = "0x1F2E3D4C5B6A";
+  char bin[] = "0b1011001110001111000011111";
+  bench("convert/from_dec", run_from_string, dec, strlen(dec));
+  bench("convert/from_hex", run_from_string, hex, strlen(hex));
+  bench("convert/from_bin", run_from_string, bin, strlen(bin));
+
+  char *big_dec = malloc_checked(CONVERSION_BIG_DIGITS + 1);
+  for (size_t i = 0; i < CONVERSION_BIG_DIGITS; i++) {
+    big_dec[i] = (char)('1' + i * 7 % 9);
+  }
+  big_dec[CONVERSION_BIG_DIGITS] = '\0';
+  bench("convert/from_dec_10k", run_from_string, big_dec,
+        CONVERSION_BIG_DIGITS);
+  struct bignum big;
+  bignum_init(&big);
+  enum ConversionError error;
+  convert_from_string(big_dec, CONVERSION_BIG_DIGITS, &big, &error);
+  b = (struct conversion_bench){&big, 1, 10};
+  bench("convert/to_dec_10k", run_to_string, &b, 0);
+  b.base = 16;
+  bench("convert/to_hex_10k", run_to_string, &b, 0);
+  b.base = 2;
+  bench("convert/to_bin_10k", run_to_string, &b, 0);
+  bignum_free(&big);
+  free_checked(big_dec);
+}
+
+/* One operation is one push onto a vector that is freed every 64Ki pushes */
+static void run_push_char(void *ctx, size_t iterations) {
+  (void)ctx;
+  struct vector_char v;
+  vector_init_char(&v);
+  for (size_t i = 0; i < iterations; i++) {
+    if (v.len == 1 << 16) {
+      vector_free_char(&v);
+      vector_init_char(&v);
+    }
+    vector_push_char(&v, (char)i);
+  }
+  vector_free_char(&v);
+}
+
+static void run_extend_char(void *ctx, size_t iterations) {
+  (void)ctx;
+  static const char chunk[4096];
+  struct vector_char v;
+  vector_init_char(&v);
+  for (size_t i = 0; i < iterations; i++) {
+    if (v.len == 64 * sizeof(chunk)) {
+      vector_clear_char(&v);
+    }
+    vector_extend_char(&v, chunk, sizeof(chunk));
+  }
+  vector_free_char(&v);
+}
+
+/* A whole evaluation stack's life: fits in the inline buffer */
+static void run_small_double(void *ctx, size_t iterations) {
+  (void)ctx;
+  for (size_t i = 0; i < iterations; i++) {
+    struct vector_small_double v;
+    vector_init_small_double(&v);
+    for (int j = 0; j < 8; j++) {
+      vector_push_small_double(&v, j);
+    }
+    double sum = 0;
+    while (v.len > 0) {
+      sum += vector_pop_small_double(&v);
+    }
+    sink = sum;
+    vector_free_small_double(&v);
+  }
+}
+
+static void bench_vector(void) {
+  bench("vector/push_char", run_push_char, NULL, 1);
+  bench("vector/extend_4k", run_extend_char, NULL, 4096);
+  bench("vector/small_double_8", run_small_double, NULL, 0);
+}
+
+static void run_plot_render(void *ctx, size_t iterations) {
+  const char *expr = ctx;
+  for (size_t i = 0; i < iterations; i++) {
+    PlotError error;
+    struct vector_char png = plot_render(expr, &error);
+    if (error != PLE_OK) {
+      fprintf(stderr, "Failed to plot benchmark expression `%s`\n", expr);
+      exit(EXIT_FAILURE);
+    }
+    vector_free_char(&png);
+  }
+}
+
+struct gnuplot_bench {
+  const char *expr;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  bool failed;
+};
+
+static void on_gnuplot_done(struct vector_char *png, void *data) {
+  struct gnuplot_bench *b = data;
+  pthread_mutex_lock(&b->lock);
+  b->failed = b->failed || png->len == 0;
+  b->done = true;
+  pthread_cond_signal(&b->cond);
+  pthread_mutex_unlock(&b->lock);
+  vector_free_char(png);
+}
+
+/* Plots are serialized so this is the latency of a warm worker */
+static void run_gnuplot(void *ctx, size_t iterations) {
+  struct gnuplot_bench *b = ctx;
+  for (size_t i = 0; i < iterations && !b->failed; i++) {
+    b->done = false;
+    gnuplot_plot_async(b->expr, on_gnuplot_done, b);
+    pthread_mutex_lock(&b->lock);
+    while (!b->done) {
+      pthread_cond_wait(&b->cond, &b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+static void bench_gnuplot(const char *name, const char *expr) {
+  if (!selected(name)) {
+    return;
+  }
+  struct gnuplot_bench b = {.expr = expr,
+                            .lock = PTHREAD_MUTEX_INITIALIZER,
+                            .cond = PTHREAD_COND_INITIALIZER};
+  gnuplot_pool_init(1);
+  run_gnuplot(&b, 1);
+  if (b.failed) {
+    /* Not installed on every machine that builds the bot */
+    fprintf(stderr, "Skipping `%s`, gnuplot is not available\n", name);
+  } else {
+    bench(name, run_gnuplot, &b, 0);
+  }
+  gnuplot_pool_cleanup();
+}
+
+struct pipe_bench {
+  char *payload;
+  size_t size;
+  bool byte_reads;
+};
+
+/* Reads everything a child process writes into a vector, the way
+ * gnuplot_plot() used to (one read() per byte) or with the pipe reader */
+static void read_from_child(const struct pipe_bench *b) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    for (size_t written = 0; written < b->size;) {
+      ssize_t n = write(fds[1], b->payload + written, b->size - written);
+      if (n <= 0) {
+        _exit(EXIT_FAILURE);
+      }
+      written += n;
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  close(fds[1]);
+
+  struct vector_char out;
+  vector_init_char(&out);
+  if (b->byte_reads) {
+    char c;
+    while (read(fds[0], &c, 1) > 0) {
+      vector_push_char(&out, c);
+    }
+  } else {
+    struct pipe_reader reader;
+    vector_reserve_char(&out, PIPE_READER_MIN_READ);
+    pipe_reader_init(&reader, fds[0], b->size, 5000);
+    if (pipe_reader_read_all(&reader, &out) != PR_OK) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (out.len != b->size) {
+    fprintf(stderr, "Short read from child: %zu of %zu bytes\n", out.len,
+            b->size);
+    exit(EXIT_FAILURE);
+  }
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  vector_free_char(&out);
+}
+
+static void run_pipe(void *ctx, size_t iterations) {
+  for (size_t i = 0; i < iterations; i++) {
+    read_from_child(ctx);
+  }
+}
+
+static void bench_pipe(const char *name, size_t size, bool byte_reads) {
+  struct pipe_bench b = {
+      .payload = malloc(size), .size = size, .byte_reads = byte_reads};
+  for (size_t i = 0; i < size; i++) {
+    b.payload[i] = (char)(i * 31);
+  }
+  bench(name, run_pipe, &b, size);
+  free(b.payload);
+}
+
+static char *make_long_expression(size_t terms) {
+  struct vector_char expr;
+  vector_init_char(&expr);
+  for (size_t i = 0; i < terms; i++) {
+    char term[32];
+    int len = snprintf(term, sizeof(term), "%s%zu.5 * %zu", i ? " + " : "",
+                       i, i % 7 + 1);
+    vector_extend_char(&expr, term, len);
+  }
+  vector_push_char(&expr, '\0');
+  return expr.buf;
+}
+
+static char *make_nested_expression(size_t depth) {
+  struct vector_char expr;
+  vector_init_char(&expr);
+  for (size_t i = 0; i < depth; i++) {
+    vector_extend_char(&expr, "sin(1 + ", 8);
+  }
+  vector_push_char(&expr, '2');
+  for (size_t i = 0; i < depth; i++) {
+    vector_push_char(&expr, ')');
+  }
+  vector_push_char(&expr, '\0');
+  return expr.buf;
+}
+
+static void print_results(void) {
+  for (size_t i = 0; i < suite.len; i++) {
+    const struct bench_result *r = &suite.results[i];
+    printf("%-24s %12.1f ns/op %8.2f allocs/op %12.0f ops/s", r->name,
+           r->ns_per_op, r->allocs_per_op, 1e9 / r->ns_per_op);
+    if (r->bytes_per_op > 0) {
+      printf(" %9.1f MB/s", r->bytes_per_op / r->ns_per_op * 1e3);
+    }
+    printf("\n");
+  }
+}
+
+/* One result per line, so the baseline can be read back without a JSON
+ * parser */
+static bool write_json(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  fprintf(f, "{\"batch_isa\":\"%s\",\"results\":[\n", batch_isa());
+  for (size_t i = 0; i < suite.len; i++) {
+    const struct bench_result *r = &suite.results[i];
+    fprintf(f,
+            "{\"name\":\"%s\",\"ns_per_op\":%.3f,\"allocs_per_op\":%.3f,"
+            "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f,\"iterations\":%zu}"
+            "%s\n",
+            r->name, r->ns_per_op, r->allocs_per_op, 1e9 / r->ns_per_op,
+            r->bytes_per_op * 1e9 / r->ns_per_op, r->iterations,
+            i + 1 < suite.len ? "," : "");
+  }
+  fprintf(f, "]}\n");
+  fclose(f);
+  return true;
+}
+
+static const struct bench_result *find_result(const char *name) {
+  for (size_t i = 0; i < suite.len; i++) {
+    if (strcmp(suite.results[i].name, name) == 0) {
+      return &suite.results[i];
+    }
+  }
+  return NULL;
+}
+
+/* Returns the number of regressions. Only benchmarks present in both runs
+ * are compared. */
+static size_t compare_baseline(const char *path, double threshold) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    printf("\nNo baseline at %s, run `make bench_baseline` to record one\n",
+           path);
+    return 0;
+  }
+
+  printf("\nCompared to %s (regression threshold %.0f%%):\n", path,
+         threshold * 100);
+  size_t regressions = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    struct bench_result base;
+    if (sscanf(line, "{\"name\":\"%63[^\"]\",\"ns_per_op\":%lf,"
+                     "\"allocs_per_op\":%lf",
+               base.name, &base.ns_per_op, &base.allocs_per_op) != 3) {
+      continue;
+    }
+    const struct bench_result *r = find_result(base.name);
+    if (r == NULL) {
+      continue;
+    }
+    double change = r->ns_per_op / base.ns_per_op - 1;
+    /* Allocation counts are deterministic, any increase is a regression */
+    bool more_allocs = r->allocs_per_op > base.allocs_per_op + 0.01;
+    bool slower = change > threshold;
+    printf("%-24s %+7.1f%% time %8.2f -> %8.2f allocs/op%s\n", r->name,
+           change * 100, base.allocs_per_op, r->allocs_per_op,
+           slower || more_allocs ? "  REGRESSION" : "");
+    regressions += slower || more_allocs;
+  }
+  fclose(f);
+  return regressions;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [--json FILE] [--baseline FILE] [--threshold PERCENT] "
+          "[--filter SUBSTRING] [--strict]\n",
+          argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *json_path = NULL;
+  const char *baseline_path = NULL;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  /* Fail the run on regressions, timings on a busy machine are noisy so this
+   * is opt-in */
+  bool strict = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--strict") == 0) {
+      strict = true;
+    } else if (i + 1 == argc) {
+      usage(argv[0]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      threshold = atof(argv[++i]) / 100;
+    } else if (strcmp(argv[i], "--filter") == 0) {
+      suite.filter = argv[++i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  char short_expr[] = "1 + 2 * 3";
+  char funcs_expr[] = "sqrt(2) * sin(1) + max(3, 4) ^ 2 / hypot(3, 4)";
+  char int_expr[] = "2 ^ 40 * 3 - 7 * (12345 + 678) / 3";
+  char big_expr[] = "2 ^ 4000 * 3 ^ 2000 - 7 ^ 1000 / 49";
+  char *nested_expr = make_nested_expression(64);
+  char *long_expr = make_long_expression(200);
+  bench_expression("short", short_expr);
+  bench_expression("funcs", funcs_expr);
+  bench_expression("int", int_expr);
+  bench_expression("big", big_expr);
+  bench_expression("nested", nested_expr);
+  bench_expression("long", long_expr);
+  free_checked(nested_expr);
+  free_checked(long_expr);
+
+  char poly_expr[] = "x ^ 2 - 2 * x + 1";
+  char arith_expr[] = "(3 * x * x - 2 * x + 1) / (x * x + 1) + abs(x)";
+  char trig_expr[] = "sin(x) * cos(2 * x) + sqrt(abs(x))";
+  bench_batch("batch/poly", poly_expr);
+  bench_batch("batch/arith", arith_expr);
+  bench_batch("batch/trig", trig_expr);
+
+  bench_conversion();
+  bench_vector();
+
+  char single_plot[] = "sin(x)";
+  char multi_plot[] = "sin(x), cos(x), x ** 2 / 10, tan(x)";
+  bench("plot/single", run_plot_render, single_plot, 0);
+  bench("plot/multi", run_plot_render, multi_plot, 0);
+  bench_gnuplot("gnuplot/single", "sin(x)");
+
+  bench_pipe("pipe/byte_reads_8k", 8 * 1024, true);
+  bench_pipe("pipe/reader_8k", 8 * 1024, false);
+  bench_pipe("pipe/reader_1m", 1024 * 1024, false);
+
+  metrics_cleanup();
+
+  print_results();
+  if (json_path != NULL && !write_json(json_path)) {
+    return EXIT_FAILURE;
+  }
+  size_t regressions =
+      baseline_path != NULL ? compare_baseline(baseline_path, threshold) : 0;
+  if (regressions > 0) {
+    printf("%zu regression%s\n", regressions, regressions > 1 ? "s" : "");
+  }
+  return strict && regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,964 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "include/bignum.h"
+#include "include/mem.h"
+#include "include/vector.h"
+
+typedef unsigned __int128 dlimb;
+
+/* Enough levels of powers of the base for numbers of 2^48 limbs */
+#define RADIX_MAX_LEVELS 48
+
+static const char digit_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+/* Digit values plus one, everything else is 0 and so out of range for any
+ * base once one is subtracted */
+static const uint8_t digit_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7,
+    ['7'] = 8, ['8'] = 9, ['9'] = 10, ['A'] = 11, ['B'] = 12, ['C'] = 13,
+    ['D'] = 14, ['E'] = 15, ['F'] = 16, ['G'] = 17, ['H'] = 18, ['I'] = 19,
+    ['J'] = 20, ['K'] = 21, ['L'] = 22, ['M'] = 23, ['N'] = 24, ['O'] = 25,
+    ['P'] = 26, ['Q'] = 27, ['R'] = 28, ['S'] = 29, ['T'] = 30, ['U'] = 31,
+    ['V'] = 32, ['W'] = 33, ['X'] = 34, ['Y'] = 35, ['Z'] = 36, ['a'] = 11,
+    ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['g'] = 17,
+    ['h'] = 18, ['i'] = 19, ['j'] = 20, ['k'] = 21, ['l'] = 22, ['m'] = 23,
+    ['n'] = 24, ['o'] = 25, ['p'] = 26, ['q'] = 27, ['r'] = 28, ['s'] = 29,
+    ['t'] = 30, ['u'] = 31, ['v'] = 32, ['w'] = 33, ['x'] = 34, ['y'] = 35,
+    ['z'] = 36,
+};
+
+static void reserve(struct bignum *n, size_t cap) {
+  if (cap > n->cap) {
+    n->limbs = realloc_checked(n->limbs, cap * sizeof(uint64_t));
+    n->cap = cap;
+  }
+}
+
+static void normalize(struct bignum *n) {
+  while (n->len > 0 && n->limbs[n->len - 1] == 0) {
+    n->len--;
+  }
+  if (n->len == 0) {
+    n->negative = false;
+  }
+}
+
+static bool is_one(const struct bignum *n) {
+  return n->len == 1 && n->limbs[0] == 1 && !n->negative;
+}
+
+static int cmp_raw(const uint64_t *a, size_t an, const uint64_t *b,
+                   size_t bn) {
+  if (an != bn) {
+    return an < bn ? -1 : 1;
+  }
+  for (size_t i = an; i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* r = a + b for an >= bn, returns the carry out of `r[an - 1]`. `r` may
+ * alias `a`. */
+static uint64_t add_raw(uint64_t *r, const uint64_t *a, size_t an,
+                        const uint64_t *b, size_t bn) {
+  uint64_t carry = 0;
+  size_t i = 0;
+  for (; i < bn; i++) {
+    dlimb sum = (dlimb)a[i] + b[i] + carry;
+    r[i] = (uint64_t)sum;
+    carry = (uint64_t)(sum >> 64);
+  }
+  for (; i < an; i++) {
+    uint64_t sum = a[i] + carry;
+    carry = sum < carry;
+    r[i] = sum;
+  }
+  return carry;
+}
+
+/* r = a - b for a >= b, `r` may alias `a` */
+static void sub_raw(uint64_t *r, const uint64_t *a, size_t an,
+                    const uint64_t *b, size_t bn) {
+  uint64_t borrow = 0;
+  size_t i = 0;
+  for (; i < bn; i++) {
+    uint64_t diff = a[i] - b[i];
+    uint64_t wrapped = a[i] < b[i];
+    r[i] = diff - borrow;
+    borrow = wrapped | (diff < borrow);
+  }
+  for (; i < an; i++) {
+    uint64_t diff = a[i] - borrow;
+    borrow = a[i] < borrow;
+    r[i] = diff;
+  }
+}
+
+/* a = a * m + add over `n` limbs, returns the limb carried out */
+static uint64_t mul_add_1(uint64_t *a, size_t n, uint64_t m, uint64_t add) {
+  uint64_t carry = add;
+  for (size_t i = 0; i < n; i++) {
+    dlimb product = (dlimb)a[i] * m + carry;
+    a[i] = (uint64_t)product;
+    carry = (uint64_t)(product >> 64);
+  }
+  return carry;
+}
+
+/* a /= d over `n` limbs, returns the remainder */
+static uint64_t div_1(uint64_t *a, size_t n, uint64_t d) {
+  dlimb rem = 0;
+  for (size_t i = n; i-- > 0;) {
+    dlimb cur = rem << 64 | a[i];
+    a[i] = (uint64_t)(cur / d);
+    rem = cur % d;
+  }
+  return (uint64_t)rem;
+}
+
+/* Shifts by `s` < 64 bits, returns the bits shifted out of the top limb.
+ * `n` must not be 0. */
+static uint64_t shl_raw(uint64_t *r, const uint64_t *a, size_t n, int s) {
+  if (s == 0) {
+    memmove(r, a, n * sizeof(uint64_t));
+    return 0;
+  }
+  uint64_t out = a[n - 1] >> (64 - s);
+  for (size_t i = n - 1; i > 0; i--) {
+    r[i] = a[i] << s | a[i - 1] >> (64 - s);
+  }
+  r[0] = a[0] << s;
+  return out;
+}
+
+static void shr_raw(uint64_t *r, const uint64_t *a, size_t n, int s) {
+  if (s == 0) {
+    memmove(r, a, n * sizeof(uint64_t));
+    return;
+  }
+  for (size_t i = 0; i + 1 < n; i++) {
+    r[i] = a[i] >> s | a[i + 1] << (64 - s);
+  }
+  r[n - 1] = a[n - 1] >> s;
+}
+
+/* `r` holds an + bn limbs and aliases neither operand */
+static void mul_basecase(uint64_t *r, const uint64_t *a, size_t an,
+                         const uint64_t *b, size_t bn) {
+  memset(r, 0, (an + bn) * sizeof(uint64_t));
+  for (size_t j = 0; j < bn; j++) {
+    uint64_t carry = 0;
+    for (size_t i = 0; i < an; i++) {
+      dlimb product = (dlimb)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (uint64_t)product;
+      carry = (uint64_t)(product >> 64);
+    }
+    r[j + an] = carry;
+  }
+}
+
+static void mul_raw(uint64_t *r, const uint64_t *a, size_t an,
+                    const uint64_t *b, size_t bn);
+
+static void mul_any(uint64_t *r, const uint64_t *a, size_t an,
+                    const uint64_t *b, size_t bn) {
+  if (an >= bn) {
+    mul_raw(r, a, an, b, bn);
+  } else {
+    mul_raw(r, b, bn, a, an);
+  }
+}
+
+/* Same contract as `mul_basecase()`, with an >= bn */
+static void mul_raw(uint64_t *r, const uint64_t *a, size_t an,
+                    const uint64_t *b, size_t bn) {
+  if (bn < BIGNUM_KARATSUBA_THRESHOLD) {
+    mul_basecase(r, a, an, b, bn);
+    return;
+  }
+
+  if (an >= 2 * bn) {
+    /* Too unbalanced to split evenly, `a` is cut into pieces the size of
+     * `b` instead */
+    memset(r, 0, (an + bn) * sizeof(uint64_t));
+    uint64_t *piece = malloc_checked(2 * bn * sizeof(uint64_t));
+    for (size_t i = 0; i < an; i += bn) {
+      size_t n = an - i < bn ? an - i : bn;
+      mul_any(piece, a + i, n, b, bn);
+      add_raw(r + i, r + i, an + bn - i, piece, n + bn);
+    }
+    free_checked(piece);
+    return;
+  }
+
+  /* With a = a1 B^m + a0 and b = b1 B^m + b0 the middle term a0 b1 + a1 b0
+   * is (a0 + a1)(b0 + b1) - a0 b0 - a1 b1, three products instead of four.
+   * Since an < 2 bn, `b1` isn't empty. */
+  size_t m = an / 2;
+  size_t a1n = an - m;
+  size_t b1n = bn - m;
+  mul_raw(r, a, m, b, m);
+  mul_any(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  size_t sa_n = a1n + 1;
+  size_t sb_n = (b1n > m ? b1n : m) + 1;
+  uint64_t *sa = malloc_checked(2 * (sa_n + sb_n) * sizeof(uint64_t));
+  uint64_t *sb = sa + sa_n;
+  uint64_t *mid = sb + sb_n;
+  sa[a1n] = add_raw(sa, a + m, a1n, a, m);
+  if (b1n >= m) {
+    sb[b1n] = add_raw(sb, b + m, b1n, b, m);
+  } else {
+    sb[m] = add_raw(sb, b, m, b + m, b1n);
+  }
+  mul_any(mid, sa, sa_n, sb, sb_n);
+
+  size_t mid_n = sa_n + sb_n;
+  sub_raw(mid, mid, mid_n, r, 2 * m);
+  sub_raw(mid, mid, mid_n, r + 2 * m, an + bn - 2 * m);
+  while (mid_n > 0 && mid[mid_n - 1] == 0) {
+    mid_n--;
+  }
+  add_raw(r + m, r + m, an + bn - m, mid, mid_n);
+  free_checked(sa);
+}
+
+/* Knuth's algorithm D for an >= bn >= 2. `q` holds an - bn + 1 limbs and `r`
+ * holds bn. */
+static void divmod_raw(uint64_t *q, uint64_t *r, const uint64_t *a, size_t an,
+                       const uint64_t *b, size_t bn) {
+  /* With the top bit of the divisor set, the estimated quotient digit is at
+   * most 2 too large */
+  int s = __builtin_clzll(b[bn - 1]);
+  uint64_t *un = malloc_checked((an + 1 + bn) * sizeof(uint64_t));
+  uint64_t *vn = un + an + 1;
+  shl_raw(vn, b, bn, s);
+  un[an] = shl_raw(un, a, an, s);
+  uint64_t d1 = vn[bn - 1];
+  uint64_t d0 = vn[bn - 2];
+
+  for (size_t j = an - bn + 1; j-- > 0;) {
+    uint64_t top = un[j + bn];
+    uint64_t next = un[j + bn - 1];
+    uint64_t qhat;
+    dlimb rhat;
+    if (top >= d1) {
+      qhat = UINT64_MAX;
+      rhat = (dlimb)next + d1;
+    } else {
+      dlimb num = (dlimb)top << 64 | next;
+      qhat = (uint64_t)(num / d1);
+      rhat = num % d1;
+    }
+    while (rhat >> 64 == 0 &&
+           (dlimb)qhat * d0 > (rhat << 64 | un[j + bn - 2])) {
+      qhat--;
+      rhat += d1;
+    }
+
+    uint64_t carry = 0;
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < bn; i++) {
+      dlimb product = (dlimb)qhat * vn[i] + carry;
+      carry = (uint64_t)(product >> 64);
+      uint64_t lo = (uint64_t)product;
+      uint64_t diff = un[i + j] - lo;
+      uint64_t wrapped = un[i + j] < lo;
+      un[i + j] = diff - borrow;
+      borrow = wrapped | (diff < borrow);
+    }
+    uint64_t diff = un[j + bn] - carry;
+    uint64_t wrapped = un[j + bn] < carry;
+    un[j + bn] = diff - borrow;
+    if (wrapped | (diff < borrow)) {
+      /* Rare, `qhat` was still one too large */
+      qhat--;
+      un[j + bn] += add_raw(un + j, un + j, bn, vn, bn);
+    }
+    q[j] = qhat;
+  }
+
+  shr_raw(r, un, bn, s);
+  free_checked(un);
+}
+
+void bignum_init(struct bignum *n) { *n = (struct bignum){0}; }
+
+void bignum_free(struct bignum *n) {
+  free_checked(n->limbs);
+  *n = (struct bignum){0};
+}
+
+void bignum_set_i64(struct bignum *n, int64_t value) {
+  reserve(n, 1);
+  n->limbs[0] = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  n->len = 1;
+  n->negative = value < 0;
+  normalize(n);
+}
+
+void bignum_copy(struct bignum *dst, const struct bignum *src) {
+  if (dst == src) {
+    return;
+  }
+  reserve(dst, src->len);
+  if (src->len > 0) {
+    memcpy(dst->limbs, src->limbs, src->len * sizeof(uint64_t));
+  }
+  dst->len = src->len;
+  dst->negative = src->negative;
+}
+
+void bignum_swap(struct bignum *a, struct bignum *b) {
+  struct bignum tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+bool bignum_to_i64(const struct bignum *n, int64_t *value) {
+  if (n->len == 0) {
+    *value = 0;
+    return true;
+  }
+  if (n->len > 1 || n->limbs[0] > (uint64_t)INT64_MAX + n->negative) {
+    return false;
+  }
+  *value = n->negative ? (int64_t)(0 - n->limbs[0]) : (int64_t)n->limbs[0];
+  return true;
+}
+
+size_t bignum_bits(const struct bignum *n) {
+  return n->len == 0
+             ? 0
+             : n->len * 64 - (size_t)__builtin_clzll(n->limbs[n->len - 1]);
+}
+
+int bignum_cmp(const struct bignum *a, const struct bignum *b) {
+  if (a->negative != b->negative) {
+    return a->negative ? -1 : 1;
+  }
+  int cmp = cmp_raw(a->limbs, a->len, b->limbs, b->len);
+  return a->negative ? -cmp : cmp;
+}
+
+static void add_signed(struct bignum *r, const struct bignum *a,
+                       const struct bignum *b, bool b_negative) {
+  struct bignum sum;
+  bignum_init(&sum);
+  if (a->negative == b_negative) {
+    const struct bignum *longer = a->len >= b->len ? a : b;
+    const struct bignum *shorter = longer == a ? b : a;
+    reserve(&sum, longer->len + 1);
+    sum.limbs[longer->len] = add_raw(sum.limbs, longer->limbs, longer->len,
+                                     shorter->limbs, shorter->len);
+    sum.len = longer->len + 1;
+    sum.negative = b_negative;
+  } else if (cmp_raw(a->limbs, a->len, b->limbs, b->len) >= 0) {
+    reserve(&sum, a->len);
+    sub_raw(sum.limbs, a->limbs, a->len, b->limbs, b->len);
+    sum.len = a->len;
+    sum.negative = a->negative;
+  } else {
+    reserve(&sum, b->len);
+    sub_raw(sum.limbs, b->limbs, b->len, a->limbs, a->len);
+    sum.len = b->len;
+    sum.negative = b_negative;
+  }
+  normalize(&sum);
+  bignum_swap(r, &sum);
+  bignum_free(&sum);
+}
+
+void bignum_add(struct bignum *r, const struct bignum *a,
+                const struct bignum *b) {
+  add_signed(r, a, b, b->negative);
+}
+
+void bignum_sub(struct bignum *r, const struct bignum *a,
+                const struct bignum *b) {
+  add_signed(r, a, b, b->len > 0 && !b->negative);
+}
+
+void bignum_mul(struct bignum *r, const struct bignum *a,
+                const struct bignum *b) {
+  struct bignum product;
+  bignum_init(&product);
+  if (a->len > 0 && b->len > 0) {
+    reserve(&product, a->len + b->len);
+    mul_any(product.limbs, a->limbs, a->len, b->limbs, b->len);
+    product.len = a->len + b->len;
+    product.negative = a->negative != b->negative;
+    normalize(&product);
+  }
+  bignum_swap(r, &product);
+  bignum_free(&product);
+}
+
+void bignum_divmod(struct bignum *q, struct bignum *r, const struct bignum *a,
+                   const struct bignum *b) {
+  struct bignum quot;
+  struct bignum rem;
+  bignum_init(&quot);
+  bignum_init(&rem);
+  if (cmp_raw(a->limbs, a->len, b->limbs, b->len) < 0) {
+    bignum_copy(&rem, a);
+  } else if (b->len == 1) {
+    bignum_copy(&quot, a);
+    uint64_t rest = div_1(quot.limbs, quot.len, b->limbs[0]);
+    reserve(&rem, 1);
+    rem.limbs[0] = rest;
+    rem.len = 1;
+  } else {
+    reserve(&quot, a->len - b->len + 1);
+    reserve(&rem, b->len);
+    divmod_raw(quot.limbs, rem.limbs, a->limbs, a->len, b->limbs, b->len);
+    quot.len = a->len - b->len + 1;
+    rem.len = b->len;
+  }
+  quot.negative = a->negative != b->negative;
+  rem.negative = a->negative;
+  normalize(&quot);
+  normalize(&rem);
+  if (q != NULL) {
+    bignum_swap(q, &quot);
+  }
+  if (r != NULL) {
+    bignum_swap(r, &rem);
+  }
+  bignum_free(&quot);
+  bignum_free(&rem);
+}
+
+void bignum_pow(struct bignum *r, const struct bignum *base, uint64_t exp) {
+  struct bignum result;
+  struct bignum square;
+  bignum_init(&result);
+  bignum_init(&square);
+  bignum_set_i64(&result, 1);
+  bignum_copy(&square, base);
+  while (exp > 0) {
+    if (exp & 1) {
+      bignum_mul(&result, &result, &square);
+    }
+    exp >>= 1;
+    if (exp > 0) {
+      bignum_mul(&square, &square, &square);
+    }
+  }
+  bignum_swap(r, &result);
+  bignum_free(&result);
+  bignum_free(&square);
+}
+
+void bignum_gcd(struct bignum *r, const struct bignum *a,
+                const struct bignum *b) {
+  struct bignum x;
+  struct bignum y;
+  bignum_init(&x);
+  bignum_init(&y);
+  bignum_copy(&x, a);
+  bignum_copy(&y, b);
+  x.negative = false;
+  y.negative = false;
+  while (y.len > 0) {
+    bignum_divmod(NULL, &x, &x, &y);
+    bignum_swap(&x, &y);
+  }
+  bignum_swap(r, &x);
+  bignum_free(&x);
+  bignum_free(&y);
+}
+
+static unsigned digit_value(char c) {
+  return (unsigned)digit_table[(unsigned char)c] - 1;
+}
+
+/* 8 characters at a time, the first one in the least significant byte */
+static uint64_t load_8(const char *str) {
+  uint64_t x;
+  memcpy(&x, str, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  return x;
+}
+
+static void store_8(char *str, uint64_t x) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  memcpy(str, &x, sizeof(x));
+}
+
+/* Returns false unless all 8 characters are decimal digits */
+static bool parse_8_digits(const char *str, uint64_t *value) {
+  uint64_t x = load_8(str);
+  /* Digits are 0x30 to 0x39, adding 6 carries anything above into the high
+   * nibble */
+  if (((x & 0xF0F0F0F0F0F0F0F0) |
+       (((x + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+      0x3333333333333333) {
+    return false;
+  }
+  x -= 0x3030303030303030;
+  /* Combines pairs of digits, then pairs of those and so on */
+  x = x * 10 + (x >> 8);
+  x = (((x & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+       (((x >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >>
+      32;
+  *value = x;
+  return true;
+}
+
+/* The 8 binary digits of `byte`, most significant first */
+static uint64_t format_8_bin(uint8_t byte) {
+  /* Byte i keeps bit i, which then becomes 0 or 1 */
+  uint64_t x = ((uint64_t)byte * 0x0101010101010101) & 0x8040201008040201;
+  x += 0x7F7F7F7F7F7F7F7F;
+  x = ((x >> 7) & 0x0101010101010101) | 0x3030303030303030;
+  return __builtin_bswap64(x);
+}
+
+/* The 8 hexadecimal digits of `word`, most significant first */
+static uint64_t format_8_hex(uint32_t word) {
+  /* Byte i gets nibble i */
+  uint64_t x = word;
+  x = (x | x << 16) & 0x0000FFFF0000FFFF;
+  x = (x | x << 8) & 0x00FF00FF00FF00FF;
+  x = (x | x << 4) & 0x0F0F0F0F0F0F0F0F;
+  /* Nibbles above 9 skip the 7 characters between '9' and 'A' */
+  x += 0x3030303030303030 + (((x + 0x0606060606060606) >> 4) &
+                              0x0101010101010101) *
+                                 7;
+  return __builtin_bswap64(x);
+}
+
+/* Digits are converted a limb at a time, `chunk` is the largest power of the
+ * base that fits in one and `powers[i]` is chunk^(2^i) */
+struct radix {
+  unsigned base;
+  uint64_t chunk;
+  size_t chunk_digits;
+  struct bignum powers[RADIX_MAX_LEVELS];
+  size_t levels;
+};
+
+static void radix_init(struct radix *radix, unsigned base) {
+  radix->base = base;
+  radix->chunk = base;
+  radix->chunk_digits = 1;
+  while (radix->chunk <= UINT64_MAX / base) {
+    radix->chunk *= base;
+    radix->chunk_digits++;
+  }
+  /* Short numbers never need the powers */
+  radix->levels = 0;
+}
+
+static const struct bignum *radix_power(struct radix *radix, size_t level) {
+  while (radix->levels <= level) {
+    struct bignum *next = &radix->powers[radix->levels];
+    bignum_init(next);
+    if (radix->levels == 0) {
+      reserve(next, 1);
+      next->limbs[0] = radix->chunk;
+      next->len = 1;
+    } else {
+      bignum_mul(next, &radix->powers[radix->levels - 1],
+                 &radix->powers[radix->levels - 1]);
+    }
+    radix->levels++;
+  }
+  return &radix->powers[level];
+}
+
+static void radix_free(struct radix *radix) {
+  for (size_t i = 0; i < radix->levels; i++) {
+    bignum_free(&radix->powers[i]);
+  }
+}
+
+static bool from_string_basecase(struct bignum *n, const char *str,
+                                 size_t len, const struct radix *radix) {
+  reserve(n, len / radix->chunk_digits + 1);
+  n->len = 0;
+  n->negative = false;
+  /* The first chunk takes whatever doesn't divide evenly */
+  size_t chunk_len = len % radix->chunk_digits;
+  if (chunk_len == 0) {
+    chunk_len = radix->chunk_digits;
+  }
+  for (size_t i = 0; i < len; i += chunk_len, chunk_len = radix->chunk_digits) {
+    uint64_t value = 0;
+    uint64_t scale = 1;
+    size_t j = i;
+    for (; radix->base == 10 && j + 8 <= i + chunk_len; j += 8) {
+      uint64_t digits;
+      if (!parse_8_digits(str + j, &digits)) {
+        return false;
+      }
+      value = value * 100000000 + digits;
+      scale *= 100000000;
+    }
+    for (; j < i + chunk_len; j++) {
+      unsigned digit = digit_value(str[j]);
+      if (digit >= radix->base) {
+        return false;
+      }
+      value = value * radix->base + digit;
+      scale *= radix->base;
+    }
+    uint64_t carry = mul_add_1(n->limbs, n->len, scale, value);
+    if (carry != 0) {
+      n->limbs[n->len++] = carry;
+    }
+  }
+  normalize(n);
+  return true;
+}
+
+static bool from_string_rec(struct bignum *n, const char *str, size_t len,
+                            struct radix *radix) {
+  if (len <= radix->chunk_digits * BIGNUM_RADIX_DC_THRESHOLD) {
+    return from_string_basecase(n, str, len, radix);
+  }
+
+  /* n = hi * chunk^(2^level) + lo, where `lo` is the last chunk_digits *
+   * 2^level digits. Karatsuba makes this faster than the quadratic
+   * digit-by-digit loop. */
+  size_t level = 0;
+  while ((radix->chunk_digits << (level + 1)) < len) {
+    level++;
+  }
+  size_t lo_len = radix->chunk_digits << level;
+  struct bignum lo;
+  bignum_init(&lo);
+  bool ok = from_string_rec(n, str, len - lo_len, radix) &&
+            from_string_rec(&lo, str + len - lo_len, lo_len, radix);
+  if (ok) {
+    bignum_mul(n, n, radix_power(radix, level));
+    bignum_add(n, n, &lo);
+  }
+  bignum_free(&lo);
+  return ok;
+}
+
+static bool from_string_pow2(struct bignum *n, const char *str, size_t len,
+                             unsigned base) {
+  unsigned bits = (unsigned)__builtin_ctz(base);
+  reserve(n, (len * bits + 63) / 64);
+  n->len = (len * bits + 63) / 64;
+  n->negative = false;
+  /* Invalid digits are only checked for at the end, the loops don't branch
+   * on the input */
+  bool invalid = false;
+  if (64 % bits == 0) {
+    /* Every limb is made of whole digits */
+    size_t per_limb = 64 / bits;
+    for (size_t l = 0; l < n->len; l++) {
+      size_t end = len - l * per_limb;
+      uint64_t limb = 0;
+      for (size_t j = end > per_limb ? end - per_limb : 0; j < end; j++) {
+        unsigned digit = digit_value(str[j]);
+        invalid |= digit >= base;
+        limb = limb << bits | (digit & (base - 1));
+      }
+      n->limbs[l] = limb;
+    }
+  } else {
+    memset(n->limbs, 0, n->len * sizeof(uint64_t));
+    for (size_t i = 0; i < len; i++) {
+      unsigned digit = digit_value(str[len - 1 - i]);
+      invalid |= digit >= base;
+      digit &= base - 1;
+      size_t bit = i * bits;
+      n->limbs[bit / 64] |= (uint64_t)digit << (bit % 64);
+      if (bit % 64 + bits > 64) {
+        n->limbs[bit / 64 + 1] |= (uint64_t)digit >> (64 - bit % 64);
+      }
+    }
+  }
+  normalize(n);
+  return !invalid;
+}
+
+bool bignum_from_string(struct bignum *n, const char *str, size_t len,
+                        unsigned base) {
+  if (len == 0) {
+    return false;
+  }
+  if ((base & (base - 1)) == 0) {
+    return from_string_pow2(n, str, len, base);
+  }
+  struct radix radix;
+  radix_init(&radix, base);
+  bool ok = from_string_rec(n, str, len, &radix);
+  radix_free(&radix);
+  return ok;
+}
+
+/* Appends the digits of the magnitude of `limbs`, zero padded to `width`
+ * unless that is 0 */
+static void to_string_basecase(const uint64_t *limbs, size_t len, size_t width,
+                               const struct radix *radix,
+                               struct vector_char *out) {
+  uint64_t *rest = malloc_checked((len > 0 ? len : 1) * sizeof(uint64_t));
+  if (len > 0) {
+    memcpy(rest, limbs, len * sizeof(uint64_t));
+  }
+  /* A chunk holds more than 32 bits, so there are at most two per limb */
+  size_t cap = (2 * len + 1) * radix->chunk_digits + width;
+  char *reversed = malloc_checked(cap);
+  size_t n = 0;
+  while (len > 0) {
+    uint64_t chunk = div_1(rest, len, radix->chunk);
+    while (len > 0 && rest[len - 1] == 0) {
+      len--;
+    }
+    for (size_t i = 0; i < radix->chunk_digits; i++) {
+      reversed[n++] = digit_chars[chunk % radix->base];
+      chunk /= radix->base;
+    }
+  }
+  /* The last chunk was padded as well */
+  while (n > width && n > 0 && reversed[n - 1] == '0') {
+    n--;
+  }
+  while (n < width) {
+    reversed[n++] = '0';
+  }
+  vector_reserve_char(out, out->len + n);
+  for (size_t i = 0; i < n; i++) {
+    out->buf[out->len + i] = reversed[n - 1 - i];
+  }
+  out->len += n;
+  free_checked(reversed);
+  free_checked(rest);
+}
+
+static void to_string_rec(const struct bignum *n, size_t width,
+                          struct radix *radix, struct vector_char *out) {
+  if (n->len <= BIGNUM_RADIX_DC_THRESHOLD) {
+    to_string_basecase(n->limbs, n->len, width, radix, out);
+    return;
+  }
+
+  /* Splits at the largest power that is about the square root of `n`, the
+   * halves are converted independently */
+  size_t level = 0;
+  while (radix_power(radix, level)->len * 4 - 1 <= n->len) {
+    level++;
+  }
+  struct bignum hi;
+  struct bignum lo;
+  bignum_init(&hi);
+  bignum_init(&lo);
+  bignum_divmod(&hi, &lo, n, radix_power(radix, level));
+  size_t lo_width = radix->chunk_digits << level;
+  to_string_rec(&hi, width > lo_width ? width - lo_width : 0, radix, out);
+  to_string_rec(&lo, lo_width, radix, out);
+  bignum_free(&hi);
+  bignum_free(&lo);
+}
+
+static void to_string_pow2(const struct bignum *n, unsigned base,
+                           struct vector_char *out) {
+  unsigned bits = (unsigned)__builtin_ctz(base);
+  size_t n_digits = (bignum_bits(n) + bits - 1) / bits;
+  vector_reserve_char(out, out->len + n_digits);
+  /* Binary and hexadecimal limbs below the top one are formatted 8 digits at
+   * a time */
+  bool packed = base == 2 || base == 16;
+  size_t low_digits = packed ? (n->len - 1) * 64 / bits : 0;
+  for (size_t i = n_digits; i-- > low_digits;) {
+    size_t bit = i * bits;
+    uint64_t digit = n->limbs[bit / 64] >> (bit % 64);
+    if (bit % 64 + bits > 64 && bit / 64 + 1 < n->len) {
+      digit |= n->limbs[bit / 64 + 1] << (64 - bit % 64);
+    }
+    out->buf[out->len++] = digit_chars[digit & (base - 1)];
+  }
+  for (size_t l = low_digits > 0 ? n->len - 1 : 0; l-- > 0;) {
+    uint64_t limb = n->limbs[l];
+    if (base == 16) {
+      store_8(out->buf + out->len, format_8_hex((uint32_t)(limb >> 32)));
+      store_8(out->buf + out->len + 8, format_8_hex((uint32_t)limb));
+      out->len += 16;
+      continue;
+    }
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      store_8(out->buf + out->len, format_8_bin((uint8_t)(limb >> shift)));
+      out->len += 8;
+    }
+  }
+}
+
+void bignum_to_string(const struct bignum *n, unsigned base,
+                      struct vector_char *out) {
+  if (n->len == 0) {
+    vector_push_char(out, '0');
+    return;
+  }
+  if (n->negative) {
+    vector_push_char(out, '-');
+  }
+  if ((base & (base - 1)) == 0) {
+    to_string_pow2(n, base, out);
+    return;
+  }
+  struct bignum magnitude = *n;
+  magnitude.negative = false;
+  struct radix radix;
+  radix_init(&radix, base);
+  to_string_rec(&magnitude, 0, &radix, out);
+  radix_free(&radix);
+}
+
+void bigrat_init(struct bigrat *q) {
+  bignum_init(&q->num);
+  bignum_init(&q->den);
+  bignum_set_i64(&q->den, 1);
+}
+
+void bigrat_free(struct bigrat *q) {
+  bignum_free(&q->num);
+  bignum_free(&q->den);
+}
+
+void bigrat_set_i64(struct bigrat *q, int64_t value) {
+  bignum_set_i64(&q->num, value);
+  bignum_set_i64(&q->den, 1);
+}
+
+static void reduce(struct bigrat *q) {
+  if (is_one(&q->den)) {
+    return;
+  }
+  struct bignum gcd;
+  bignum_init(&gcd);
+  bignum_gcd(&gcd, &q->num, &q->den);
+  if (!is_one(&gcd)) {
+    bignum_divmod(&q->num, NULL, &q->num, &gcd);
+    bignum_divmod(&q->den, NULL, &q->den, &gcd);
+  }
+  bignum_free(&gcd);
+}
+
+bool bigrat_from_decimal(struct bigrat *q, const char *str, size_t len) {
+  const char *dot = memchr(str, '.', len);
+  size_t whole_len = dot != NULL ? (size_t)(dot - str) : len;
+  size_t frac_len = dot != NULL ? len - whole_len - 1 : 0;
+  struct bignum frac;
+  bignum_init(&frac);
+  bool ok =
+      (whole_len == 0 || bignum_from_string(&q->num, str, whole_len, 10)) &&
+      (frac_len == 0 || bignum_from_string(&frac, dot + 1, frac_len, 10));
+  if (ok) {
+    if (whole_len == 0) {
+      bignum_set_i64(&q->num, 0);
+    }
+    /* whole + frac / 10^frac_len */
+    struct bignum ten;
+    bignum_init(&ten);
+    bignum_set_i64(&ten, 10);
+    bignum_pow(&q->den, &ten, frac_len);
+    bignum_mul(&q->num, &q->num, &q->den);
+    bignum_add(&q->num, &q->num, &frac);
+    bignum_free(&ten);
+    reduce(q);
+  }
+  bignum_free(&frac);
+  return ok;
+}
+
+bool bigrat_is_integer(const struct bigrat *q) { return is_one(&q->den); }
+
+static void add_fractions(struct bigrat *r, const struct bigrat *a,
+                          const struct bigrat *b, bool subtract) {
+  void (*op)(struct bignum *, const struct bignum *, const struct bignum *) =
+      subtract ? bignum_sub : bignum_add;
+  if (is_one(&a->den) && is_one(&b->den)) {
+    op(&r->num, &a->num, &b->num);
+    bignum_set_i64(&r->den, 1);
+    return;
+  }
+  struct bignum num;
+  struct bignum scaled;
+  bignum_init(&num);
+  bignum_init(&scaled);
+  bignum_mul(&num, &a->num, &b->den);
+  bignum_mul(&scaled, &b->num, &a->den);
+  op(&num, &num, &scaled);
+  bignum_mul(&r->den, &a->den, &b->den);
+  bignum_swap(&r->num, &num);
+  reduce(r);
+  bignum_free(&num);
+  bignum_free(&scaled);
+}
+
+void bigrat_add(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b) {
+  add_fractions(r, a, b, false);
+}
+
+void bigrat_sub(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b) {
+  add_fractions(r, a, b, true);
+}
+
+void bigrat_mul(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b) {
+  bool integers = is_one(&a->den) && is_one(&b->den);
+  bignum_mul(&r->num, &a->num, &b->num);
+  bignum_mul(&r->den, &a->den, &b->den);
+  if (!integers) {
+    reduce(r);
+  }
+}
+
+bool bigrat_div(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b) {
+  if (b->num.len == 0) {
+    return false;
+  }
+  struct bignum num;
+  bignum_init(&num);
+  bignum_mul(&num, &a->num, &b->den);
+  bignum_mul(&r->den, &a->den, &b->num);
+  bignum_swap(&r->num, &num);
+  bignum_free(&num);
+  if (r->den.negative) {
+    r->den.negative = false;
+    r->num.negative = r->num.len > 0 && !r->num.negative;
+  }
+  reduce(r);
+  return true;
+}
+
+bool bigrat_pow(struct bigrat *r, const struct bigrat *base, int64_t exp) {
+  uint64_t magnitude = exp < 0 ? -(uint64_t)exp : (uint64_t)exp;
+  if (exp >= 0) {
+    bignum_pow(&r->num, &base->num, magnitude);
+    bignum_pow(&r->den, &base->den, magnitude);
+    return true;
+  }
+  if (base->num.len == 0) {
+    return false;
+  }
+  /* Powers of coprime numbers stay coprime, so there's nothing to reduce */
+  struct bignum num;
+  bignum_init(&num);
+  bignum_pow(&num, &base->den, magnitude);
+  bignum_pow(&r->den, &base->num, magnitude);
+  bignum_swap(&r->num, &num);
+  bignum_free(&num);
+  if (r->den.negative) {
+    r->den.negative = false;
+    r->num.negative = r->num.len > 0;
+  }
+  return true;
+}
@@ -0,0 +1,258 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/calc_cache.h"
+#include "include/mem.h"
+#include "include/parser.h"
+
+struct calc_cache_entry {
+  char *key;
+  uint64_t hash;
+  struct calc_cache_value value;
+  /* Bucket chain */
+  struct calc_cache_entry *next_in_bucket;
+  /* LRU list, most recently used first */
+  struct calc_cache_entry *prev;
+  struct calc_cache_entry *next;
+};
+
+static struct {
+  struct calc_cache_entry **buckets;
+  size_t n_buckets;
+  struct calc_cache_entry *head;
+  struct calc_cache_entry *tail;
+  struct calc_cache_stats stats;
+  /* Held for every operation, lookups reorder the LRU list */
+  pthread_mutex_t lock;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t hash_key(const char *key) {
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*key != '\0') {
+    hash ^= (unsigned char)*key++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static inline bool is_word_char(char c) {
+  return isalnum((unsigned char)c) || c == '.';
+}
+
+/* Whether dropping the whitespace between the lexeme ending in `last` and the
+ * text starting with `next` would change how it lexes. Names only call a
+ * function when `(` follows right after them, and `* *` is not `**`. */
+static bool needs_separator(char first, char last, char next) {
+  return (is_word_char(last) && is_word_char(next)) ||
+         (last == '*' && next == '*') ||
+         (isalpha((unsigned char)first) && next == '(');
+}
+
+char *calc_cache_normalize(const char *expr, struct arena *arena) {
+  size_t size = strlen(expr) + 1;
+  char *normalized =
+      arena != NULL ? arena_alloc(arena, size) : malloc_checked(size);
+  size_t len = 0;
+  size_t prev_end = 0;
+  char first = '\0';
+
+  struct lexer lx;
+  lexer_init(&lx, expr);
+  for (;;) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    Lexeme lexeme = lexer_next(&lx, &error, &error_index);
+    if (lexeme.type == TT_EOF) {
+      break;
+    }
+
+    /* A separator is only kept where there was whitespace, so the key is
+     * never longer than `expr` */
+    if (len > 0 && lexeme.offset > prev_end &&
+        needs_separator(first, normalized[len - 1], expr[lexeme.offset])) {
+      normalized[len++] = ' ';
+    }
+    if (lexeme.type == TT_ERROR) {
+      /* Whatever the lexer can't read is kept as is, so text that fails to
+       * lex never shares a key with text that doesn't */
+      size_t rest = strlen(expr + lexeme.offset);
+      memcpy(normalized + len, expr + lexeme.offset, rest);
+      len += rest;
+      break;
+    }
+    memcpy(normalized + len, expr + lexeme.offset, lexeme.len);
+    len += lexeme.len;
+    first = expr[lexeme.offset];
+    prev_end = lexeme.offset + lexeme.len;
+  }
+  normalized[len] = '\0';
+
+  return normalized;
+}
+
+void calc_cache_init(size_t capacity) {
+  pthread_mutex_lock(&cache.lock);
+  cache.stats = (struct calc_cache_stats){.capacity = capacity};
+  cache.head = NULL;
+  cache.tail = NULL;
+
+  /* Keep the load factor at or below 0.5 */
+  cache.n_buckets = 1;
+  while (cache.n_buckets < capacity * 2) {
+    cache.n_buckets <<= 1;
+  }
+  cache.buckets =
+      malloc_checked(sizeof(struct calc_cache_entry *) * cache.n_buckets);
+  memset(cache.buckets, 0, sizeof(struct calc_cache_entry *) * cache.n_buckets);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+static void value_free(struct calc_cache_value *value) {
+  free_checked(value->exact);
+  value->exact = NULL;
+}
+
+static void entry_free(struct calc_cache_entry *entry) {
+  value_free(&entry->value);
+  free_checked(entry->key);
+  free_checked(entry);
+}
+
+void calc_cache_cleanup(void) {
+  pthread_mutex_lock(&cache.lock);
+  struct calc_cache_entry *entry = cache.head;
+  while (entry != NULL) {
+    struct calc_cache_entry *next = entry->next;
+    entry_free(entry);
+    entry = next;
+  }
+  free_checked(cache.buckets);
+  cache.buckets = NULL;
+  cache.n_buckets = 0;
+  cache.head = NULL;
+  cache.tail = NULL;
+  cache.stats.len = 0;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+static void lru_unlink(struct calc_cache_entry *entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache.head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache.tail = entry->prev;
+  }
+}
+
+static void lru_push_front(struct calc_cache_entry *entry) {
+  entry->prev = NULL;
+  entry->next = cache.head;
+  if (cache.head != NULL) {
+    cache.head->prev = entry;
+  }
+  cache.head = entry;
+  if (cache.tail == NULL) {
+    cache.tail = entry;
+  }
+}
+
+static void bucket_remove(struct calc_cache_entry *entry) {
+  struct calc_cache_entry **link =
+      &cache.buckets[entry->hash & (cache.n_buckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->next_in_bucket;
+  }
+  *link = entry->next_in_bucket;
+}
+
+static struct calc_cache_entry *find(const char *key, uint64_t hash) {
+  struct calc_cache_entry *entry = cache.buckets[hash & (cache.n_buckets - 1)];
+  while (entry != NULL) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+    entry = entry->next_in_bucket;
+  }
+  return NULL;
+}
+
+bool calc_cache_lookup(const char *key, struct calc_cache_value *value) {
+  pthread_mutex_lock(&cache.lock);
+  struct calc_cache_entry *entry =
+      cache.stats.capacity > 0 ? find(key, hash_key(key)) : NULL;
+  if (entry == NULL) {
+    cache.stats.misses++;
+    pthread_mutex_unlock(&cache.lock);
+    return false;
+  }
+
+  cache.stats.hits++;
+  if (entry != cache.head) {
+    lru_unlink(entry);
+    lru_push_front(entry);
+  }
+  *value = entry->value;
+  if (value->exact != NULL) {
+    value->exact = malloc_checked(strlen(entry->value.exact) + 1);
+    strcpy(value->exact, entry->value.exact);
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return true;
+}
+
+void calc_cache_insert(const char *key, struct calc_cache_value *value) {
+  if (cache.stats.capacity == 0) {
+    value_free(value);
+    return;
+  }
+
+  uint64_t hash = hash_key(key);
+  pthread_mutex_lock(&cache.lock);
+  struct calc_cache_entry *entry = find(key, hash);
+  if (entry != NULL) {
+    value_free(&entry->value);
+    entry->value = *value;
+    lru_unlink(entry);
+    lru_push_front(entry);
+    pthread_mutex_unlock(&cache.lock);
+    return;
+  }
+
+  if (cache.stats.len >= cache.stats.capacity) {
+    struct calc_cache_entry *victim = cache.tail;
+    lru_unlink(victim);
+    bucket_remove(victim);
+    entry_free(victim);
+    cache.stats.len--;
+    cache.stats.evictions++;
+  }
+
+  entry = malloc_checked(sizeof(struct calc_cache_entry));
+  entry->key = malloc_checked(strlen(key) + 1);
+  strcpy(entry->key, key);
+  entry->hash = hash;
+  entry->value = *value;
+
+  size_t bucket = hash & (cache.n_buckets - 1);
+  entry->next_in_bucket = cache.buckets[bucket];
+  cache.buckets[bucket] = entry;
+  lru_push_front(entry);
+  cache.stats.len++;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+struct calc_cache_stats calc_cache_get_stats(void) {
+  pthread_mutex_lock(&cache.lock);
+  struct calc_cache_stats stats = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+  return stats;
+}
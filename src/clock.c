@@ -0,0 +1,10 @@
+#define _GNU_SOURCE
+#include <time.h>
+
+#include "include/clock.h"
+
+uint64_t clock_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
@@ -1,56 +1,137 @@
 #define _GNU_SOURCE
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <concord/discord.h>
 #include <concord/log.h>
 
+#include "include/bignum.h"
+#include "include/calc_cache.h"
+#include "include/clock.h"
 #include "include/command.h"
 #include "include/conversion.h"
 #include "include/evaluator.h"
 #include "include/gnuplot.h"
+#include "include/mem.h"
+#include "include/metrics.h"
 #include "include/parser.h"
+#include "include/plot.h"
+#include "include/plot_cache.h"
+#include "include/trace.h"
 #include "include/vector.h"
+#include "include/vm.h"
+
+#define CALC_ARENA_SIZE 4096
+#define MEMORY_LIMIT_REPLY "That needs too much memory, try something smaller"
+/* Discord rejects messages over 2000 characters, the middle of longer
+ * numbers is cut out */
+#define REPLY_MAX_DIGITS 1800
+/* Replies to several conversions only echo this much of every input */
+#define REPLY_ECHO_DIGITS 40
+#define EXACT_PREFIX "exact "
 
 const struct Command commands[N_COMMANDS] = {
     {.longf = "calc",
      .shortf = "c",
      .description =
-         "`<expression>`. Caluclate an expression e.g. `+calc 10 / 5`. "
-         "Supports `+-*/^` and these functions: [`sqrt`, `sin`, `tan`, `cos`]",
-     .callback = &on_calc},
+         "`<expression>`. Caluclate an expression e.g. `+calc 10 / 5` or "
+         "`+calc max(2, 3)`. Integers have arbitrary precision, "
+         "`+calc exact 1/3 + 1/6` keeps fractions exact too. Supports "
+         "`+-*/^`, the constants `pi` and `e` and these functions:"
+#define FUNCTION(__name, __tt, __arity, __expr) " `" #__name "`"
+#include "include/functions.def"
+#undef FUNCTION
+     ,
+     .callback = &on_calc,
+     .class = CC_COMPUTE,
+     .cost = 1},
     {.longf = "ping",
      .shortf = "p",
      .description = "Show the bots latency",
-     .callback = &on_ping},
+     .callback = &on_ping,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
     {.longf = "plot",
      .shortf = "pl",
      .description = "`<expression>`. Plot a function e.g. `+plot x**2` or "
                     "multiple functions: `+plot log10(pi * x), sin(x)`",
-     .callback = &on_plot},
+     .callback = &on_plot,
+     .class = CC_RENDER,
+     .cost = 5},
     {.longf = "tobin",
      .shortf = "tb",
-     .description = "`<number>` Convert `<number>` to binary representation",
-     .callback = &on_tobin},
+     .description = "`<numbers>` Convert numbers of any size to binary "
+                    "representation e.g. `+tobin 42 0xFF 36#ZZ`",
+     .callback = &on_tobin,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
     {.longf = "tohex",
      .shortf = "th",
-     .description = "`<number>` Convert `<number>` to hexadecimal representation",
-     .callback = &on_tohex},
+     .description = "`<numbers>` Convert numbers of any size to "
+                    "hexadecimal representation",
+     .callback = &on_tohex,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
     {.longf = "todec",
      .shortf = "td",
-     .description = "`<number>` Convert `<number>` to decimal representation",
-     .callback = &on_todec},
+     .description = "`<numbers>` Convert numbers of any size to decimal "
+                    "representation",
+     .callback = &on_todec,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
+    {.longf = "tobase",
+     .shortf = "to",
+     .description = "`<base> <numbers>` Convert numbers of any size to "
+                    "`<base>`, 2 to 36, e.g. `+tobase 36 1295`",
+     .callback = &on_tobase,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
     {.longf = "why",
      .shortf = "w",
      .description = "Describe why something is the way it is",
-     .callback = &on_why},
+     .callback = &on_why,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
+    {.longf = "stats",
+     .shortf = "st",
+     .description = "Show latency percentiles of the commands and their stages",
+     .callback = &on_stats,
+     .class = CC_INTERACTIVE,
+     .cost = 1},
     {.longf = "help",
      .shortf = "h",
      .description = "Show this message",
-     .callback = &on_help}};
+     .callback = &on_help,
+     .class = CC_INTERACTIVE,
+     .cost = 1}};
+
+const char *command_class_to_str(CommandClass cc) {
+  switch (cc) {
+  case CC_INTERACTIVE:
+    return "interactive";
+  case CC_COMPUTE:
+    return "compute";
+  case CC_RENDER:
+    return "render";
+  }
+  return "N/A";
+}
+
+static void send_message(struct discord *client, u64snowflake channel_id,
+                         struct discord_create_message *params) {
+  uint64_t start = clock_now_ns();
+  CCORDcode code = discord_create_message(client, channel_id, params, NULL);
+  uint64_t end = clock_now_ns();
+  metrics_record_stage(MS_DISCORD_SEND, end - start);
+  trace_record(trace_current(), "reply", start, end);
+  metrics_count(code == CCORD_OK ? MC_REPLIES : MC_REPLY_ERRORS);
+}
 
-static void reply_msg(struct discord *client, const struct discord_message *msg,
-                      char *content) {
+void reply_msg(struct discord *client, const struct discord_message *msg,
+               char *content) {
   struct discord_create_message params = {
       .content = content,
       .allowed_mentions =
@@ -59,7 +140,85 @@ static void reply_msg(struct discord *client, const struct discord_message *msg,
           &(struct discord_message_reference){.message_id = msg->id,
                                               .channel_id = msg->channel_id,
                                               .guild_id = msg->guild_id}};
-  discord_create_message(client, msg->channel_id, &params, NULL);
+  send_message(client, msg->channel_id, &params);
+}
+
+/* Appends `digits` in backticks, cutting out the middle if there are more
+ * than `max` of them */
+static void append_digits(struct vector_char *out, const char *digits,
+                          size_t len, size_t max) {
+  if (len <= max) {
+    vector_char_printf(out, "`%.*s`", (int)len, digits);
+  } else {
+    vector_char_printf(out, "`%.*s...%.*s` (%zu characters)", (int)(max / 2),
+                       digits, (int)(max / 2), digits + len - max / 2, len);
+  }
+}
+
+static char *format_digits(const char *digits) {
+  struct vector_char out;
+  vector_init_char(&out);
+  append_digits(&out, digits, strlen(digits), REPLY_MAX_DIGITS);
+  char *res_str = strndup(out.buf, out.len);
+  vector_free_char(&out);
+  return res_str;
+}
+
+static char *format_evaluation(const struct calc_cache_value *value) {
+  char *res_str = NULL;
+  if (value->error != ER_OK) {
+    assert(asprintf(&res_str,
+                    "Failed to evaluate your expression. Error code: `%s`",
+                    evaluator_result_to_str(value->error)) != -1);
+  } else if (value->is_int) {
+    assert(asprintf(&res_str, "`%" PRId64 "`", value->int_result) != -1);
+  } else if (value->exact != NULL) {
+    res_str = format_digits(value->exact);
+  } else if (value->result == floor(value->result)) {
+    assert(asprintf(&res_str, "`%.0f`", value->result) != -1);
+  } else {
+    assert(asprintf(&res_str, "`%f`", value->result) != -1);
+  }
+  return res_str;
+}
+
+static void calc_arena_release(struct arena *arena) {
+  /* Calculations run on several workers at once */
+  static size_t peak = 0;
+  size_t seen = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+  while (arena->high_water > seen) {
+    if (__atomic_compare_exchange_n(&peak, &seen, arena->high_water, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      log_debug(
+          "Calc arena high-water mark: %zu bytes (inline chunk: %d bytes)",
+          arena->high_water, CALC_ARENA_SIZE);
+      break;
+    }
+  }
+  arena_free(arena);
+}
+
+/* Returns the exact result as `p` or `p/q`, or NULL when it's left to
+ * floating point. Fractions are only kept when asked for. */
+static char *calc_exact(const struct rpn_program *program, const char *expr,
+                        bool fractions) {
+  struct bigrat q;
+  bigrat_init(&q);
+  char *exact = NULL;
+  if (evaluate_exact(program, expr, &q) &&
+      (fractions || bigrat_is_integer(&q))) {
+    struct vector_char text;
+    vector_init_char(&text);
+    bignum_to_string(&q.num, 10, &text);
+    if (!bigrat_is_integer(&q)) {
+      vector_push_char(&text, '/');
+      bignum_to_string(&q.den, 10, &text);
+    }
+    vector_push_char(&text, '\0');
+    exact = text.buf;
+  }
+  bigrat_free(&q);
+  return exact;
 }
 
 void on_calc(struct discord *client, const struct discord_message *event) {
@@ -70,16 +229,59 @@ void on_calc(struct discord *client, const struct discord_message *event) {
 
   char *res_str = NULL;
 
+  /* Everything the parser and evaluator allocate for this message lives in
+   * the arena, the first chunk of which is on the stack */
+  unsigned char arena_buf[CALC_ARENA_SIZE];
+  struct arena arena;
+  arena_init(&arena, arena_buf, sizeof(arena_buf), CALC_ARENA_SIZE);
+
+  char *expr = event->content;
+  bool exact_mode = strncmp(expr, EXACT_PREFIX, strlen(EXACT_PREFIX)) == 0;
+  if (exact_mode) {
+    expr += strlen(EXACT_PREFIX);
+  }
+
+  uint64_t normalize_start = trace_begin();
+  char *cache_key = calc_cache_normalize(expr, &arena);
+  if (exact_mode) {
+    /* The prefix isn't something the lexer reads */
+    char *exact_key =
+        arena_alloc(&arena, strlen(EXACT_PREFIX) + strlen(cache_key) + 1);
+    strcpy(exact_key, EXACT_PREFIX);
+    strcat(exact_key, cache_key);
+    cache_key = exact_key;
+  }
+  struct calc_cache_value cached;
+  bool hit = calc_cache_lookup(cache_key, &cached);
+  trace_end("normalize", normalize_start);
+  if (hit) {
+    res_str = format_evaluation(&cached);
+    free_checked(cached.exact);
+    calc_arena_release(&arena);
+    reply_msg(client, event, res_str);
+    free(res_str);
+    return;
+  }
+
   ParseError parse_error = PE_OK;
   size_t parse_error_index = 0;
-  struct vector_token parsed_tokens =
-      parse_math(event->content, &parse_error, &parse_error_index);
+  struct rpn_program program;
+  uint64_t parse_start = clock_now_ns();
+  parse_math(expr, &arena, &program, &parse_error, &parse_error_index);
+  metrics_record_stage(MS_PARSE, clock_now_ns() - parse_start);
+  if (mem_request_exceeded()) {
+    rpn_program_free(&program);
+    calc_arena_release(&arena);
+    reply_msg(client, event, MEMORY_LIMIT_REPLY);
+    return;
+  }
   if (parse_error != PE_OK) {
-    vector_free_token(&parsed_tokens);
+    metrics_count(MC_PARSE_ERRORS);
+    rpn_program_free(&program);
 
     struct vector_char error_format_pointer_str;
-    vector_init_char(&error_format_pointer_str);
-    for (size_t i = 0; i < parse_error_index - 1; i++) {
+    vector_init_arena_char(&error_format_pointer_str, &arena);
+    for (size_t i = 0; i + 1 < parse_error_index; i++) {
       vector_push_char(&error_format_pointer_str, ' ');
     }
     vector_push_char(&error_format_pointer_str, '\0');
@@ -89,26 +291,55 @@ void on_calc(struct discord *client, const struct discord_message *event) {
                     "%s\n"
                     "%s\033[1;31m^\033[0m Here"
                     "```",
-                    parse_error_to_str(parse_error), event->content,
+                    parse_error_to_str(parse_error), expr,
                     error_format_pointer_str.buf) != -1);
     vector_free_char(&error_format_pointer_str);
   } else {
-    EvaluatorResult error;
-    double res = evaluate(&parsed_tokens, &error);
-    vector_free_token(&parsed_tokens);
-    if (error != ER_OK) {
-      assert(asprintf(&res_str,
-                      "Failed to evaluate your expression. Error code: `%s`",
-                      evaluator_result_to_str(error)) != -1);
-    } else {
-      if (res == (long long)res) {
-        assert(asprintf(&res_str, "`%.0f`", res) != -1);
-      } else {
-        assert(asprintf(&res_str, "`%f`", res) != -1);
+    uint64_t evaluate_start = clock_now_ns();
+    /* Malformed programs are known to fail from the parse alone */
+    struct calc_cache_value value = {.result = NAN,
+                                     .error = program.header.result};
+    if (value.error == ER_OK && program.header.n_vars > 0) {
+      /* Nothing binds `x` in a calculation */
+      value.error = ER_UNBOUND_VARIABLE;
+    }
+    if (value.error == ER_OK) {
+      /* Exact arithmetic doesn't need a program. Rationals are only tried
+       * when asked for, or to promote integers that overflow 64 bits to
+       * arbitrary precision. */
+      bool overflow = false;
+      value.is_int = evaluate_int(&program, &value.int_result, &overflow);
+      if (!value.is_int && (exact_mode || overflow)) {
+        value.exact = calc_exact(&program, expr, exact_mode);
       }
+      if (!value.is_int && value.exact == NULL) {
+        /* Compiled into the arena, the register file is on the C stack
+         * unless the program is too large for it */
+        struct vm_program vm;
+        value.error = vm_compile(&program, &arena, &vm);
+        if (value.error == ER_OK) {
+          value.result = vm_execute(&vm, NULL);
+        }
+        vm_program_free(&vm);
+      }
+    }
+    uint64_t evaluate_end = clock_now_ns();
+    metrics_record_stage(MS_EVALUATE, evaluate_end - evaluate_start);
+    trace_record(trace_current(), "evaluate", evaluate_start, evaluate_end);
+    if (mem_request_exceeded()) {
+      /* Not worth keeping a result this big around */
+      free_checked(value.exact);
+      calc_arena_release(&arena);
+      reply_msg(client, event, MEMORY_LIMIT_REPLY);
+      return;
     }
+    res_str = format_evaluation(&value);
+
+    /* Every expression is constant, so the result can be cached as well */
+    calc_cache_insert(cache_key, &value);
   }
 
+  calc_arena_release(&arena);
   reply_msg(client, event, res_str);
   free(res_str);
 }
@@ -118,43 +349,116 @@ void on_ping(struct discord *client, const struct discord_message *event) {
   assert(asprintf(&res_str, ":ping_pong: Pong! Latency: `%i` ms",
                   discord_get_ping(client)) != -1);
   struct discord_create_message params = {.content = res_str};
-  discord_create_message(client, event->channel_id, &params, NULL);
+  send_message(client, event->channel_id, &params);
   free(res_str);
 }
 
+/* Everything needed to reply once the plot is done, the event itself is gone
+ * by then */
+struct plot_request {
+  struct discord *client;
+  struct discord_message msg;
+  char *expr;
+  char *cache_key;
+};
+
+static void plot_request_free(struct plot_request *req) {
+  free_checked(req->expr);
+  free(req->cache_key);
+  free_checked(req);
+}
+
+static void plot_reply(struct plot_image *image, void *data) {
+  struct plot_request *req = data;
+  if (image == NULL) {
+    reply_msg(req->client, &req->msg,
+              "Something went wrong ploting your expression :(");
+  } else {
+    struct discord_create_message params = {
+        .attachments =
+            &(struct discord_attachments){
+                .size = 1,
+                .array = &(struct discord_attachment){.filename = "plot.png",
+                                                      .content = image->buf,
+                                                      .size = image->len}},
+        .allowed_mentions =
+            &(struct discord_allowed_mention){.replied_user = false},
+        .message_reference =
+            &(struct discord_message_reference){
+                .message_id = req->msg.id,
+                .channel_id = req->msg.channel_id,
+                .guild_id = req->msg.guild_id}};
+    send_message(req->client, req->msg.channel_id, &params);
+    plot_image_release(image);
+  }
+
+  plot_request_free(req);
+}
+
+static void on_gnuplot_done(struct vector_char *png, void *data) {
+  struct plot_request *req = data;
+  if (png->len == 0) {
+    vector_free_char(png);
+    plot_cache_abandon(req->cache_key);
+    plot_reply(NULL, req);
+    return;
+  }
+  plot_reply(plot_cache_publish(req->cache_key, png), req);
+}
+
 void on_plot(struct discord *client, const struct discord_message *event) {
-  int exit_status;
-  struct vector_char pngbuf = gnuplot_plot(event->content, &exit_status);
-  if (exit_status == EXIT_FAILURE || pngbuf.len == 0) {
-    reply_msg(client, event, "Something went wrong ploting your expression :(");
-    vector_free_char(&pngbuf);
+  struct plot_request *req = malloc_checked(sizeof(struct plot_request));
+  req->client = client;
+  req->msg = (struct discord_message){.id = event->id,
+                                      .channel_id = event->channel_id,
+                                      .guild_id = event->guild_id};
+  req->expr = malloc_checked(strlen(event->content) + 1);
+  strcpy(req->expr, event->content);
+  req->cache_key = plot_cache_key(event->content, plot_get_backend());
+
+  /* Identical plots are rendered once, requests for a plot that is still
+   * being rendered are answered together with the first one */
+  struct plot_image *image;
+  switch (plot_cache_acquire(req->cache_key, &image, plot_reply, req)) {
+  case PCR_HIT:
+    plot_reply(image, req);
+    return;
+  case PCR_PENDING:
     return;
+  case PCR_MISS:
+    break;
   }
 
-  struct discord_create_message params = {
-      .attachments =
-          &(struct discord_attachments){
-              .size = 1,
-              .array = &(struct discord_attachment){.filename = "plot.png",
-                                                    .content = pngbuf.buf,
-                                                    .size = pngbuf.len}},
-      .allowed_mentions =
-          &(struct discord_allowed_mention){.replied_user = false},
-      .message_reference =
-          &(struct discord_message_reference){.message_id = event->id,
-                                              .channel_id = event->channel_id,
-                                              .guild_id = event->guild_id}};
-  discord_create_message(client, event->channel_id, &params, NULL);
+  if (plot_get_backend() == PB_NATIVE) {
+    PlotError plot_error;
+    uint64_t render_start = clock_now_ns();
+    struct vector_char pngbuf = plot_render(req->expr, &plot_error);
+    uint64_t render_end = clock_now_ns();
+    metrics_record_stage(MS_PLOT_RENDER, render_end - render_start);
+    trace_record(trace_current(), "plot_render", render_start, render_end);
+    if (mem_request_exceeded()) {
+      vector_free_char(&pngbuf);
+      plot_cache_abandon(req->cache_key);
+      reply_msg(client, event, MEMORY_LIMIT_REPLY);
+      plot_request_free(req);
+      return;
+    }
+    if (plot_error == PLE_OK) {
+      plot_reply(plot_cache_publish(req->cache_key, &pngbuf), req);
+      return;
+    }
+    log_debug("Native plot failed with `%s`, falling back to gnuplot",
+              plot_error_to_str(plot_error));
+    vector_free_char(&pngbuf);
+  }
 
-  vector_free_char(&pngbuf);
+  /* Replies from the gnuplot pool's I/O thread, the REST client is safe to
+   * use from there */
+  gnuplot_plot_async(req->expr, on_gnuplot_done, req);
 }
 
 static void vector_char_push_str(struct vector_char *vec, char *str) {
-  while (*str != '\0') {
-    /* vector_push_char(vec, *str++); */ // TODO: Test
-    vector_push_char(vec, *str);
-    str++;
-  }
+  vector_extend_char(vec, str, strlen(str));
 }
 
 void on_help(struct discord *client, const struct discord_message *event) {
@@ -175,74 +479,119 @@ void on_help(struct discord *client, const struct discord_message *event) {
   struct discord_create_message params = {
     .content = help_msg.buf,
   };
-  discord_create_message(client, event->channel_id, &params, NULL);
+  send_message(client, event->channel_id, &params);
 
   vector_free_char(&help_msg);
 }
 
-void on_tobin(struct discord *client, const struct discord_message *event) {
-  enum ConversionError cerr;
-  long long num = convert_from_string(event->content, &cerr);
-  if (cerr != CE_OK) {
-    char *res_str = NULL;
-    assert(asprintf(&res_str, "Failed to covert! Error code: `%s`",
-                    conversion_error_to_str(cerr)) != -1);
-    reply_msg(client, event, res_str);
-    free(res_str);
+static size_t count_words(const char *str) {
+  size_t count = 0;
+  for (; *str != '\0'; str++) {
+    if (!isspace((unsigned char)*str) &&
+        (str[1] == '\0' || isspace((unsigned char)str[1]))) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Every whitespace separated number in `numbers` gets a line of the reply,
+ * which ends early rather than going over the message size limit */
+static void reply_conversions(struct discord *client,
+                              const struct discord_message *event,
+                              const char *numbers, unsigned base) {
+  size_t count = count_words(numbers);
+  if (count == 0) {
+    reply_msg(client, event, "You're missing a number!");
     return;
   }
+  size_t max_digits = count == 1 ? REPLY_MAX_DIGITS : REPLY_MAX_DIGITS / count;
+  if (max_digits < REPLY_ECHO_DIGITS) {
+    max_digits = REPLY_ECHO_DIGITS;
+  }
 
-  struct vector_char res_str;
-  vector_init_char(&res_str);
-  convert_to_bin(num, &res_str);
-  char *bin_str = NULL;
-  assert(asprintf(&bin_str, "`%s`", res_str.buf) != -1);
-  reply_msg(client, event, bin_str);
+  struct vector_char reply;
+  struct vector_char line;
+  struct vector_char converted;
+  vector_init_char(&reply);
+  vector_init_char(&line);
+  vector_init_char(&converted);
+  struct bignum num;
+  bignum_init(&num);
+  const char *end = numbers;
+  for (size_t i = 0; i < count; i++) {
+    const char *start = end;
+    while (isspace((unsigned char)*start)) {
+      start++;
+    }
+    for (end = start; *end != '\0' && !isspace((unsigned char)*end); end++) {
+    }
 
-  vector_free_char(&res_str);
-  free(bin_str);
-}
+    enum ConversionError cerr;
+    convert_from_string(start, (size_t)(end - start), &num, &cerr);
+    vector_clear_char(&line);
+    if (count > 1) {
+      append_digits(&line, start, (size_t)(end - start), REPLY_ECHO_DIGITS);
+      vector_char_printf(&line, cerr == CE_OK ? " = " : ": ");
+    }
+    if (cerr != CE_OK) {
+      vector_char_printf(&line,
+                         count == 1 ? "Failed to covert! Error code: `%s`"
+                                    : "`%s`",
+                         conversion_error_to_str(cerr));
+    } else {
+      vector_clear_char(&converted);
+      convert_to_base(&num, base, &converted);
+      append_digits(&line, converted.buf, converted.len, max_digits);
+    }
+    vector_push_char(&line, '\n');
 
-void on_tohex(struct discord *client, const struct discord_message *event) {
-  enum ConversionError cerr;
-  long long num = convert_from_string(event->content, &cerr);
-  if (cerr != CE_OK) {
-    char *res_str = NULL;
-    assert(asprintf(&res_str, "Failed to covert! Error code: `%s`",
-                    conversion_error_to_str(cerr)) != -1);
-    reply_msg(client, event, res_str);
-    free(res_str);
-    return;
+    if (i > 0 && reply.len + line.len > REPLY_MAX_DIGITS) {
+      vector_char_printf(&reply, "... and %zu more\n", count - i);
+      break;
+    }
+    vector_extend_char(&reply, line.buf, line.len);
   }
+  /* Replaces the last newline */
+  reply.buf[reply.len - 1] = '\0';
+  reply_msg(client, event, reply.buf);
+
+  bignum_free(&num);
+  vector_free_char(&converted);
+  vector_free_char(&line);
+  vector_free_char(&reply);
+}
 
-  struct vector_char res_str;
-  vector_init_char(&res_str);
-  convert_to_hex(num, &res_str);
-  char *hex_str = NULL;
-  assert(asprintf(&hex_str, "`%s`", res_str.buf) != -1);
-  reply_msg(client, event, hex_str);
+void on_tobin(struct discord *client, const struct discord_message *event) {
+  reply_conversions(client, event, event->content, 2);
+}
 
-  vector_free_char(&res_str);
-  free(hex_str);
+void on_tohex(struct discord *client, const struct discord_message *event) {
+  reply_conversions(client, event, event->content, 16);
 }
 
 void on_todec(struct discord *client, const struct discord_message *event) {
-  enum ConversionError cerr;
-  long long num = convert_from_string(event->content, &cerr);
-  if (cerr != CE_OK) {
-    char *res_str = NULL;
-    assert(asprintf(&res_str, "Failed to covert! Error code: `%s`",
-                    conversion_error_to_str(cerr)) != -1);
-    reply_msg(client, event, res_str);
-    free(res_str);
+  reply_conversions(client, event, event->content, 10);
+}
+
+void on_tobase(struct discord *client, const struct discord_message *event) {
+  char *numbers = NULL;
+  unsigned long base = strtoul(event->content, &numbers, 10);
+  if (numbers == event->content || base < 2 || base > 36) {
+    reply_msg(client, event,
+              "The base has to be between 2 and 36 e.g. `+tobase 36 1295`");
     return;
   }
+  reply_conversions(client, event, numbers, (unsigned)base);
+}
 
-  char *dec_str = NULL;
-  assert(asprintf(&dec_str, "`%lld`", num) != -1);
-  reply_msg(client, event, dec_str);
-
-  free(dec_str);
+void on_stats(struct discord *client, const struct discord_message *event) {
+  struct vector_char stats_msg;
+  vector_init_char(&stats_msg);
+  metrics_format_table(&stats_msg);
+  vector_push_char(&stats_msg, '\0');
+  reply_msg(client, event, stats_msg.buf);
+  vector_free_char(&stats_msg);
 }
 
 void on_why(struct discord *client, const struct discord_message *event) {
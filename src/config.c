@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <concord/discord.h>
+#include <concord/log.h>
+
+#include "include/config.h"
+
+long config_get_long(struct discord *client, char *const path[],
+                     unsigned depth, long default_value) {
+  struct ccord_szbuf_readonly field =
+      discord_config_get_field(client, path, depth);
+  if (field.start == NULL || field.size == 0) {
+    return default_value;
+  }
+
+  char numbuf[32];
+  if (field.size >= sizeof(numbuf)) {
+    log_warn("Config field `%s` is too long, using default", path[depth - 1]);
+    return default_value;
+  }
+  memcpy(numbuf, field.start, field.size);
+  numbuf[field.size] = '\0';
+
+  char *endptr;
+  long value = strtol(numbuf, &endptr, 10);
+  if (endptr == numbuf || *endptr != '\0') {
+    log_warn("Config field `%s` is not an integer, using default",
+             path[depth - 1]);
+    return default_value;
+  }
+
+  return value;
+}
+
+void config_get_string(struct discord *client, char *const path[],
+                       unsigned depth, char *buf, size_t size,
+                       const char *default_value) {
+  struct ccord_szbuf_readonly field =
+      discord_config_get_field(client, path, depth);
+  if (field.start == NULL || field.size == 0) {
+    snprintf(buf, size, "%s", default_value);
+    return;
+  }
+
+  /* Strings come with their JSON quotes */
+  const char *start = field.start;
+  size_t len = field.size;
+  if (len >= 2 && start[0] == '"' && start[len - 1] == '"') {
+    start++;
+    len -= 2;
+  }
+  if (len >= size) {
+    log_warn("Config field `%s` is too long, using default", path[depth - 1]);
+    snprintf(buf, size, "%s", default_value);
+    return;
+  }
+  memcpy(buf, start, len);
+  buf[len] = '\0';
+}
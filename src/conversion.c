@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "include/conversion.h"
+#include "include/mem.h"
 #include "include/vector.h"
 
 const char *conversion_error_to_str(enum ConversionError err) {
@@ -15,131 +16,106 @@ const char *conversion_error_to_str(enum ConversionError err) {
     return "ATTEMPT_TO_CONVERT_FLOAT";
   case CE_STR_CONVERSION_FAILED:
     return "STR_CONVERSION_FAILED";
+  case CE_INVALID_BASE:
+    return "INVALID_BASE";
   }
   return "N/A";
 }
 
-void convert_to_hex(long long from, struct vector_char *to) {
-  char *hex_str = NULL;
-  assert(asprintf(&hex_str, "0x%llX", from) != -1);
-  vector_free_char(to);
-  to->buf = hex_str;
-  to->len = strlen(hex_str);
-  to->cap = strlen(hex_str);
-}
-
-void convert_to_bin(long long from, struct vector_char *to) {
-  bool has_a_one = false;
-
-  if (from < 0) {
+void convert_to_base(const struct bignum *from, unsigned base,
+                     struct vector_char *to) {
+  MemTag tag = mem_tag_swap(MT_CONVERSION);
+  if (from->negative) {
     vector_push_char(to, '-');
-    from *= -1;
-  }
-  vector_push_char(to, '0');
-  vector_push_char(to, 'b');
-
-  long long mask = 1LL << 62;
-  while (mask > 0) {
-    if ((from & mask) > 0) {
-      vector_push_char(to, '1');
-      has_a_one = true;
-    } else if (has_a_one) {
-      vector_push_char(to, '0');
-    }
-    mask >>= 1;
   }
-
-  if (!has_a_one) {
-    vector_push_char(to, '0');
+  switch (base) {
+  case 2:
+    vector_extend_char(to, "0b", 2);
+    break;
+  case 8:
+    vector_extend_char(to, "0o", 2);
+    break;
+  case 10:
+    break;
+  case 16:
+    vector_extend_char(to, "0x", 2);
+    break;
+  default:
+    vector_char_printf(to, "%u#", base);
+    break;
   }
-
-  vector_push_char(to, '\0');
+  /* The sign goes before the prefix */
+  struct bignum magnitude = *from;
+  magnitude.negative = false;
+  bignum_to_string(&magnitude, base, to);
+  mem_tag_swap(tag);
 }
 
-static inline bool is_valid_dec(char c) { return c >= '0' && c <= '9'; }
-
-static inline bool is_valid_hex(char c) {
-  return is_valid_dec(c) || (tolower(c) >= 'a' && tolower(c) <= 'f');
-}
-
-static inline bool is_valid_bin(char c) { return c == '0' || c == '1'; }
-
-long long convert_from_string(char *str, enum ConversionError *error) {
-  bool is_negative = false;
-  if (*str == '-') {
-    is_negative = true;
-    str++;
-  }
-
-  int base;
-  struct vector_char parsed;
-  vector_init_char(&parsed);
-  if (*str == '0') {
-    str++;
-    if (tolower(*str) == 'b') {
-      str++;
+/* Strips the prefix or `<base>#` off `*str`, 0 if the base is invalid */
+static unsigned read_base(const char **str, size_t *len) {
+  const char *s = *str;
+  if (*len > 2 && s[0] == '0') {
+    unsigned base = 0;
+    switch (tolower(s[1])) {
+    case 'b':
       base = 2;
-      while (1) {
-        if (*str == '\0') {
-          break;
-        }
-
-        if (!is_valid_bin(*str)) {
-          *error = CE_STR_CONVERSION_FAILED;
-          return 0;
-        }
-        vector_push_char(&parsed, *str);
-        str++;
-      }
-      goto fin;
-    } else if (tolower(*str) == 'x') {
-      str++;
+      break;
+    case 'o':
+      base = 8;
+      break;
+    case 'x':
       base = 16;
-      while (1) {
-        if (*str == '\0') {
-          break;
-        }
-
-        if (!is_valid_hex(*str)) {
-          *error = CE_STR_CONVERSION_FAILED;
-          return 0;
-        }
-        vector_push_char(&parsed, *str);
-        str++;
-      }
-      goto fin;
-    }
-  }
-
-  base = 10;
-  while (1) {
-    if (*str == '\0') {
       break;
     }
-
-    if (!is_valid_dec(*str)) {
-      if (*str == '.') {
-        *error = CE_ATTEMPT_TO_CONVERT_FLOAT;
-      } else {
-        *error = CE_STR_CONVERSION_FAILED;
-      }
+    if (base != 0) {
+      *str += 2;
+      *len -= 2;
+      return base;
+    }
+  }
+  const char *hash = memchr(s, '#', *len);
+  if (hash == NULL) {
+    return 10;
+  }
+  unsigned base = 0;
+  for (const char *c = s; c < hash; c++) {
+    if (!isdigit((unsigned char)*c) || base > 36) {
       return 0;
     }
-    vector_push_char(&parsed, *str);
-    str++;
+    base = base * 10 + (unsigned)(*c - '0');
   }
+  *len -= (size_t)(hash + 1 - s);
+  *str = hash + 1;
+  return base >= 2 && base <= 36 ? base : 0;
+}
 
-fin:
-  vector_push_char(&parsed, '\0');
-  char *endptr = NULL;
-  long long res = strtoll(parsed.buf, &endptr, base);
-  if (endptr != NULL) {
-    *error = CE_STR_CONVERSION_FAILED;
+static void from_string(const char *str, size_t len, struct bignum *to,
+                        enum ConversionError *error) {
+  bool is_negative = false;
+  if (len > 0 && *str == '-') {
+    is_negative = true;
+    str++;
+    len--;
   }
 
+  unsigned base = read_base(&str, &len);
+  if (base == 0) {
+    *error = CE_INVALID_BASE;
+    return;
+  }
+  if (!bignum_from_string(to, str, len, base)) {
+    *error = base == 10 && memchr(str, '.', len) != NULL
+                 ? CE_ATTEMPT_TO_CONVERT_FLOAT
+                 : CE_STR_CONVERSION_FAILED;
+    return;
+  }
+  to->negative = is_negative && to->len > 0;
   *error = CE_OK;
+}
 
-  vector_free_char(&parsed);
-
-  return is_negative ? -1 * res : res;
+void convert_from_string(const char *str, size_t len, struct bignum *to,
+                         enum ConversionError *error) {
+  MemTag tag = mem_tag_swap(MT_CONVERSION);
+  from_string(str, len, to, error);
+  mem_tag_swap(tag);
 }
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <concord/log.h>
+
+#include "include/clock.h"
+#include "include/command.h"
+#include "include/dispatch.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/mpmc.h"
+#include "include/ratelimit.h"
+#include "include/trace.h"
+
+/* Queued classes are all but the interactive one, the last of them is shed
+ * first */
+#define FIRST_QUEUED_CLASS (CC_INTERACTIVE + 1)
+#define SHED_CLASS (N_COMMAND_CLASSES - 1)
+
+#define BUSY_REPLY "I'm a bit busy right now, try again later"
+
+/* The event is freed once the gateway callback returns, so a job carries a
+ * copy of the fields the commands use */
+struct dispatch_job {
+  const struct Command *command;
+  struct discord *client;
+  uint64_t queued_ns;
+  uint64_t trace_id;
+  struct discord_message msg;
+  struct discord_user author;
+  char content[];
+};
+
+struct dispatch_worker {
+  pthread_t thread;
+  /* Only written by the worker itself */
+  size_t jobs;
+  uint64_t busy_ns;
+} __attribute__((aligned(MPMC_CACHE_LINE)));
+
+struct dispatch_class {
+  struct mpmc_queue queue;
+  size_t limit;
+  size_t running;
+  /* Queueing delay of the last job taken off the queue */
+  uint64_t last_delay_ns;
+  /* `queue_depth` is read from the queue */
+  struct dispatch_class_stats stats;
+};
+
+static struct {
+  struct dispatch_worker *workers;
+  size_t n_workers;
+  struct dispatch_class classes[N_COMMAND_CLASSES];
+  uint64_t slo_ns;
+  /* Counts queued jobs and stop requests, workers sleep on it */
+  sem_t pending;
+  /* Wakes parked workers when a job of a class at its limit finishes */
+  sem_t slot_freed;
+  size_t parked;
+  size_t stops;
+  uint64_t started_ns;
+} pool;
+
+/* Handed to each worker once on shutdown */
+static struct dispatch_job stop_job;
+
+static struct dispatch_job *job_new(const struct Command *command,
+                                    struct discord *client,
+                                    const struct discord_message *event) {
+  size_t content_len = strlen(event->content);
+  struct dispatch_job *job =
+      malloc_checked(sizeof(struct dispatch_job) + content_len + 1);
+  job->command = command;
+  job->client = client;
+  job->queued_ns = clock_now_ns();
+  job->trace_id = trace_current();
+  memcpy(job->content, event->content, content_len + 1);
+  job->author = (struct discord_user){0};
+  if (event->author != NULL) {
+    job->author.id = event->author->id;
+    job->author.bot = event->author->bot;
+  }
+  job->msg = (struct discord_message){.id = event->id,
+                                      .channel_id = event->channel_id,
+                                      .guild_id = event->guild_id,
+                                      .author = &job->author,
+                                      .content = job->content};
+  return job;
+}
+
+static void store_max(uint64_t *max, uint64_t value) {
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(max, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static bool class_enter(struct dispatch_class *cls) {
+  size_t running = __atomic_load_n(&cls->running, __ATOMIC_RELAXED);
+  do {
+    if (running >= cls->limit) {
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&cls->running, &running, running + 1,
+                                        true, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED));
+  return true;
+}
+
+static void class_leave(struct dispatch_class *cls) {
+  __atomic_sub_fetch(&cls->running, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool.parked, __ATOMIC_SEQ_CST) > 0) {
+    sem_post(&pool.slot_freed);
+  }
+}
+
+static bool can_run_any(void) {
+  for (int c = FIRST_QUEUED_CLASS; c < N_COMMAND_CLASSES; c++) {
+    struct dispatch_class *cls = &pool.classes[c];
+    if (mpmc_size(&cls->queue) > 0 &&
+        __atomic_load_n(&cls->running, __ATOMIC_SEQ_CST) < cls->limit) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool take_stop(void) {
+  size_t stops = __atomic_load_n(&pool.stops, __ATOMIC_RELAXED);
+  while (stops > 0) {
+    if (__atomic_compare_exchange_n(&pool.stops, &stops, stops - 1, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Called with a `pending` token, so there is a job or a stop request for us.
+ * Returns the highest class job that is within its class's limit. */
+static struct dispatch_job *next_job(struct dispatch_class **job_class) {
+  while (true) {
+    bool limited = false;
+    for (int c = FIRST_QUEUED_CLASS; c < N_COMMAND_CLASSES; c++) {
+      struct dispatch_class *cls = &pool.classes[c];
+      if (mpmc_size(&cls->queue) == 0) {
+        continue;
+      }
+      if (!class_enter(cls)) {
+        limited = true;
+        continue;
+      }
+      struct dispatch_job *job = mpmc_pop(&cls->queue);
+      if (job != NULL) {
+        *job_class = cls;
+        return job;
+      }
+      class_leave(cls);
+    }
+    if (take_stop()) {
+      return &stop_job;
+    }
+    if (!limited) {
+      /* The semaphore is posted after the push completes, but an earlier slot
+       * may still be mid-push by another producer */
+      sched_yield();
+      continue;
+    }
+
+    /* Everything queued belongs to classes at their limit. Registering as
+     * parked before checking again means a slot freed in between still wakes
+     * us up. */
+    __atomic_add_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+    if (!can_run_any()) {
+      while (sem_wait(&pool.slot_freed) == -1 && errno == EINTR) {
+      }
+    }
+    __atomic_sub_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* Allocations made by a command count against its request's memory
+ * ceiling, which the command checks between stages */
+static void run_command(const struct Command *command, struct discord *client,
+                        const struct discord_message *msg) {
+  MemTag tag = mem_tag_swap(MT_COMMAND);
+  mem_request_begin();
+  command->callback(client, msg);
+  mem_request_end();
+  mem_tag_swap(tag);
+}
+
+static void *worker_main(void *arg) {
+  struct dispatch_worker *w = arg;
+  while (true) {
+    while (sem_wait(&pool.pending) == -1 && errno == EINTR) {
+    }
+    struct dispatch_class *cls = NULL;
+    struct dispatch_job *job = next_job(&cls);
+    if (job == &stop_job) {
+      break;
+    }
+
+    uint64_t start = clock_now_ns();
+    uint64_t delay = start - job->queued_ns;
+    __atomic_store_n(&cls->last_delay_ns, delay, __ATOMIC_RELAXED);
+    trace_set_current(job->trace_id);
+    trace_record(job->trace_id, "queue", job->queued_ns, start);
+    if (cls == &pool.classes[SHED_CLASS] && delay > pool.slo_ns) {
+      /* The answer would come too late to be useful, and running it would
+       * only delay everything behind it */
+      __atomic_add_fetch(&cls->stats.shed, 1, __ATOMIC_RELAXED);
+      log_warn("Shedding `+%s` after %.0f ms in the queue",
+               job->command->longf, delay / 1e6);
+      reply_msg(job->client, &job->msg, BUSY_REPLY);
+    } else {
+      run_command(job->command, job->client, &job->msg);
+      uint64_t busy = clock_now_ns() - start;
+      metrics_record_command((size_t)(job->command - commands), busy);
+      trace_record(job->trace_id, job->command->longf, start, start + busy);
+      __atomic_add_fetch(&cls->stats.jobs, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&cls->stats.delay_ns, delay, __ATOMIC_RELAXED);
+      store_max(&cls->stats.max_delay_ns, delay);
+      __atomic_store_n(&w->jobs, w->jobs + 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&w->busy_ns, w->busy_ns + busy, __ATOMIC_RELAXED);
+    }
+    trace_set_current(0);
+    class_leave(cls);
+    free_checked(job);
+  }
+  return NULL;
+}
+
+void dispatch_init(const struct dispatch_config *config) {
+  pool.n_workers = config->workers > 0 ? config->workers : 1;
+  pool.slo_ns = config->slo_ms > 0 ? config->slo_ms * 1000000 : UINT64_MAX;
+  for (int c = FIRST_QUEUED_CLASS; c < N_COMMAND_CLASSES; c++) {
+    struct dispatch_class *cls = &pool.classes[c];
+    mpmc_init(&cls->queue, config->queue_size > 0 ? config->queue_size : 1);
+    size_t limit = config->limits[c];
+    cls->limit = limit > 0 && limit < pool.n_workers ? limit : pool.n_workers;
+  }
+  sem_init(&pool.pending, 0, 0);
+  sem_init(&pool.slot_freed, 0, 0);
+  pool.started_ns = clock_now_ns();
+
+  pool.workers =
+      aligned_alloc(MPMC_CACHE_LINE, pool.n_workers * sizeof(*pool.workers));
+  if (pool.workers == NULL) {
+    log_fatal("Failed to allocate %zu dispatch workers", pool.n_workers);
+    exit(1);
+  }
+  for (size_t i = 0; i < pool.n_workers; i++) {
+    struct dispatch_worker *w = &pool.workers[i];
+    w->jobs = 0;
+    w->busy_ns = 0;
+    int err = pthread_create(&w->thread, NULL, worker_main, w);
+    if (err != 0) {
+      log_fatal("Starting dispatch worker %zu failed: %s", i, strerror(err));
+      exit(1);
+    }
+  }
+}
+
+void dispatch_cleanup(void) {
+  /* Workers only take a stop request once nothing they could run is left */
+  __atomic_store_n(&pool.stops, pool.n_workers, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < pool.n_workers; i++) {
+    sem_post(&pool.pending);
+  }
+  for (size_t i = 0; i < pool.n_workers; i++) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.n_workers = 0;
+  for (int c = FIRST_QUEUED_CLASS; c < N_COMMAND_CLASSES; c++) {
+    mpmc_free(&pool.classes[c].queue);
+  }
+  sem_destroy(&pool.pending);
+  sem_destroy(&pool.slot_freed);
+}
+
+/* While any queue is behind its objective there is no point in queueing
+ * more of the lowest class */
+static bool overloaded(void) {
+  for (int c = FIRST_QUEUED_CLASS; c < N_COMMAND_CLASSES; c++) {
+    struct dispatch_class *cls = &pool.classes[c];
+    if (mpmc_size(&cls->queue) > 0 &&
+        __atomic_load_n(&cls->last_delay_ns, __ATOMIC_RELAXED) > pool.slo_ns) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void route(const struct Command *command, struct discord *client,
+                  const struct discord_message *event) {
+  bool notify;
+  RateLimitResult admission = ratelimit_admit(
+      event->author != NULL ? event->author->id : 0, event->channel_id,
+      command->cost, ratelimit_now_ms(), &notify);
+  if (admission != RL_OK) {
+    log_debug("Rate limited `+%s`: %s", command->longf,
+              ratelimit_result_to_str(admission));
+    /* Only the first rejected request of a flood gets an answer */
+    if (notify) {
+      reply_msg(client, event,
+                admission == RL_USER_LIMITED
+                    ? "You're going too fast, try again in a few seconds"
+                    : "This channel is going too fast, try again in a few "
+                      "seconds");
+    }
+    return;
+  }
+
+  struct dispatch_class *cls = &pool.classes[command->class];
+  if (command->class == CC_INTERACTIVE) {
+    __atomic_add_fetch(&cls->stats.jobs, 1, __ATOMIC_RELAXED);
+    uint64_t start = clock_now_ns();
+    run_command(command, client, event);
+    uint64_t end = clock_now_ns();
+    metrics_record_command((size_t)(command - commands), end - start);
+    trace_record(trace_current(), command->longf, start, end);
+    return;
+  }
+
+  if (command->class == SHED_CLASS && overloaded()) {
+    __atomic_add_fetch(&cls->stats.shed, 1, __ATOMIC_RELAXED);
+    log_warn("Over the queueing objective, shedding `+%s`", command->longf);
+    reply_msg(client, event, BUSY_REPLY);
+    return;
+  }
+
+  struct dispatch_job *job = job_new(command, client, event);
+  if (!mpmc_push(&cls->queue, job)) {
+    __atomic_add_fetch(&cls->stats.rejected, 1, __ATOMIC_RELAXED);
+    log_warn("Dispatch queue full, rejecting `+%s`", command->longf);
+    free_checked(job);
+    reply_msg(client, event, BUSY_REPLY);
+    return;
+  }
+  sem_post(&pool.pending);
+
+  size_t depth = mpmc_size(&cls->queue);
+  if (depth > __atomic_load_n(&cls->stats.max_queue_depth, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&cls->stats.max_queue_depth, depth, __ATOMIC_RELAXED);
+  }
+}
+
+static void dispatch(const struct Command *command, struct discord *client,
+                     const struct discord_message *event) {
+  /* Everything this request does from here on, on any thread, is recorded
+   * under its trace id */
+  trace_set_current(trace_sample(event->id));
+  uint64_t start = trace_begin();
+  route(command, client, event);
+  trace_end("receive", start);
+  trace_set_current(0);
+}
+
+/* The library passes no user data to command callbacks, so every command
+ * gets its own entry point */
+#define DISPATCH_TRAMPOLINE(__i)                                               \
+  static void dispatch_##__i(struct discord *client,                          \
+                             const struct discord_message *event) {            \
+    dispatch(&commands[__i], client, event);                                   \
+  }
+
+DISPATCH_TRAMPOLINE(0)
+DISPATCH_TRAMPOLINE(1)
+DISPATCH_TRAMPOLINE(2)
+DISPATCH_TRAMPOLINE(3)
+DISPATCH_TRAMPOLINE(4)
+DISPATCH_TRAMPOLINE(5)
+DISPATCH_TRAMPOLINE(6)
+DISPATCH_TRAMPOLINE(7)
+DISPATCH_TRAMPOLINE(8)
+DISPATCH_TRAMPOLINE(9)
+
+#undef DISPATCH_TRAMPOLINE
+
+/* Fails to compile when a command is added without a trampoline */
+typedef char dispatch_trampolines_cover_commands[N_COMMANDS == 10 ? 1 : -1];
+
+const discord_ev_message dispatch_callbacks[N_COMMANDS] = {
+    dispatch_0, dispatch_1, dispatch_2, dispatch_3, dispatch_4,
+    dispatch_5, dispatch_6, dispatch_7, dispatch_8, dispatch_9};
+
+struct dispatch_stats dispatch_get_stats(void) {
+  struct dispatch_stats stats = {
+      .workers = pool.n_workers,
+      .queue_capacity = mpmc_capacity(&pool.classes[FIRST_QUEUED_CLASS].queue),
+      .uptime_ns = clock_now_ns() - pool.started_ns};
+  for (int c = 0; c < N_COMMAND_CLASSES; c++) {
+    struct dispatch_class_stats *src = &pool.classes[c].stats;
+    stats.classes[c] = (struct dispatch_class_stats){
+        .jobs = __atomic_load_n(&src->jobs, __ATOMIC_RELAXED),
+        .queue_depth =
+            c >= FIRST_QUEUED_CLASS ? mpmc_size(&pool.classes[c].queue) : 0,
+        .max_queue_depth =
+            __atomic_load_n(&src->max_queue_depth, __ATOMIC_RELAXED),
+        .rejected = __atomic_load_n(&src->rejected, __ATOMIC_RELAXED),
+        .shed = __atomic_load_n(&src->shed, __ATOMIC_RELAXED),
+        .delay_ns = __atomic_load_n(&src->delay_ns, __ATOMIC_RELAXED),
+        .max_delay_ns = __atomic_load_n(&src->max_delay_ns, __ATOMIC_RELAXED)};
+  }
+  return stats;
+}
+
+size_t dispatch_get_worker_stats(struct dispatch_worker_stats *out, size_t n) {
+  for (size_t i = 0; i < n && i < pool.n_workers; i++) {
+    out[i] = (struct dispatch_worker_stats){
+        .jobs = __atomic_load_n(&pool.workers[i].jobs, __ATOMIC_RELAXED),
+        .busy_ns = __atomic_load_n(&pool.workers[i].busy_ns, __ATOMIC_RELAXED)};
+  }
+  return pool.n_workers;
+}
@@ -1,6 +1,11 @@
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include "include/bignum.h"
 #include "include/evaluator.h"
+#include "include/functions.h"
+#include "include/mem.h"
 #include "include/parser.h"
 #include "include/vector.h"
 
@@ -14,108 +19,347 @@ const char *evaluator_result_to_str(EvaluatorResult er) {
     return "MISSING_OPERAND";
   case ER_INVALID_OPERATOR:
     return "INVALID_OPERATOR";
+  case ER_TOO_COMPLEX:
+    return "TOO_COMPLEX";
+  case ER_UNBOUND_VARIABLE:
+    return "UNBOUND_VARIABLE";
   }
   return "N/A";
 }
 
-double evaluate(struct vector_token *tokens, EvaluatorResult *res) {
-  struct vector_double vstack;
-  vector_init_double(&vstack);
+/* Deeper expressions aren't common enough to be worth the stack space */
+#define INT_STACK_SIZE 64
 
-  for (size_t i = 0; i < tokens->len; i++) {
-    switch (tokens->buf[i].type) {
+static inline bool int_mul(int64_t a, int64_t b, int64_t *out) {
+  __int128 product = (__int128)a * b;
+  if (product < INT64_MIN || product > INT64_MAX) {
+    return false;
+  }
+  *out = (int64_t)product;
+  return true;
+}
+
+/* Exponentiation by squaring. The base is only squared while a higher bit of
+ * the exponent is left, so it overflows only if the result would as well. */
+static bool int_pow(int64_t base, int64_t exp, int64_t *out) {
+  if (exp < 0) {
+    return false;
+  }
+  int64_t result = 1;
+  while (true) {
+    if ((exp & 1) && !int_mul(result, base, &result)) {
+      return false;
+    }
+    exp >>= 1;
+    if (exp == 0) {
+      break;
+    }
+    if (!int_mul(base, base, &base)) {
+      return false;
+    }
+  }
+  *out = result;
+  return true;
+}
+
+bool evaluate_int(const struct rpn_program *program, int64_t *result,
+                  bool *overflow) {
+  int64_t stack[INT_STACK_SIZE];
+  size_t len = 0;
+  const union rpn_const *operand = program->consts;
+  *overflow = false;
+
+  /* Programs `parse_math()` rejected or that are too deep are left to the
+   * checks of the other evaluators */
+  for (size_t i = 0; i < program->len; i++) {
+    /* One past the top of the stack */
+    int64_t *top = stack + len;
+    switch ((TokenType)program->ops[i]) {
+    case TT_INT:
+      if (len == INT_STACK_SIZE) {
+        return false;
+      }
+      stack[len++] = (operand++)->integer;
+      break;
     case TT_NUM:
-      vector_push_double(&vstack, tokens->buf[i].num);
+      /* Integer literals are only TT_NUM when they don't fit in a TT_INT.
+       * Decimals that large are promoted as well, the rationals give up on
+       * them soon enough. */
+      *overflow = operand->num >= 0x1p63;
+      return false;
+    case TT_NEG:
+      if (len < 1) {
+        return false;
+      }
+      if (top[-1] == INT64_MIN) {
+        *overflow = true;
+        return false;
+      }
+      top[-1] = -top[-1];
       break;
     case TT_ADD:
-      if (vstack.len < 2) {
-        break;
+      if (len < 2) {
+        return false;
+      }
+      if (__builtin_add_overflow(top[-2], top[-1], &top[-2])) {
+        *overflow = true;
+        return false;
       }
-      const double top = vector_pop_double(&vstack);
-      vstack.buf[vstack.len - 1] += top;
+      len--;
       break;
     case TT_SUB:
-      if (vstack.len < 2) {
-        vstack.buf[vstack.len - 1] *= -1.0;
-        break;
+      if (len < 2) {
+        return false;
+      }
+      if (__builtin_sub_overflow(top[-2], top[-1], &top[-2])) {
+        *overflow = true;
+        return false;
       }
-      const double top_2 = vector_pop_double(&vstack);
-      vstack.buf[vstack.len - 1] -= top_2;
+      len--;
       break;
     case TT_MULTIPLY:
-      if (vstack.len < 2) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+      if (len < 2) {
+        return false;
+      }
+      if (!int_mul(top[-2], top[-1], &top[-2])) {
+        *overflow = true;
+        return false;
       }
-      const double top_3 = vector_pop_double(&vstack);
-      vstack.buf[vstack.len - 1] *= top_3;
+      len--;
       break;
     case TT_DIVIDE:
-      if (vstack.len < 2) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+      if (len < 2 || top[-1] == 0) {
+        return false;
+      }
+      if (top[-2] == INT64_MIN && top[-1] == -1) {
+        *overflow = true;
+        return false;
+      }
+      if (top[-2] % top[-1] != 0) {
+        return false;
       }
-      const double top_4 = vector_pop_double(&vstack);
-      vstack.buf[vstack.len - 1] /= top_4;
+      top[-2] /= top[-1];
+      len--;
       break;
     case TT_POW:
-      if (vstack.len < 2) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+      if (len < 2 || top[-1] < 0) {
+        return false;
       }
-      const double top_5 = vector_pop_double(&vstack);
-      vstack.buf[vstack.len - 1] = pow(vstack.buf[vstack.len - 1], top_5);
+      if (!int_pow(top[-2], top[-1], &top[-2])) {
+        *overflow = true;
+        return false;
+      }
+      len--;
       break;
-    case TT_SQRT:
-      if (vstack.len < 1) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+    default:
+      return false;
+    }
+  }
+
+  if (len != 1) {
+    return false;
+  }
+  *result = stack[0];
+  return true;
+}
+
+static bool exact_fits(const struct bigrat *q) {
+  return bignum_bits(&q->num) + bignum_bits(&q->den) <=
+         EVALUATOR_MAX_EXACT_BITS;
+}
+
+static bool exact_pow(struct bigrat *base, const struct bigrat *exp) {
+  int64_t e;
+  if (!bigrat_is_integer(exp) || !bignum_to_i64(&exp->num, &e)) {
+    return false;
+  }
+  /* A number of b bits is at least 2^(b - 1), so the result has at least
+   * (bits - 2) * |e| bits. Checked up front, the power itself could take
+   * forever. */
+  size_t bits = bignum_bits(&base->num) + bignum_bits(&base->den);
+  uint64_t magnitude = e < 0 ? -(uint64_t)e : (uint64_t)e;
+  if (bits > 2 && magnitude > EVALUATOR_MAX_EXACT_BITS / (bits - 2)) {
+    return false;
+  }
+  return bigrat_pow(base, base, e);
+}
+
+static bool evaluate_bigrat(const struct rpn_program *program,
+                            const char *expr, struct bigrat *result) {
+  struct bigrat stack[INT_STACK_SIZE];
+  /* Slots are initialized the first time they are used */
+  size_t live = 0;
+  size_t len = 0;
+  bool ok = true;
+  const union rpn_const *operand = program->consts;
+  const struct rpn_literal *literal = program->literals;
+
+  for (size_t i = 0; ok && i < program->len; i++) {
+    struct bigrat *top = stack + len;
+    TokenType tt = (TokenType)program->ops[i];
+    switch (tt) {
+    case TT_NUM:
+    case TT_INT: {
+      const union rpn_const *value = operand++;
+      /* Constants are irrational */
+      if (len == INT_STACK_SIZE || (tt == TT_NUM && literal->len == 0)) {
+        ok = false;
+        break;
+      }
+      if (len == live) {
+        bigrat_init(&stack[live++]);
       }
-      vstack.buf[vstack.len - 1] = sqrt(vstack.buf[vstack.len - 1]);
+      if (tt == TT_INT) {
+        bigrat_set_i64(&stack[len], value->integer);
+      } else {
+        ok = bigrat_from_decimal(&stack[len], expr + literal->offset,
+                                 literal->len);
+        literal++;
+      }
+      len++;
       break;
-    case TT_SIN:
-      if (vstack.len < 1) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+    }
+    case TT_NEG:
+      if (len < 1) {
+        ok = false;
+        break;
       }
-      vstack.buf[vstack.len - 1] = sin(vstack.buf[vstack.len - 1]);
+      top[-1].num.negative = top[-1].num.len > 0 && !top[-1].num.negative;
       break;
-    case TT_COS:
-      if (vstack.len < 1) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+    case TT_ADD:
+    case TT_SUB:
+      if (len < 2) {
+        ok = false;
+        break;
+      }
+      if (tt == TT_ADD) {
+        bigrat_add(&top[-2], &top[-2], &top[-1]);
+      } else {
+        bigrat_sub(&top[-2], &top[-2], &top[-1]);
+      }
+      len--;
+      break;
+    case TT_MULTIPLY:
+      if (len < 2) {
+        ok = false;
+        break;
       }
-      vstack.buf[vstack.len - 1] = cos(vstack.buf[vstack.len - 1]);
+      bigrat_mul(&top[-2], &top[-2], &top[-1]);
+      len--;
       break;
-    case TT_TAN:
-      if (vstack.len < 1) {
-        *res = ER_MISSING_OPERAND;
-        return NAN;
+    case TT_DIVIDE:
+      if (len < 2 || !bigrat_div(&top[-2], &top[-2], &top[-1])) {
+        ok = false;
+        break;
+      }
+      len--;
+      break;
+    case TT_POW:
+      if (len < 2 || !exact_pow(&top[-2], &top[-1])) {
+        ok = false;
+        break;
       }
-      vstack.buf[vstack.len - 1] = tan(vstack.buf[vstack.len - 1]);
+      len--;
       break;
-    case TT_EOF:
-    case TT_EMPTY:
-    case TT_ERROR:
-    case TT_OPENPAR:
-    case TT_CLOSEPAR:
     default:
-      vector_free_token(tokens);
-      vector_free_double(&vstack);
-      *res = ER_INVALID_OPERATOR;
-      return NAN;
+      ok = false;
+      break;
     }
+    ok = ok && (len == 0 || exact_fits(&stack[len - 1]));
   }
 
-  if (vstack.len != 1) {
-    *res = ER_MULTIPLE_RESULTS;
-    return NAN;
+  ok = ok && len == 1;
+  if (ok) {
+    bignum_swap(&result->num, &stack[0].num);
+    bignum_swap(&result->den, &stack[0].den);
   }
+  for (size_t i = 0; i < live; i++) {
+    bigrat_free(&stack[i]);
+  }
+  return ok;
+}
 
-  double evaluated_res = vstack.buf[0];
+bool evaluate_exact(const struct rpn_program *program, const char *expr,
+                    struct bigrat *result) {
+  MemTag tag = mem_tag_swap(MT_EVALUATOR);
+  bool ok = evaluate_bigrat(program, expr, result);
+  mem_tag_swap(tag);
+  return ok;
+}
 
-  vector_free_double(&vstack);
+/* `top` points one past the top of the stack */
+static double evaluate_rpn(const struct rpn_program *program, double *top) {
+  const union rpn_const *operand = program->consts;
+  for (size_t i = 0; i < program->len; i++) {
+    switch ((TokenType)program->ops[i]) {
+    case TT_NUM:
+      *top++ = (operand++)->num;
+      break;
+    case TT_INT:
+      *top++ = (double)(operand++)->integer;
+      break;
+    case TT_NEG:
+      top[-1] = -top[-1];
+      break;
+    case TT_ADD:
+      top[-2] += top[-1];
+      top--;
+      break;
+    case TT_SUB:
+      top[-2] -= top[-1];
+      top--;
+      break;
+    case TT_MULTIPLY:
+      top[-2] *= top[-1];
+      top--;
+      break;
+    case TT_DIVIDE:
+      top[-2] /= top[-1];
+      top--;
+      break;
+    case TT_POW:
+      top[-2] = pow(top[-2], top[-1]);
+      top--;
+      break;
+#define FUNCTION(__name, __tt, __arity, __expr)                                \
+  case __tt: {                                                                 \
+    const double b = top[-1];                                                  \
+    top -= (__arity) - 1;                                                      \
+    const double a = top[-1];                                                  \
+    (void)b;                                                                   \
+    top[-1] = (__expr);                                                        \
+    break;                                                                     \
+  }
+#include "include/functions.def"
+#undef FUNCTION
+    default:
+      /* Ruled out by `parse_math()` */
+      break;
+    }
+  }
+  return top[-1];
+}
 
+double evaluate(const struct rpn_program *program, double *stack,
+                EvaluatorResult *res) {
+  const struct rpn_header *header = &program->header;
+  if (header->result != ER_OK) {
+    *res = header->result;
+    return NAN;
+  }
+  if (header->n_vars > 0) {
+    /* Expressions with variables only run through the VM */
+    *res = ER_UNBOUND_VARIABLE;
+    return NAN;
+  }
+  double inline_stack[EVALUATOR_INLINE_STACK];
+  if (stack == NULL) {
+    if (header->max_depth > EVALUATOR_INLINE_STACK) {
+      *res = ER_TOO_COMPLEX;
+      return NAN;
+    }
+    stack = inline_stack;
+  }
   *res = ER_OK;
-  return evaluated_res;
+  return evaluate_rpn(program, stack);
 }
@@ -0,0 +1,87 @@
+/* Build time generator for the lexer's function lookup table. It searches for
+ * a seed under which `function_hash()` maps every name in functions.def to a
+ * distinct slot and prints the resulting table as a C header. */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/functions.h"
+
+struct function {
+  const char *name;
+  const char *tt;
+};
+
+static const struct function functions[] = {
+#define FUNCTION(__name, __tt, __arity, __expr) {#__name, #__tt},
+#include "include/functions.def"
+#undef FUNCTION
+};
+
+#define N_FUNCTIONS (sizeof(functions) / sizeof(functions[0]))
+#define MAX_SEEDS 1000000
+
+static bool try_seed(uint32_t seed, size_t size, int *slots) {
+  for (size_t i = 0; i < size; i++) {
+    slots[i] = -1;
+  }
+  for (size_t i = 0; i < N_FUNCTIONS; i++) {
+    size_t slot = function_hash(functions[i].name, strlen(functions[i].name),
+                                seed) &
+                  (size - 1);
+    if (slots[slot] != -1) {
+      return false;
+    }
+    slots[slot] = (int)i;
+  }
+  return true;
+}
+
+int main(void) {
+  for (size_t i = 0; i < N_FUNCTIONS; i++) {
+    for (size_t j = i + 1; j < N_FUNCTIONS; j++) {
+      if (strcmp(functions[i].name, functions[j].name) == 0) {
+        fprintf(stderr, "Duplicate function `%s`\n", functions[i].name);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  size_t size = 1;
+  while (size < N_FUNCTIONS) {
+    size <<= 1;
+  }
+
+  int *slots = NULL;
+  for (; size <= N_FUNCTIONS * 16; size <<= 1) {
+    slots = realloc(slots, size * sizeof(int));
+    for (uint32_t seed = 1; seed < MAX_SEEDS; seed++) {
+      if (!try_seed(seed, size, slots)) {
+        continue;
+      }
+
+      printf("/* Generated by src/gen_function_hash.c from functions.def, do "
+             "not edit */\n");
+      printf("#define FUNCTION_HASH_SEED %uu\n", seed);
+      printf("#define FUNCTION_HASH_SIZE %zu\n\n", size);
+      printf("static const struct FunctionTableEntry "
+             "functions_table[FUNCTION_HASH_SIZE] = {\n");
+      for (size_t i = 0; i < size; i++) {
+        if (slots[i] != -1) {
+          const struct function *f = &functions[slots[i]];
+          printf("    [%zu] = {.label = \"%s\", .len = %zu, .tt = %s},\n", i,
+                 f->name, strlen(f->name), f->tt);
+        }
+      }
+      printf("};\n");
+      free(slots);
+      return EXIT_SUCCESS;
+    }
+  }
+
+  fprintf(stderr, "No perfect hash seed found for %zu functions\n",
+          N_FUNCTIONS);
+  free(slots);
+  return EXIT_FAILURE;
+}
@@ -1,66 +1,632 @@
 #define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 #include <concord/log.h>
 
+#include "include/clock.h"
 #include "include/gnuplot.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/pipe_reader.h"
+#include "include/trace.h"
 #include "include/vector.h"
 
-struct vector_char gnuplot_plot(char *expr, int *exit_status) {
-  (void)expr;
+/* A default 640x480 gnuplot PNG is usually a few KiB */
+#define GNUPLOT_PNG_RESERVE (16 * 1024)
+#define GNUPLOT_MAX_PNG_SIZE (8 * 1024 * 1024)
+/* A worker that doesn't finish a plot in time is killed and respawned */
+#define GNUPLOT_TIMEOUT_MS 5000
+#define GNUPLOT_SENTINEL_LEN 64
+#define GNUPLOT_MAX_EVENTS 16
+
+/* epoll data is the worker index shifted left by one, the low bit tells the
+ * worker's stdout from its pidfd */
+#define EV_OUT 0
+#define EV_EXIT 1
+#define EV_WAKE UINT64_MAX
+
+static const char png_signature[8] = "\x89PNG\r\n\x1a\n";
+
+typedef enum { GO_INCOMPLETE, GO_DONE, GO_INVALID } GnuplotOutput;
+
+struct gnuplot_job {
+  char *expr;
+  gnuplot_done_cb done;
+  void *data;
+  uint64_t queued_ns;
+  /* When the plot command was sent */
+  uint64_t started_ns;
+  uint64_t trace_id;
+  struct gnuplot_job *next;
+};
 
-  int pipefd[2];
+struct gnuplot_worker {
+  pid_t pid;
+  /* gnuplot's stdin and stdout */
+  int cmd_fd;
+  int out_fd;
+  /* -1 without pidfd_open(), a dead worker then shows up as EOF on stdout */
+  int pid_fd;
+  size_t spawns;
+  size_t served;
+  unsigned long long seq;
+  struct pipe_reader reader;
+  /* The plot in progress, NULL while idle */
+  struct gnuplot_job *job;
+  struct vector_char out;
+  char sentinel[GNUPLOT_SENTINEL_LEN];
+};
 
-  struct vector_char pngbuf;
-  vector_init_char(&pngbuf);
+static struct {
+  struct gnuplot_worker *workers;
+  size_t size;
+  /* The workers and the idle stack belong to the I/O thread */
+  size_t *idle;
+  size_t n_idle;
+  int epoll_fd;
+  int wake_fd;
+  pthread_t thread;
+  /* Protects everything below */
+  pthread_mutex_t lock;
+  struct gnuplot_job *queue_head;
+  struct gnuplot_job *queue_tail;
+  size_t in_flight;
+  bool stopping;
+  struct gnuplot_pool_stats stats;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-  if (pipe(pipefd) == -1) {
-    log_error("Pipe creation failed");
-    *exit_status = EXIT_FAILURE;
-    return pngbuf;
+bool gnuplot_expression_is_safe(const char *expr) {
+  /* Everything goes into gnuplot's command stream, so anything that could end
+   * the plot command or build a string for system() is rejected */
+  if (strstr(expr, "system") != NULL) {
+    return false;
   }
+  for (; *expr != '\0'; expr++) {
+    switch (*expr) {
+    case '\n':
+    case '\r':
+    case ';':
+    case '`':
+    case '"':
+    case '\'':
+    case '$':
+    case '@':
+    case '#':
+    case '\\':
+      return false;
+    }
+  }
+  return true;
+}
 
-  pid_t pid = fork();
+static void watch_fd(int fd, uint64_t data) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = data};
+  if (epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    log_error("Watching gnuplot fd %d failed: %s", fd, strerror(errno));
+  }
+}
+
+static bool worker_spawn(struct gnuplot_worker *w) {
+  int cmd_pipe[2];
+  int out_pipe[2];
+  if (pipe2(cmd_pipe, O_CLOEXEC) == -1) {
+    log_error("Gnuplot pipe creation failed: %s", strerror(errno));
+    return false;
+  }
+  if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+    log_error("Gnuplot pipe creation failed: %s", strerror(errno));
+    close(cmd_pipe[0]);
+    close(cmd_pipe[1]);
+    return false;
+  }
 
+  pid_t pid = fork();
   if (pid < 0) {
-    log_error("Gnuplot fork failed");
-    *exit_status = EXIT_FAILURE;
-    return pngbuf;
+    log_error("Gnuplot fork failed: %s", strerror(errno));
+    close(cmd_pipe[0]);
+    close(cmd_pipe[1]);
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return false;
   } else if (pid == 0) {
-    close(pipefd[0]);
+    dup2(cmd_pipe[0], STDIN_FILENO);
+    dup2(out_pipe[1], STDOUT_FILENO);
+    execvp("gnuplot", (char *const[]){"gnuplot", NULL});
+    _exit(EXIT_FAILURE);
+  }
+
+  close(cmd_pipe[0]);
+  close(out_pipe[1]);
+  w->pid = pid;
+  w->cmd_fd = cmd_pipe[1];
+  w->out_fd = out_pipe[0];
+  w->pid_fd = (int)syscall(SYS_pidfd_open, pid, 0);
+  w->spawns++;
+  w->served = 0;
+  /* The commands are tiny, if they don't fit in the pipe the worker is stuck
+   * and the I/O thread mustn't wait for it */
+  fcntl(w->cmd_fd, F_SETFL, fcntl(w->cmd_fd, F_GETFL) | O_NONBLOCK);
+  pipe_reader_init(&w->reader, w->out_fd,
+                   GNUPLOT_MAX_PNG_SIZE + GNUPLOT_SENTINEL_LEN,
+                   GNUPLOT_TIMEOUT_MS);
+
+  uint64_t index = (uint64_t)(w - pool.workers);
+  watch_fd(w->out_fd, index << 1 | EV_OUT);
+  if (w->pid_fd != -1) {
+    watch_fd(w->pid_fd, index << 1 | EV_EXIT);
+  }
+  return true;
+}
+
+/* Closing the fds also drops them from the epoll set */
+static void worker_close(struct gnuplot_worker *w) {
+  close(w->cmd_fd);
+  close(w->out_fd);
+  if (w->pid_fd != -1) {
+    close(w->pid_fd);
+  }
+  w->pid = 0;
+}
+
+static void worker_kill(struct gnuplot_worker *w) {
+  if (w->pid <= 0) {
+    return;
+  }
+  pid_t pid = w->pid;
+  kill(pid, SIGKILL);
+  worker_close(w);
+  waitpid(pid, NULL, 0);
+}
+
+static bool worker_alive(struct gnuplot_worker *w) {
+  if (w->pid <= 0) {
+    return false;
+  }
+  if (waitpid(w->pid, NULL, WNOHANG) != 0) {
+    /* Already reaped */
+    worker_close(w);
+    return false;
+  }
+  return true;
+}
+
+static uint32_t read_be32(const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 |
+         (uint32_t)u[3];
+}
+
+/* The PNG is framed by its own chunk structure up to IEND, followed by the
+ * sentinel line. A failed plot only prints the sentinel, or kills gnuplot.
+ * Called again whenever more output arrives, on GO_DONE `png_len` is the
+ * length of the PNG, 0 if the plot failed. */
+static GnuplotOutput parse_output(const struct vector_char *out,
+                                  const char *sentinel, size_t *png_len) {
+  if (out->len == 0) {
+    return GO_INCOMPLETE;
+  }
+
+  /* Offset of the sentinel line, i.e. the end of the PNG if there is one */
+  size_t end = 0;
+  if (out->buf[0] == png_signature[0]) {
+    if (out->len < sizeof(png_signature)) {
+      return GO_INCOMPLETE;
+    }
+    if (memcmp(out->buf, png_signature, sizeof(png_signature)) != 0) {
+      return GO_INVALID;
+    }
+    end = sizeof(png_signature);
+    while (true) {
+      if (out->len < end + 8) {
+        return GO_INCOMPLETE;
+      }
+      uint32_t chunk_len = read_be32(out->buf + end);
+      if (chunk_len > GNUPLOT_MAX_PNG_SIZE - end) {
+        return GO_INVALID;
+      }
+      bool last = memcmp(out->buf + end + 4, "IEND", 4) == 0;
+      end += (size_t)chunk_len + 12;
+      if (last) {
+        break;
+      }
+    }
+  }
+
+  size_t line_len = strlen(sentinel) + 1;
+  if (out->len < end + line_len) {
+    return GO_INCOMPLETE;
+  }
+  /* Anything else means the worker is out of sync with us */
+  if (out->len != end + line_len ||
+      memcmp(out->buf + end, sentinel, line_len - 1) != 0 ||
+      out->buf[end + line_len - 1] != '\n') {
+    return GO_INVALID;
+  }
+  *png_len = end;
+  return GO_DONE;
+}
+
+static void job_complete(struct gnuplot_job *job, struct vector_char *png) {
+  /* The reply is sent from here */
+  trace_set_current(job->trace_id);
+  job->done(png, job->data);
+  trace_set_current(0);
+  free_checked(job->expr);
+  free_checked(job);
+
+  pthread_mutex_lock(&pool.lock);
+  pool.in_flight--;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/* Hands the output to the job's callback and returns the worker to the idle
+ * stack. An unhealthy worker is killed and respawned on its next use. */
+static void worker_finish(struct gnuplot_worker *w, bool healthy,
+                          size_t png_len) {
+  struct gnuplot_job *job = w->job;
+  w->job = NULL;
+  if (healthy) {
+    w->served++;
+    uint64_t now = clock_now_ns();
+    metrics_record_stage(MS_GNUPLOT_READ, now - job->started_ns);
+    trace_record(job->trace_id, "gnuplot_read", job->started_ns, now);
+  } else {
+    worker_kill(w);
+    png_len = 0;
+  }
+  w->out.len = png_len;
+  if (png_len == 0) {
+    vector_free_char(&w->out);
+    w->out = (struct vector_char){0};
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  if (!healthy) {
+    pool.stats.failures++;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  pool.idle[pool.n_idle++] = (size_t)(w - pool.workers);
 
-    dup2(pipefd[1], STDOUT_FILENO);
-    close(pipefd[1]);
+  job_complete(job, &w->out);
+  w->out = (struct vector_char){0};
+}
+
+static void worker_start(struct gnuplot_worker *w, struct gnuplot_job *job) {
+  w->job = job;
+  vector_init_char(&w->out);
+
+  /* Health check, the worker may have died while idle */
+  bool respawned = false;
+  bool reused = false;
+  if (!worker_alive(w)) {
+    respawned = w->spawns > 0;
+    uint64_t fork_start = clock_now_ns();
+    bool spawned = worker_spawn(w);
+    uint64_t fork_end = clock_now_ns();
+    metrics_record_stage(MS_GNUPLOT_FORK, fork_end - fork_start);
+    trace_record(job->trace_id, "gnuplot_spawn", fork_start, fork_end);
+    if (!spawned) {
+      worker_finish(w, false, 0);
+      return;
+    }
+  } else {
+    reused = w->served > 0;
+  }
+
+  uint64_t wait = clock_now_ns() - job->queued_ns;
+  metrics_record_stage(MS_GNUPLOT_WAIT, wait);
+  trace_record(job->trace_id, "gnuplot_wait", job->queued_ns,
+               job->queued_ns + wait);
+  pthread_mutex_lock(&pool.lock);
+  pool.stats.requests++;
+  pool.stats.respawns += respawned;
+  pool.stats.reuses += reused;
+  pool.stats.queue_wait_ns += wait;
+  if (wait > pool.stats.max_queue_wait_ns) {
+    pool.stats.max_queue_wait_ns = wait;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  snprintf(w->sentinel, sizeof(w->sentinel), "bprogbot-done-%d-%llu", w->pid,
+           ++w->seq);
+  /* A plain `reset` keeps variables and functions, and `plot f(x)=0, f(x)`
+   * would then change the plots of everyone this worker serves next */
+  char *cmds = NULL;
+  int len = asprintf(&cmds,
+                     "reset session\n"
+                     "set terminal png\n"
+                     "set output \"/dev/stdout\"\n"
+                     "plot %s\n"
+                     "unset output\n"
+                     "set print \"/dev/stdout\"\n"
+                     "print \"%s\"\n"
+                     "unset print\n",
+                     job->expr, w->sentinel);
+  assert(len != -1);
+  for (int written = 0; written < len;) {
+    ssize_t n = write(w->cmd_fd, cmds + written, len - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      log_error("Writing to gnuplot worker %d failed: %s", w->pid,
+                strerror(errno));
+      free(cmds);
+      worker_finish(w, false, 0);
+      return;
+    }
+    written += n;
+  }
+  free(cmds);
+  job->started_ns = clock_now_ns();
+
+  vector_reserve_char(&w->out, GNUPLOT_PNG_RESERVE);
+  pipe_reader_rearm(&w->reader, GNUPLOT_TIMEOUT_MS);
+}
+
+static void worker_on_output(struct gnuplot_worker *w) {
+  if (w->job == NULL) {
+    /* Output or EOF from an idle worker, it's out of sync or gone */
+    log_error("Idle gnuplot worker %d became readable", w->pid);
+    worker_kill(w);
+    return;
+  }
+
+  PipeReadResult res = pipe_reader_read_available(&w->reader, &w->out);
+  size_t png_len = 0;
+  switch (parse_output(&w->out, w->sentinel, &png_len)) {
+  case GO_DONE:
+    worker_finish(w, true, png_len);
+    break;
+  case GO_INVALID:
+    log_error("Gnuplot worker %d sent unexpected output", w->pid);
+    worker_finish(w, false, 0);
+    break;
+  case GO_INCOMPLETE:
+    if (res != PR_WOULD_BLOCK) {
+      log_error("Reading from gnuplot worker %d failed: %s", w->pid,
+                pipe_read_result_to_str(res));
+      worker_finish(w, false, 0);
+    }
+    break;
+  }
+}
+
+static void worker_on_exit(struct gnuplot_worker *w) {
+  if (w->job != NULL) {
+    /* Whatever it printed before dying is still in the pipe */
+    worker_on_output(w);
+  }
+  if (w->job != NULL) {
+    log_error("Gnuplot worker %d exited mid-plot", w->pid);
+    worker_finish(w, false, 0);
+  } else {
+    worker_kill(w);
+  }
+}
+
+static void schedule(void) {
+  while (pool.n_idle > 0) {
+    pthread_mutex_lock(&pool.lock);
+    struct gnuplot_job *job = pool.queue_head;
+    if (job != NULL) {
+      pool.queue_head = job->next;
+      if (pool.queue_head == NULL) {
+        pool.queue_tail = NULL;
+      }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (job == NULL) {
+      return;
+    }
+    worker_start(&pool.workers[pool.idle[--pool.n_idle]], job);
+  }
+}
+
+/* Milliseconds until the earliest deadline of a running plot, -1 if none */
+static int next_timeout_ms(void) {
+  uint64_t now = clock_now_ns();
+  int timeout = -1;
+  for (size_t i = 0; i < pool.size; i++) {
+    struct gnuplot_worker *w = &pool.workers[i];
+    if (w->job == NULL) {
+      continue;
+    }
+    int ms = w->reader.deadline_ns > now
+                 ? (int)((w->reader.deadline_ns - now) / 1000000) + 1
+                 : 0;
+    if (timeout == -1 || ms < timeout) {
+      timeout = ms;
+    }
+  }
+  return timeout;
+}
+
+static void expire_timeouts(void) {
+  uint64_t now = clock_now_ns();
+  for (size_t i = 0; i < pool.size; i++) {
+    struct gnuplot_worker *w = &pool.workers[i];
+    if (w->job != NULL && now >= w->reader.deadline_ns) {
+      log_error("Reading from gnuplot worker %d failed: %s", w->pid,
+                pipe_read_result_to_str(PR_TIMEOUT));
+      worker_finish(w, false, 0);
+    }
+  }
+}
+
+static void *pool_thread(void *arg) {
+  (void)arg;
+  /* Everything this thread allocates is plot output */
+  mem_tag_swap(MT_PLOT);
+  struct epoll_event events[GNUPLOT_MAX_EVENTS];
+
+  while (true) {
+    pthread_mutex_lock(&pool.lock);
+    bool stopping = pool.stopping;
+    pthread_mutex_unlock(&pool.lock);
+    if (stopping) {
+      break;
+    }
 
-    char *eval_str = NULL;
-    assert(asprintf(&eval_str, "set terminal png; plot %s", expr) != -1);
-    execvp("gnuplot", (char *const[]){"gnuplot", "-e", eval_str, NULL});
-    free(eval_str);
-    exit(EXIT_FAILURE);
+    schedule();
+    int n = epoll_wait(pool.epoll_fd, events, GNUPLOT_MAX_EVENTS,
+                       next_timeout_ms());
+    if (n < 0) {
+      if (errno != EINTR) {
+        log_error("Waiting for gnuplot workers failed: %s", strerror(errno));
+        break;
+      }
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.u64 == EV_WAKE) {
+        uint64_t count;
+        (void)!read(pool.wake_fd, &count, sizeof(count));
+        continue;
+      }
+      struct gnuplot_worker *w = &pool.workers[events[i].data.u64 >> 1];
+      /* Killed earlier in this batch */
+      if (w->pid <= 0) {
+        continue;
+      }
+      if ((events[i].data.u64 & 1) == EV_EXIT) {
+        worker_on_exit(w);
+      } else {
+        worker_on_output(w);
+      }
+    }
+    expire_timeouts();
+  }
+
+  /* Shutting down, nothing in flight gets a plot anymore */
+  for (size_t i = 0; i < pool.size; i++) {
+    if (pool.workers[i].job != NULL) {
+      worker_finish(&pool.workers[i], false, 0);
+    }
   }
+  pthread_mutex_lock(&pool.lock);
+  struct gnuplot_job *job = pool.queue_head;
+  pool.queue_head = NULL;
+  pool.queue_tail = NULL;
+  pthread_mutex_unlock(&pool.lock);
+  while (job != NULL) {
+    struct gnuplot_job *next = job->next;
+    job_complete(job, &(struct vector_char){0});
+    job = next;
+  }
+  return NULL;
+}
+
+void gnuplot_pool_init(size_t size) {
+  /* Writing to a worker that just died must not take the bot down */
+  signal(SIGPIPE, SIG_IGN);
 
-  close(pipefd[1]);
+  pool.size = size > 0 ? size : 1;
+  pool.workers = malloc_checked(pool.size * sizeof(struct gnuplot_worker));
+  pool.idle = malloc_checked(pool.size * sizeof(size_t));
+  for (size_t i = 0; i < pool.size; i++) {
+    /* Spawned on first use */
+    pool.workers[i] = (struct gnuplot_worker){.pid = 0};
+    pool.idle[i] = pool.size - 1 - i;
+  }
+  pool.n_idle = pool.size;
+  pool.stopping = false;
+  pool.stats = (struct gnuplot_pool_stats){.workers = pool.size};
 
-  char buf;
-  // HACK: this is slow
-  while (read(pipefd[0], &buf, sizeof(buf)) > 0) {
-    vector_push_char(&pngbuf, buf);
+  pool.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  pool.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool.epoll_fd == -1 || pool.wake_fd == -1) {
+    log_fatal("Gnuplot pool setup failed: %s", strerror(errno));
+    exit(1);
+  }
+  watch_fd(pool.wake_fd, EV_WAKE);
+  int err = pthread_create(&pool.thread, NULL, pool_thread, NULL);
+  if (err != 0) {
+    log_fatal("Starting the gnuplot I/O thread failed: %s", strerror(err));
+    exit(1);
   }
+}
+
+static void wake_pool(void) {
+  uint64_t one = 1;
+  (void)!write(pool.wake_fd, &one, sizeof(one));
+}
+
+void gnuplot_pool_cleanup(void) {
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  pthread_mutex_unlock(&pool.lock);
+  wake_pool();
+  pthread_join(pool.thread, NULL);
 
-  close(pipefd[0]);
+  for (size_t i = 0; i < pool.size; i++) {
+    struct gnuplot_worker *w = &pool.workers[i];
+    if (w->pid > 0) {
+      /* gnuplot exits on EOF */
+      pid_t pid = w->pid;
+      worker_close(w);
+      waitpid(pid, NULL, 0);
+    }
+  }
+  close(pool.epoll_fd);
+  close(pool.wake_fd);
+  free_checked(pool.workers);
+  free_checked(pool.idle);
+  pool.workers = NULL;
+  pool.idle = NULL;
+  pool.size = 0;
+  pool.n_idle = 0;
+}
 
-  int status;
-  waitpid(pid, &status, 0);
+struct gnuplot_pool_stats gnuplot_pool_get_stats(void) {
+  pthread_mutex_lock(&pool.lock);
+  struct gnuplot_pool_stats stats = pool.stats;
+  pthread_mutex_unlock(&pool.lock);
+  return stats;
+}
 
-  if (WIFEXITED(status)) {
-    int exit_code = WEXITSTATUS(status);
-    *exit_status = exit_code;
-    return pngbuf;
+void gnuplot_plot_async(const char *expr, gnuplot_done_cb done, void *data) {
+  if (!gnuplot_expression_is_safe(expr)) {
+    log_warn("Refusing to pass `%s` to gnuplot", expr);
+    done(&(struct vector_char){0}, data);
+    return;
   }
 
-  *exit_status = EXIT_FAILURE;
-  return pngbuf;
+  MemTag tag = mem_tag_swap(MT_PLOT);
+  struct gnuplot_job *job = malloc_checked(sizeof(struct gnuplot_job));
+  job->expr = malloc_checked(strlen(expr) + 1);
+  mem_tag_swap(tag);
+  strcpy(job->expr, expr);
+  job->done = done;
+  job->data = data;
+  job->queued_ns = clock_now_ns();
+  job->trace_id = trace_current();
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.queue_tail != NULL) {
+    pool.queue_tail->next = job;
+  } else {
+    pool.queue_head = job;
+  }
+  pool.queue_tail = job;
+  if (++pool.in_flight > pool.stats.max_in_flight) {
+    pool.stats.max_in_flight = pool.in_flight;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  wake_pool();
 }
@@ -0,0 +1,75 @@
+#include <stdint.h>
+
+#include "include/histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define MAX_VALUE ((UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1)
+
+static unsigned bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return (unsigned)value;
+  }
+  if (value > MAX_VALUE) {
+    value = MAX_VALUE;
+  }
+  unsigned exponent = 63 - __builtin_clzll(value);
+  unsigned shift = exponent - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+         (unsigned)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper_bound(unsigned index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  unsigned shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1)))
+                   << shift;
+  return lower + (UINT64_C(1) << shift) - 1;
+}
+
+/* The writer owns the histogram, the atomics only keep readers from seeing
+ * torn values */
+void histogram_record(struct histogram *h, uint64_t value) {
+  uint64_t *bucket = &h->buckets[bucket_index(value)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+  if (value > h->max) {
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+  /* Buckets are read after the count, so the buckets never add up to less
+   * than the count */
+  uint64_t count = __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+  dst->count += count;
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  if (max > dst->max) {
+    dst->max = max;
+  }
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t histogram_quantile(const struct histogram *h, double q) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
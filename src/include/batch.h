@@ -0,0 +1,21 @@
+#ifndef __H_BATCH
+#define __H_BATCH 1
+
+#include <stddef.h>
+
+#include "vm.h"
+
+/* Points evaluated per block. Every register of the program gets a column of
+ * this many values, so a block of a typical program stays in L1/L2. */
+#define BATCH_LANES 256
+
+/* Evaluates `program` with `x` bound to every `xs[i]` and stores the result
+ * in `out[i]`, bit for bit what vm_execute() returns for that point. Programs
+ * without variables fill `out` with their single value. */
+void evaluate_batch(const struct vm_program *program, const double *xs,
+                    double *out, size_t n);
+
+/* Instruction set chosen at runtime: "avx2", "sse2" or "scalar" */
+const char *batch_isa(void);
+
+#endif /* __H_BATCH */
@@ -0,0 +1,85 @@
+#ifndef __H_BIGNUM
+#define __H_BIGNUM 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+/* Products where both operands have at least this many limbs use Karatsuba */
+#define BIGNUM_KARATSUBA_THRESHOLD 32
+/* Numbers with more limbs than this are converted to and from strings by
+ * splitting them at powers of the base */
+#define BIGNUM_RADIX_DC_THRESHOLD 32
+
+/* Sign and magnitude. `limbs` is little endian and its top limb is never
+ * zero, so zero has no limbs. Results may alias operands. */
+struct bignum {
+  uint64_t *limbs;
+  size_t len;
+  size_t cap;
+  bool negative;
+};
+
+/* Always in lowest terms with a positive denominator */
+struct bigrat {
+  struct bignum num;
+  struct bignum den;
+};
+
+void bignum_init(struct bignum *n);
+void bignum_free(struct bignum *n);
+void bignum_set_i64(struct bignum *n, int64_t value);
+void bignum_copy(struct bignum *dst, const struct bignum *src);
+void bignum_swap(struct bignum *a, struct bignum *b);
+/* Returns false when `n` doesn't fit */
+bool bignum_to_i64(const struct bignum *n, int64_t *value);
+/* Bits in the magnitude, 0 for zero */
+size_t bignum_bits(const struct bignum *n);
+int bignum_cmp(const struct bignum *a, const struct bignum *b);
+
+void bignum_add(struct bignum *r, const struct bignum *a,
+                const struct bignum *b);
+void bignum_sub(struct bignum *r, const struct bignum *a,
+                const struct bignum *b);
+void bignum_mul(struct bignum *r, const struct bignum *a,
+                const struct bignum *b);
+/* Truncating division like C's, `q` or `r` may be NULL. `b` must not be
+ * zero. */
+void bignum_divmod(struct bignum *q, struct bignum *r, const struct bignum *a,
+                   const struct bignum *b);
+void bignum_pow(struct bignum *r, const struct bignum *base, uint64_t exp);
+/* Never negative */
+void bignum_gcd(struct bignum *r, const struct bignum *a,
+                const struct bignum *b);
+
+/* `str` holds `len` digits in `base`, 2 to 36, in either case and without a
+ * sign or prefix. Returns false if it's empty or holds anything else. */
+bool bignum_from_string(struct bignum *n, const char *str, size_t len,
+                        unsigned base);
+/* Appends the upper case digits of `n` in `base`, after a `-` if it's
+ * negative. Doesn't terminate `out`. */
+void bignum_to_string(const struct bignum *n, unsigned base,
+                      struct vector_char *out);
+
+void bigrat_init(struct bigrat *q);
+void bigrat_free(struct bigrat *q);
+void bigrat_set_i64(struct bigrat *q, int64_t value);
+/* `str` is a `[0-9.]` slice with at most one dot, returns false otherwise */
+bool bigrat_from_decimal(struct bigrat *q, const char *str, size_t len);
+bool bigrat_is_integer(const struct bigrat *q);
+
+void bigrat_add(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b);
+void bigrat_sub(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b);
+void bigrat_mul(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b);
+/* Returns false on division by zero */
+bool bigrat_div(struct bigrat *r, const struct bigrat *a,
+                const struct bigrat *b);
+/* Returns false for zero to a negative power */
+bool bigrat_pow(struct bigrat *r, const struct bigrat *base, int64_t exp);
+
+#endif /* __H_BIGNUM */
@@ -0,0 +1,48 @@
+#ifndef __H_CALC_CACHE
+#define __H_CALC_CACHE 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evaluator.h"
+
+#define CALC_CACHE_DEFAULT_CAPACITY 256
+
+/* Only the outcome is kept, not the program. Exact results that don't fit in
+ * `int_result` are kept as text in `exact`, which the value owns. */
+struct calc_cache_value {
+  double result;
+  bool is_int;
+  int64_t int_result;
+  char *exact;
+  EvaluatorResult error;
+};
+
+struct calc_cache_stats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t len;
+  size_t capacity;
+};
+
+void calc_cache_init(size_t capacity);
+void calc_cache_cleanup(void);
+
+/* Returns the lexemes of `expr` joined without whitespace, except for single
+ * spaces where dropping it would change how `expr` lexes. Anything from the
+ * first lexer error on is kept verbatim. The copy is allocated from `arena`,
+ * or from the heap when `arena` is NULL. */
+char *calc_cache_normalize(const char *expr, struct arena *arena);
+
+/* Copies the cached outcome into `value`, `value->exact` is a copy the caller
+ * frees. */
+bool calc_cache_lookup(const char *key, struct calc_cache_value *value);
+
+/* Takes ownership of `value->exact`. */
+void calc_cache_insert(const char *key, struct calc_cache_value *value);
+
+struct calc_cache_stats calc_cache_get_stats(void);
+
+#endif /* __H_CALC_CACHE */
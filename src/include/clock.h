@@ -0,0 +1,9 @@
+#ifndef __H_CLOCK
+#define __H_CLOCK 1
+
+#include <stdint.h>
+
+/* Monotonic time in nanoseconds, only meaningful relative to other calls */
+uint64_t clock_now_ns(void);
+
+#endif /* __H_CLOCK */
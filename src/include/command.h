@@ -3,23 +3,45 @@
 
 #include <concord/discord.h>
 
+/* Lower classes are served first when the bot is busy */
+typedef enum {
+  /* Cheap replies, run inline on the gateway thread */
+  CC_INTERACTIVE,
+  CC_COMPUTE,
+  /* The first to be shed under load */
+  CC_RENDER
+} CommandClass;
+
+#define N_COMMAND_CLASSES 3
+
 struct Command {
   char *longf;
   char *shortf;
   char *description;
   void (*callback)(struct discord *client, const struct discord_message *event) ;
+  CommandClass class;
+  /* Rate limit tokens taken per use */
+  unsigned cost;
 };
 
-#define N_COMMANDS 8
+#define N_COMMANDS 10
 extern const struct Command commands[N_COMMANDS];
 
+const char *command_class_to_str(CommandClass cc);
+
+/* Replies to `msg` without pinging its author */
+void reply_msg(struct discord *client, const struct discord_message *msg,
+               char *content);
+
 void on_calc(struct discord *client, const struct discord_message *event);
 void on_ping(struct discord *client, const struct discord_message *event);
 void on_plot(struct discord *client, const struct discord_message *event);
 void on_help(struct discord *client, const struct discord_message *event);
+void on_stats(struct discord *client, const struct discord_message *event);
 void on_tobin(struct discord *client, const struct discord_message *event);
 void on_tohex(struct discord *client, const struct discord_message *event);
 void on_todec(struct discord *client, const struct discord_message *event);
+void on_tobase(struct discord *client, const struct discord_message *event);
 void on_why(struct discord *client, const struct discord_message *event);
 
 #endif /* __H_COMMAND */
@@ -0,0 +1,13 @@
+#ifndef __H_CONFIG
+#define __H_CONFIG 1
+
+#include <concord/discord.h>
+
+long config_get_long(struct discord *client, char *const path[],
+                     unsigned depth, long default_value);
+/* Copies the string at `path` without its quotes into `buf` */
+void config_get_string(struct discord *client, char *const path[],
+                       unsigned depth, char *buf, size_t size,
+                       const char *default_value);
+
+#endif /* __H_CONFIG */
@@ -1,18 +1,29 @@
 #ifndef __H_CONVERSION
 #define __H_CONVERSION 1
 
+#include <stddef.h>
+
+#include "bignum.h"
 #include "vector.h"
 
 enum ConversionError {
   CE_OK,
   CE_ATTEMPT_TO_CONVERT_FLOAT,
-  CE_STR_CONVERSION_FAILED
+  CE_STR_CONVERSION_FAILED,
+  CE_INVALID_BASE
 };
 
 const char *conversion_error_to_str(enum ConversionError err);
 
-void convert_to_hex(long long from, struct vector_char *to);
-void convert_to_bin(long long from, struct vector_char *to);
-long long convert_from_string(char *str, enum ConversionError *error);
+/* Appends `from` in `base`, 2 to 36, after its sign and the prefix that
+ * `convert_from_string()` reads it back with: `0b`, `0o` and `0x`, none for
+ * decimal and `<base>#` otherwise. Doesn't terminate `to`. */
+void convert_to_base(const struct bignum *from, unsigned base,
+                     struct vector_char *to);
+/* Parses the `len` characters at `str` into `to`, which must be initialized.
+ * Numbers are optionally negative and written in decimal, with one of the
+ * prefixes above or as `<base>#<digits>`. */
+void convert_from_string(const char *str, size_t len, struct bignum *to,
+                         enum ConversionError *error);
 
 #endif /* __H_CONVERSION */
@@ -0,0 +1,68 @@
+#ifndef __H_DISPATCH
+#define __H_DISPATCH 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <concord/discord.h>
+
+#include "command.h"
+
+#define DISPATCH_DEFAULT_WORKERS 2
+#define DISPATCH_DEFAULT_QUEUE_SIZE 256
+#define DISPATCH_DEFAULT_SLO_MS 2000
+/* Leaves a worker for compute jobs while plots are rendering */
+#define DISPATCH_DEFAULT_RENDER_LIMIT 1
+
+struct dispatch_config {
+  size_t workers;
+  /* Per class */
+  size_t queue_size;
+  /* Jobs of a class running at once, 0 allows one per worker */
+  size_t limits[N_COMMAND_CLASSES];
+  /* Queueing delay past which the lowest class is shed */
+  uint64_t slo_ms;
+};
+
+struct dispatch_class_stats {
+  size_t jobs;
+  size_t queue_depth;
+  size_t max_queue_depth;
+  /* Turned away because the queue was full */
+  size_t rejected;
+  /* Dropped because the bot was over its latency objective */
+  size_t shed;
+  /* Time between queueing and running, summed over `jobs` */
+  uint64_t delay_ns;
+  uint64_t max_delay_ns;
+};
+
+struct dispatch_stats {
+  size_t workers;
+  size_t queue_capacity;
+  struct dispatch_class_stats classes[N_COMMAND_CLASSES];
+  uint64_t uptime_ns;
+};
+
+struct dispatch_worker_stats {
+  size_t jobs;
+  /* Time spent in command callbacks, divide by the uptime for utilization */
+  uint64_t busy_ns;
+};
+
+/* Interactive commands run inline, every other class is copied into a job
+ * and queued for a fixed pool of worker threads. Workers serve the queues in
+ * class order, within each class's concurrency limit. */
+void dispatch_init(const struct dispatch_config *config);
+/* Finishes every queued job before returning */
+void dispatch_cleanup(void);
+
+/* What to register with `discord_set_on_commands()` for each entry of
+ * `commands[]` */
+extern const discord_ev_message dispatch_callbacks[N_COMMANDS];
+
+struct dispatch_stats dispatch_get_stats(void);
+/* Copies at most `n` entries and returns the number of workers */
+size_t dispatch_get_worker_stats(struct dispatch_worker_stats *out, size_t n);
+
+#endif /* __H_DISPATCH */
@@ -1,17 +1,92 @@
 #ifndef __H_EVALUATOR
 #define __H_EVALUATOR 1
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "vector.h"
 
 typedef enum {
   ER_OK,
   ER_MULTIPLE_RESULTS,
   ER_MISSING_OPERAND,
-  ER_INVALID_OPERATOR
+  ER_INVALID_OPERATOR,
+  ER_TOO_COMPLEX,
+  ER_UNBOUND_VARIABLE
 } EvaluatorResult;
 
 const char *evaluator_result_to_str(EvaluatorResult er);
 
-double evaluate(struct vector_token *tokens, EvaluatorResult *res);
+/* What `parse_math()` finds out about a program without running it */
+struct rpn_header {
+  /* How running the program would fail, ER_OK if it can't */
+  EvaluatorResult result;
+  /* Operands on the stack at the deepest point */
+  size_t max_depth;
+  size_t n_consts;
+  /* One more than the highest variable index used */
+  size_t n_vars;
+};
+
+/* Operand of a TT_NUM, TT_INT or TT_VAR token. Variables keep their index
+ * into `variables` in `integer`. */
+union rpn_const {
+  double num;
+  int64_t integer;
+};
+
+/* Where the n-th TT_NUM of a program is in its source, `len` is 0 for the
+ * constants */
+struct rpn_literal {
+  uint32_t offset;
+  uint32_t len;
+};
+
+/* A program as produced by `parse_math()`: one byte per token holding its
+ * TokenType, with the operands in a separate pool. The n-th TT_NUM, TT_INT or
+ * TT_VAR in `ops` takes `consts[n]`, and the n-th TT_NUM also has
+ * `literals[n]` so decimals can be read exactly from the source. All three
+ * share a single block in that order, and are NULL if the program didn't pass
+ * its checks. */
+struct rpn_program {
+  struct rpn_header header;
+  uint8_t *ops;
+  size_t len;
+  union rpn_const *consts;
+  size_t n_operands;
+  struct rpn_literal *literals;
+  size_t n_literals;
+  struct arena *arena;
+};
+
+/* Programs up to this deep don't need a stack from the caller */
+#define EVALUATOR_INLINE_STACK 256
+
+/* Runs a program checked by `parse_math()`. `stack` must hold at least
+ * `header.max_depth` doubles, or be NULL to use one on the C stack. Never
+ * allocates and doesn't check operands as it goes. */
+double evaluate(const struct rpn_program *program, double *stack,
+                EvaluatorResult *res);
+
+/* Exact evaluation of expressions that only combine TT_INT literals with
+ * `+-*^` and divisions without a remainder. Returns false when the expression
+ * needs another evaluator, `overflow` then tells whether it stopped at a
+ * value that doesn't fit in 64 bits, integer literals included. Never
+ * allocates. */
+bool evaluate_int(const struct rpn_program *program, int64_t *result,
+                  bool *overflow);
+
+/* Results with more bits than this are left to floating point */
+#define EVALUATOR_MAX_EXACT_BITS (1 << 17)
+
+struct bigrat;
+
+/* Exact evaluation in arbitrary precision rationals of expressions that only
+ * combine number literals with `+-*^/`, where every exponent is an integer.
+ * `expr` is the source the program was parsed from, literals that don't fit
+ * in a TT_INT are read from the slices in `program->literals`. `result` must
+ * be initialized. Returns false when the expression needs `evaluate()`. */
+bool evaluate_exact(const struct rpn_program *program, const char *expr,
+                    struct bigrat *result);
 
 #endif /* __H_EVALUATOR */
@@ -0,0 +1,22 @@
+#ifndef __H_FUNCTIONS
+#define __H_FUNCTIONS 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FUNCTION_PI 3.14159265358979323846
+#define FUNCTION_E 2.71828182845904523536
+
+/* Shared by the lexer and the generator of the perfect hash table, so both
+ * always agree on the slot of every function name. */
+static inline uint32_t function_hash(const char *name, size_t len,
+                                     uint32_t seed) {
+  uint32_t hash = seed;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 0x01000193u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+#endif /* __H_FUNCTIONS */
@@ -1,6 +1,43 @@
 #ifndef __H_GNUPLOT
 #define __H_GNUPLOT 1
 
-struct vector_char gnuplot_plot(char *expr, int *exit_status);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+#define GNUPLOT_DEFAULT_WORKERS 2
+
+struct gnuplot_pool_stats {
+  size_t workers;
+  size_t requests;
+  /* Requests served by a worker that had already plotted something */
+  size_t reuses;
+  size_t respawns;
+  size_t failures;
+  uint64_t queue_wait_ns;
+  uint64_t max_queue_wait_ns;
+  /* Most plots queued or running at once */
+  size_t max_in_flight;
+};
+
+/* Runs on the pool's I/O thread. `png` is empty if the plot failed,
+ * otherwise the callback owns its buffer. */
+typedef void (*gnuplot_done_cb)(struct vector_char *png, void *data);
+
+/* Workers are long lived gnuplot processes, started on first use and
+ * restarted whenever one dies or stops responding. A single I/O thread feeds
+ * them and waits on all of their pipes at once. */
+void gnuplot_pool_init(size_t size);
+void gnuplot_pool_cleanup(void);
+struct gnuplot_pool_stats gnuplot_pool_get_stats(void);
+
+/* False for anything that could escape the `plot` command */
+bool gnuplot_expression_is_safe(const char *expr);
+
+/* Queues the plot and returns right away, `done` is always called exactly
+ * once. */
+void gnuplot_plot_async(const char *expr, gnuplot_done_cb done, void *data);
 
 #endif /* __H_GNUPLOT */
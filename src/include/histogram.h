@@ -0,0 +1,31 @@
+#ifndef __H_HISTOGRAM
+#define __H_HISTOGRAM 1
+
+#include <stdint.h>
+
+/* Values below 2^HISTOGRAM_SUB_BITS get a bucket each, above that every
+ * power of two is split into 2^HISTOGRAM_SUB_BITS linear buckets, so a
+ * reported value is never more than 1/16 off */
+#define HISTOGRAM_SUB_BITS 4
+/* Larger values are recorded as 2^HISTOGRAM_MAX_BITS - 1, about 18 minutes
+ * in nanoseconds */
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS                                                      \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/* Log-linear histogram in the style of HdrHistogram. Meant to have a single
+ * writer, other threads can read it at any time but only get a snapshot. */
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_record(struct histogram *h, uint64_t value);
+/* Adds a snapshot of `src` to `dst`, which must not be written concurrently */
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+/* Upper bound of the bucket holding the value at quantile `q` (0 to 1) */
+uint64_t histogram_quantile(const struct histogram *h, double q);
+
+#endif /* __H_HISTOGRAM */
@@ -1,9 +1,88 @@
 #ifndef __H_MEM
 #define __H_MEM 1
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_CHUNK_SIZE 4096
+/* How much a request may grow the heap of its thread, 0 for no limit */
+#define MEM_DEFAULT_REQUEST_LIMIT (64 * 1024 * 1024)
+
+/* The subsystem an allocation is charged to */
+typedef enum {
+  MT_OTHER,
+  MT_PARSER,
+  MT_EVALUATOR,
+  MT_CONVERSION,
+  MT_PLOT,
+  MT_COMMAND
+} MemTag;
+
+#define N_MEM_TAGS 6
+
+struct mem_tag_stats {
+  size_t live_bytes;
+  size_t peak_bytes;
+  /* Blocks that weren't freed yet */
+  size_t live_blocks;
+  size_t allocations;
+  size_t reallocs;
+};
+
+const char *mem_tag_to_str(MemTag tag);
+
+/* Every block starts with a header holding its size and tag, so whatever
+ * these return must be released with `free_checked()`, and nothing else
+ * may be. */
 void *malloc_checked(size_t size);
+/* The block stays charged to the tag it was allocated with */
 void *realloc_checked(void *ptr, size_t size);
+void free_checked(void *ptr);
+
+/* Charges the calling thread's allocations to `tag` from now on and returns
+ * the tag they were charged to before */
+MemTag mem_tag_swap(MemTag tag);
+struct mem_tag_stats mem_get_stats(MemTag tag);
+/* Logs every tag that still has live blocks, returns their total size */
+size_t mem_leak_report(void);
+
+/* A request is charged for what its thread allocates minus what it frees.
+ * Going over the limit doesn't fail the allocation, since unwinding from the
+ * middle of a stage could leak or leave a lock held. The request checks
+ * `mem_request_exceeded()` between its stages instead. */
+void mem_set_request_limit(size_t bytes);
+void mem_request_begin(void);
+bool mem_request_exceeded(void);
+void mem_request_end(void);
+
+struct arena_chunk;
+
+/* Bump allocator for short lived allocations. Individual allocations are
+ * never freed, everything is released at once with `arena_reset()`. The
+ * first chunk can be supplied by the caller (e.g. a buffer on the stack), any
+ * overflow goes to heap chunks of at least `chunk_size` bytes. */
+struct arena {
+  unsigned char *buf;
+  size_t cap;
+  size_t used;
+  void *last;
+  unsigned char *initial;
+  size_t initial_size;
+  size_t chunk_size;
+  struct arena_chunk *chunks;
+  size_t allocated;
+  size_t high_water;
+};
+
+void arena_init(struct arena *a, void *initial, size_t initial_size,
+                size_t chunk_size);
+void *arena_alloc(struct arena *a, size_t size);
+/* Grows in place when `ptr` is the most recent allocation. */
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size,
+                    size_t new_size);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
 
 #endif /* __H_MEM */
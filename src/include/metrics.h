@@ -0,0 +1,67 @@
+#ifndef __H_METRICS
+#define __H_METRICS 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command.h"
+#include "histogram.h"
+#include "vector.h"
+
+/* 0 leaves the endpoint off */
+#define METRICS_DEFAULT_PORT 0
+
+/* Where time goes inside the commands */
+typedef enum {
+  MS_PARSE,
+  MS_EVALUATE,
+  MS_PLOT_RENDER,
+  MS_GNUPLOT_FORK,
+  /* Time spent in the pool's queue waiting for a free worker */
+  MS_GNUPLOT_WAIT,
+  /* From sending the plot command to the end of its output */
+  MS_GNUPLOT_READ,
+  MS_DISCORD_SEND
+} MetricStage;
+
+#define N_METRIC_STAGES 7
+
+typedef enum { MC_REPLIES, MC_REPLY_ERRORS, MC_PARSE_ERRORS } MetricCounter;
+
+#define N_METRIC_COUNTERS 3
+
+struct metrics_summary {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t p50_ns;
+  uint64_t p95_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+};
+
+const char *metric_stage_to_str(MetricStage ms);
+const char *metric_counter_to_str(MetricCounter mc);
+
+/* Every thread records into its own shard, so recording never waits and
+ * never bounces cache lines between threads. Reads add all shards up. */
+void metrics_record_command(size_t command, uint64_t ns);
+void metrics_record_stage(MetricStage stage, uint64_t ns);
+void metrics_count(MetricCounter counter);
+
+struct metrics_summary metrics_command_summary(size_t command);
+struct metrics_summary metrics_stage_summary(MetricStage stage);
+uint64_t metrics_counter_get(MetricCounter counter);
+
+/* A table for chat, without the terminating null byte */
+void metrics_format_table(struct vector_char *out);
+/* The Prometheus text exposition format */
+void metrics_format_prometheus(struct vector_char *out);
+
+/* Serves `metrics_format_prometheus()` over HTTP on 127.0.0.1:`port`, and
+ * `trace_format_json()` on `/trace` */
+void metrics_server_start(unsigned port);
+void metrics_server_stop(void);
+/* Frees every shard, nothing may record anymore */
+void metrics_cleanup(void);
+
+#endif /* __H_METRICS */
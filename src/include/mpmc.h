@@ -0,0 +1,38 @@
+#ifndef __H_MPMC
+#define __H_MPMC 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+struct mpmc_cell {
+  size_t seq;
+  void *data;
+};
+
+/* Bounded lock-free multi-producer multi-consumer FIFO of pointers. Every
+ * cell carries a sequence number that tells producers and consumers whose
+ * turn it is, so both sides only ever CAS their own position. */
+struct mpmc_queue {
+  struct mpmc_cell *cells;
+  size_t mask;
+  /* Producers and consumers each get their own cache line */
+  size_t enqueue_pos __attribute__((aligned(MPMC_CACHE_LINE)));
+  size_t dequeue_pos __attribute__((aligned(MPMC_CACHE_LINE)));
+};
+
+/* `capacity` is rounded up to a power of two */
+void mpmc_init(struct mpmc_queue *q, size_t capacity);
+void mpmc_free(struct mpmc_queue *q);
+
+/* False if the queue is full */
+bool mpmc_push(struct mpmc_queue *q, void *data);
+/* NULL if the queue is empty, or the next element is still being pushed */
+void *mpmc_pop(struct mpmc_queue *q);
+
+size_t mpmc_capacity(const struct mpmc_queue *q);
+/* Only a snapshot while other threads are pushing or popping */
+size_t mpmc_size(const struct mpmc_queue *q);
+
+#endif /* __H_MPMC */
@@ -1,6 +1,8 @@
 #ifndef __H_PARSER
 #define __H_PARSER 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 typedef enum {
@@ -8,17 +10,21 @@ typedef enum {
   TT_EMPTY,
   TT_ERROR,
   TT_NUM,
+  TT_INT,
+  TT_VAR,
   TT_OPENPAR,
   TT_CLOSEPAR,
+  TT_COMMA,
   TT_ADD,
   TT_SUB,
   TT_MULTIPLY,
   TT_DIVIDE,
   TT_POW,
-  TT_SQRT,
-  TT_SIN,
-  TT_COS,
-  TT_TAN
+  /* Only in parsed programs, see `parse_math()` */
+  TT_NEG,
+#define FUNCTION(__name, __tt, __arity, __expr) __tt,
+#include "functions.def"
+#undef FUNCTION
 } TokenType;
 
 typedef enum {
@@ -29,17 +35,72 @@ typedef enum {
   PE_NOT_AN_OPERATOR,
   PE_MISSING_OPEN_PARENTHESES,
   PE_UNCLOSED_PARENTHESES,
-  PE_INVALID_FUNCTION
+  PE_INVALID_FUNCTION,
+  PE_UNEXPECTED_COMMA,
+  PE_WRONG_ARGUMENT_COUNT,
+  PE_UNKNOWN_VARIABLE
 } ParseError;
 
+/* `num` of a TT_VAR token is the index of the variable in `variables`.
+ * Integer literals that fit in 64 bits are TT_INT tokens and keep their exact
+ * value in `integer` instead. `offset` is where a TT_NUM starts in the
+ * source, it fills what would otherwise be padding. */
 typedef struct {
   TokenType type;
-  double num;
+  uint32_t offset;
+  union {
+    double num;
+    int64_t integer;
+  };
 } Token;
 
+/* Free variables an expression may use, bound when the program is run */
+#define N_VARIABLES 1
+extern const char *const variables[N_VARIABLES];
+
+/* A token as a slice of the source, the lexer itself never allocates */
+typedef struct {
+  TokenType type;
+  size_t offset;
+  size_t len;
+} Lexeme;
+
+struct lexer {
+  const char *src;
+  size_t pos;
+};
+
 const char *parse_error_to_str(ParseError pe);
 
-struct vector_token parse_math(char *expr, ParseError *error,
-                               size_t *error_index);
+/* Index into `variables`, or -1 if `name` isn't one */
+int variable_index(const char *name, size_t len);
+
+/* Number of arguments a function token takes, 0 for everything else */
+int tt_to_arity(TokenType tt);
+
+void lexer_init(struct lexer *lx, const char *src);
+/* Whitespace is skipped. On error a TT_ERROR lexeme is returned and
+ * `error_index` is set to the 1-based position of the offending character. */
+Lexeme lexer_next(struct lexer *lx, ParseError *error, size_t *error_index);
+
+/* Correctly rounded conversion of a `[0-9.]` slice with at most one dot */
+double parse_decimal(const char *str, size_t len);
+
+struct arena;
+struct rpn_program;
+
+/* When `arena` is not NULL the program is allocated from it. The program is
+ * checked as a whole and described in its header, and is left empty unless
+ * the header says ER_OK. `-` with a single operand becomes TT_NEG and `+`
+ * with a single operand is dropped, so every other operator always has all
+ * of its operands. The program can be freed whatever the outcome. */
+void parse_math(char *expr, struct arena *arena, struct rpn_program *program,
+                ParseError *error, size_t *error_index);
+
+/* Bytes taken by the opcodes, the constant pool and the literal slices */
+size_t rpn_program_size(const struct rpn_program *program);
+/* Moves an arena allocated program to exactly sized heap storage */
+void rpn_program_to_heap(struct rpn_program *program);
+void rpn_program_free(struct rpn_program *program);
 
 #endif /* __H_PARSER */
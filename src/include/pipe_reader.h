@@ -0,0 +1,52 @@
+#ifndef __H_PIPE_READER
+#define __H_PIPE_READER 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+/* Reads never go into less free space than this */
+#define PIPE_READER_MIN_READ (16 * 1024)
+
+typedef enum {
+  PR_OK,
+  PR_EOF,
+  PR_WOULD_BLOCK,
+  PR_TIMEOUT,
+  PR_TOO_LARGE,
+  PR_IO_ERROR
+} PipeReadResult;
+
+/* Reads straight into the spare capacity of the caller's vector, so the
+ * buffer can be handed on without another copy. The fd is switched to
+ * non-blocking and only polled when a read comes back empty. */
+struct pipe_reader {
+  int fd;
+  size_t max_size;
+  uint64_t deadline_ns;
+  /* read() and poll() calls so far */
+  size_t syscalls;
+};
+
+const char *pipe_read_result_to_str(PipeReadResult pr);
+
+/* `timeout_ms` is a wall-clock budget for everything read through the
+ * reader until the next `pipe_reader_rearm()`. */
+void pipe_reader_init(struct pipe_reader *r, int fd, size_t max_size,
+                      unsigned timeout_ms);
+void pipe_reader_rearm(struct pipe_reader *r, unsigned timeout_ms);
+
+/* Appends to `out` until it holds at least `len` bytes. Whatever else is
+ * already in the pipe is appended as well. */
+PipeReadResult pipe_reader_fill(struct pipe_reader *r, struct vector_char *out,
+                                size_t len);
+/* Appends everything up to EOF. */
+PipeReadResult pipe_reader_read_all(struct pipe_reader *r,
+                                    struct vector_char *out);
+/* Appends whatever is in the pipe without waiting, for callers that poll the
+ * fd themselves. Returns PR_WOULD_BLOCK once the pipe is drained. */
+PipeReadResult pipe_reader_read_available(struct pipe_reader *r,
+                                          struct vector_char *out);
+
+#endif /* __H_PIPE_READER */
@@ -0,0 +1,43 @@
+#ifndef __H_PLOT
+#define __H_PLOT 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vector.h"
+
+/* Same canvas and x range as gnuplot's defaults */
+#define PLOT_WIDTH 640
+#define PLOT_HEIGHT 480
+#define PLOT_X_MIN -10.0
+#define PLOT_X_MAX 10.0
+#define PLOT_SAMPLES 1000
+#define PLOT_MAX_CURVES 8
+
+typedef enum { PB_NATIVE, PB_GNUPLOT } PlotBackend;
+
+typedef enum {
+  PLE_OK,
+  PLE_EMPTY,
+  PLE_TOO_MANY_CURVES,
+  PLE_UNSUPPORTED,
+  PLE_NO_FINITE_POINTS,
+  PLE_RANGE_TOO_LARGE
+} PlotError;
+
+const char *plot_backend_to_str(PlotBackend pb);
+/* Returns false if `str` doesn't name a backend */
+bool plot_backend_from_str(const char *str, PlotBackend *pb);
+const char *plot_error_to_str(PlotError pe);
+
+void plot_init(PlotBackend backend);
+PlotBackend plot_get_backend(void);
+
+/* Plots the comma separated expressions of `x` and returns the PNG. Anything
+ * our parser doesn't understand is reported as PLE_UNSUPPORTED so the
+ * caller can hand it to gnuplot instead. So are expressions where gnuplot's
+ * integer arithmetic gives another curve than reals, like `1/2*x` or
+ * `floor(x)/2`, where gnuplot truncates the division. */
+struct vector_char plot_render(const char *expr, PlotError *error);
+
+#endif /* __H_PLOT */
@@ -0,0 +1,65 @@
+#ifndef __H_PLOT_CACHE
+#define __H_PLOT_CACHE 1
+
+#include <stddef.h>
+
+#include "plot.h"
+#include "vector.h"
+
+#define PLOT_CACHE_DEFAULT_BUDGET (8 * 1024 * 1024)
+
+/* A rendered PNG shared between the cache and every reply that uses it */
+struct plot_image {
+  char *buf;
+  size_t len;
+  unsigned refs;
+};
+
+typedef enum {
+  /* `*image` holds a reference */
+  PCR_HIT,
+  /* Nothing cached, the caller has to render the plot and hand it to
+   * `plot_cache_publish()` or `plot_cache_abandon()` */
+  PCR_MISS,
+  /* Another request is rendering the same plot, the waiter will be called
+   * once it's done */
+  PCR_PENDING
+} PlotCacheResult;
+
+/* `image` is NULL if the render failed, otherwise the waiter owns a
+ * reference. Called from whichever thread finishes the render. */
+typedef void (*plot_cache_waiter_cb)(struct plot_image *image, void *data);
+
+struct plot_cache_stats {
+  size_t hits;
+  size_t misses;
+  /* Hits that waited for an in-flight render */
+  size_t coalesced;
+  size_t evictions;
+  size_t len;
+  size_t bytes;
+  size_t budget;
+};
+
+const char *plot_cache_result_to_str(PlotCacheResult pcr);
+
+/* A budget of 0 disables both caching and coalescing */
+void plot_cache_init(size_t budget);
+void plot_cache_cleanup(void);
+
+/* The key covers the normalized expression and everything else that affects
+ * the rendered image. Free with `free()`. */
+char *plot_cache_key(const char *expr, PlotBackend backend);
+
+PlotCacheResult plot_cache_acquire(const char *key, struct plot_image **image,
+                                   plot_cache_waiter_cb waiter, void *data);
+/* Takes ownership of `png` and calls everyone waiting on `key`. Returns the
+ * image with a reference for the caller. */
+struct plot_image *plot_cache_publish(const char *key, struct vector_char *png);
+void plot_cache_abandon(const char *key);
+
+void plot_image_release(struct plot_image *image);
+
+struct plot_cache_stats plot_cache_get_stats(void);
+
+#endif /* __H_PLOT_CACHE */
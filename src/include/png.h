@@ -0,0 +1,23 @@
+#ifndef __H_PNG
+#define __H_PNG 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+/* Running checksums, start with `png_crc32(0, ...)` and `png_adler32(1, ...)` */
+uint32_t png_crc32(uint32_t crc, const unsigned char *buf, size_t len);
+uint32_t png_adler32(uint32_t adler, const unsigned char *buf, size_t len);
+
+/* Appends `data` as a zlib stream, LZ77 with the fixed Huffman codes */
+void png_deflate(const unsigned char *data, size_t len,
+                 struct vector_char *out);
+
+/* Appends an 8 bit palette PNG, `pixels` holds one palette index per pixel
+ * row by row */
+void png_encode_indexed(const unsigned char *pixels, uint32_t width,
+                        uint32_t height, const unsigned char (*palette)[3],
+                        size_t n_colors, struct vector_char *out);
+
+#endif /* __H_PNG */
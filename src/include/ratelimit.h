@@ -0,0 +1,54 @@
+#ifndef __H_RATELIMIT
+#define __H_RATELIMIT 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slots per table, one table for users and one for channels */
+#define RATELIMIT_SLOTS (1 << 14)
+/* Tokens are fixed point with 8 fractional bits in 24 bits */
+#define RATELIMIT_MAX_BURST 0xffff
+
+#define RATELIMIT_DEFAULT_USER_BURST 10
+#define RATELIMIT_DEFAULT_USER_PER_MINUTE 30
+#define RATELIMIT_DEFAULT_CHANNEL_BURST 30
+#define RATELIMIT_DEFAULT_CHANNEL_PER_MINUTE 120
+
+typedef enum { RL_OK, RL_USER_LIMITED, RL_CHANNEL_LIMITED } RateLimitResult;
+
+/* A burst of 0 turns that limit off */
+struct ratelimit_config {
+  unsigned user_burst;
+  unsigned user_per_minute;
+  unsigned channel_burst;
+  unsigned channel_per_minute;
+};
+
+struct ratelimit_stats {
+  size_t admitted;
+  size_t user_limited;
+  size_t channel_limited;
+  /* Buckets that had refilled completely and were dropped by the sweep */
+  size_t evictions;
+  /* Buckets pushed out by a new id because their probe window was full */
+  size_t displaced;
+  size_t live;
+};
+
+const char *ratelimit_result_to_str(RateLimitResult rlr);
+
+void ratelimit_init(const struct ratelimit_config *config);
+void ratelimit_cleanup(void);
+
+uint64_t ratelimit_now_ms(void);
+
+/* Takes `cost` tokens from the user's and the channel's bucket, or from
+ * neither. An id of 0 skips that bucket. `*notify` is only set for the first
+ * rejection after the last admitted request, so a flood gets one reply. */
+RateLimitResult ratelimit_admit(uint64_t user_id, uint64_t channel_id,
+                                unsigned cost, uint64_t now_ms, bool *notify);
+
+struct ratelimit_stats ratelimit_get_stats(void);
+
+#endif /* __H_RATELIMIT */
@@ -0,0 +1,49 @@
+#ifndef __H_TRACE
+#define __H_TRACE 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+/* Spans kept per thread, older ones are overwritten */
+#define TRACE_RING_SIZE 2048
+#define TRACE_MAX_ARGS 2
+/* 0 leaves tracing off */
+#define TRACE_DEFAULT_SAMPLE_EVERY 0
+
+/* A duration attached to a span, e.g. how much of it went into a sub-step
+ * too fine-grained to be a span of its own */
+struct trace_arg {
+  const char *name;
+  uint64_t ns;
+};
+
+/* Traces one request out of every `sample_every`, 0 turns tracing off */
+void trace_init(unsigned sample_every);
+/* Frees every thread's ring, nothing may record anymore */
+void trace_cleanup(void);
+
+/* Decides whether a request is traced. Returns its trace id, or 0 if it
+ * isn't. */
+uint64_t trace_sample(uint64_t request_id);
+/* Spans ended on this thread belong to `id` until the next call, 0 stops
+ * recording */
+void trace_set_current(uint64_t id);
+uint64_t trace_current(void);
+
+/* The start of a span, or 0 if this thread isn't tracing a request */
+uint64_t trace_begin(void);
+/* Span names must be string literals or otherwise outlive the trace */
+void trace_end(const char *name, uint64_t start);
+void trace_end_args(const char *name, uint64_t start,
+                    const struct trace_arg *args, size_t n_args);
+/* Records a span of request `id`, no matter what this thread is tracing */
+void trace_record(uint64_t id, const char *name, uint64_t start,
+                  uint64_t end);
+
+/* Every span still in the rings as Chrome `trace_event` JSON, open it in
+ * chrome://tracing or Perfetto */
+void trace_format_json(struct vector_char *out);
+
+#endif /* __H_TRACE */
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "mem.h"
@@ -10,34 +11,186 @@
 
 #define VECTOR_DEFAULT_CAPACITY 16
 
+/* Capacity doubles on every reallocation so n pushes cost O(n) amortized. */
+static inline size_t vector_next_capacity(size_t cap, size_t min_cap) {
+  size_t new_cap = cap > 0 ? cap * 2 : VECTOR_DEFAULT_CAPACITY;
+  while (new_cap < min_cap) {
+    new_cap *= 2;
+  }
+  return new_cap;
+}
+
+#define VECTOR_PROTOTYPES_DEF(__T, __NAME)                                     \
+  void vector_free_##__NAME(struct vector_##__NAME *v);                        \
+  void vector_init_##__NAME(struct vector_##__NAME *v);                        \
+  void vector_init_arena_##__NAME(struct vector_##__NAME *v,                   \
+                                  struct arena *arena);                        \
+  void vector_reserve_##__NAME(struct vector_##__NAME *v, size_t cap);         \
+  void vector_shrink_to_fit_##__NAME(struct vector_##__NAME *v);               \
+  void vector_push_##__NAME(struct vector_##__NAME *v, __T e);                 \
+  void vector_extend_##__NAME(struct vector_##__NAME *v, const __T *src,       \
+                              size_t n);                                       \
+  void vector_clear_##__NAME(struct vector_##__NAME *v);                       \
+  __T vector_pop_##__NAME(struct vector_##__NAME *v)
+
 #define VECTOR_HEADER_DEF(__T, __NAME)                                         \
   struct vector_##__NAME {                                                     \
     __T *buf;                                                                  \
     size_t len;                                                                \
     size_t cap;                                                                \
+    struct arena *arena;                                                       \
   };                                                                           \
-  void vector_free_##__NAME(struct vector_##__NAME *v);                        \
-  void vector_init_##__NAME(struct vector_##__NAME *v);                        \
-  void vector_push_##__NAME(struct vector_##__NAME *v, __T e);                 \
-  __T vector_pop_##__NAME(struct vector_##__NAME *v)
+  VECTOR_PROTOTYPES_DEF(__T, __NAME)
+
+/* Vectors initialized with `vector_init_arena_*()` draw their memory from
+ * the arena, freeing them is a no-op and the memory is released together with
+ * the arena.
+ *
+ * Small buffer variant: the first `__N` elements live inside the struct, so
+ * short vectors never touch the heap. `buf` points into the struct itself,
+ * which means an initialized vector must not be copied or moved. */
+#define VECTOR_SBO_HEADER_DEF(__T, __NAME, __N)                                \
+  struct vector_##__NAME {                                                     \
+    __T *buf;                                                                  \
+    size_t len;                                                                \
+    size_t cap;                                                                \
+    struct arena *arena;                                                       \
+    __T inline_buf[__N];                                                       \
+  };                                                                           \
+  VECTOR_PROTOTYPES_DEF(__T, __NAME)
 
 #define VECTOR_INIT_DEF(__T, __NAME)                                           \
   void vector_init_##__NAME(struct vector_##__NAME *v) {                       \
     v->buf = malloc_checked(sizeof(__T) * VECTOR_DEFAULT_CAPACITY);            \
     v->cap = VECTOR_DEFAULT_CAPACITY;                                          \
     v->len = 0;                                                                \
+    v->arena = NULL;                                                           \
+  }                                                                            \
+  void vector_init_arena_##__NAME(struct vector_##__NAME *v,                   \
+                                  struct arena *arena) {                       \
+    if (arena == NULL) {                                                       \
+      vector_init_##__NAME(v);                                                 \
+      return;                                                                  \
+    }                                                                          \
+    v->buf = arena_alloc(arena, sizeof(__T) * VECTOR_DEFAULT_CAPACITY);        \
+    v->cap = VECTOR_DEFAULT_CAPACITY;                                          \
+    v->len = 0;                                                                \
+    v->arena = arena;                                                          \
+  }
+
+#define VECTOR_RESERVE_DEF(__T, __NAME)                                        \
+  void vector_reserve_##__NAME(struct vector_##__NAME *v, size_t cap) {        \
+    if (v->cap >= cap) {                                                       \
+      return;                                                                  \
+    }                                                                          \
+    if (v->arena != NULL) {                                                    \
+      v->buf = arena_realloc(v->arena, v->buf, v->cap * sizeof(__T),           \
+                             cap * sizeof(__T));                               \
+    } else {                                                                   \
+      v->buf = realloc_checked(v->buf, cap * sizeof(__T));                     \
+    }                                                                          \
+    v->cap = cap;                                                              \
+  }
+
+#define VECTOR_SHRINK_TO_FIT_DEF(__T, __NAME)                                  \
+  void vector_shrink_to_fit_##__NAME(struct vector_##__NAME *v) {              \
+    size_t cap = v->len > 0 ? v->len : 1;                                      \
+    if (v->arena != NULL || v->cap <= cap) {                                   \
+      return;                                                                  \
+    }                                                                          \
+    v->buf = realloc_checked(v->buf, cap * sizeof(__T));                       \
+    v->cap = cap;                                                              \
+  }
+
+#define VECTOR_FREE_DEF(__T, __NAME)                                           \
+  void vector_free_##__NAME(struct vector_##__NAME *v) {                       \
+    if (v->arena == NULL) {                                                    \
+      free_checked(v->buf);                                                    \
+    }                                                                          \
+    v->cap = 0;                                                                \
+    v->len = 0;                                                                \
+  }
+
+#define VECTOR_SBO_INIT_DEF(__T, __NAME)                                       \
+  void vector_init_##__NAME(struct vector_##__NAME *v) {                       \
+    vector_init_arena_##__NAME(v, NULL);                                       \
+  }                                                                            \
+  void vector_init_arena_##__NAME(struct vector_##__NAME *v,                   \
+                                  struct arena *arena) {                       \
+    v->buf = v->inline_buf;                                                    \
+    v->cap = sizeof(v->inline_buf) / sizeof(__T);                              \
+    v->len = 0;                                                                \
+    v->arena = arena;                                                          \
+  }
+
+#define VECTOR_SBO_RESERVE_DEF(__T, __NAME)                                    \
+  void vector_reserve_##__NAME(struct vector_##__NAME *v, size_t cap) {        \
+    if (v->cap >= cap) {                                                       \
+      return;                                                                  \
+    }                                                                          \
+    if (v->buf == v->inline_buf) {                                             \
+      v->buf = v->arena != NULL ? arena_alloc(v->arena, cap * sizeof(__T))     \
+                                : malloc_checked(cap * sizeof(__T));           \
+      memcpy(v->buf, v->inline_buf, v->len * sizeof(__T));                    \
+    } else if (v->arena != NULL) {                                             \
+      v->buf = arena_realloc(v->arena, v->buf, v->cap * sizeof(__T),           \
+                             cap * sizeof(__T));                               \
+    } else {                                                                   \
+      v->buf = realloc_checked(v->buf, cap * sizeof(__T));                     \
+    }                                                                          \
+    v->cap = cap;                                                              \
+  }
+
+#define VECTOR_SBO_SHRINK_TO_FIT_DEF(__T, __NAME)                              \
+  void vector_shrink_to_fit_##__NAME(struct vector_##__NAME *v) {              \
+    if (v->buf == v->inline_buf || v->arena != NULL) {                         \
+      return;                                                                  \
+    }                                                                          \
+    if (v->len <= sizeof(v->inline_buf) / sizeof(__T)) {                       \
+      memcpy(v->inline_buf, v->buf, v->len * sizeof(__T));                     \
+      free_checked(v->buf);                                                    \
+      v->buf = v->inline_buf;                                                  \
+      v->cap = sizeof(v->inline_buf) / sizeof(__T);                            \
+      return;                                                                  \
+    }                                                                          \
+    if (v->cap > v->len) {                                                     \
+      v->buf = realloc_checked(v->buf, v->len * sizeof(__T));                  \
+      v->cap = v->len;                                                         \
+    }                                                                          \
+  }
+
+#define VECTOR_SBO_FREE_DEF(__T, __NAME)                                       \
+  void vector_free_##__NAME(struct vector_##__NAME *v) {                       \
+    if (v->buf != v->inline_buf && v->arena == NULL) {                         \
+      free_checked(v->buf);                                                    \
+    }                                                                          \
+    v->buf = v->inline_buf;                                                    \
+    v->cap = 0;                                                                \
+    v->len = 0;                                                                \
   }
 
 #define VECTOR_PUSH_DEF(__T, __NAME)                                           \
   void vector_push_##__NAME(struct vector_##__NAME *v, __T e) {                \
     if (v->cap <= v->len) {                                                    \
-      v->cap += VECTOR_DEFAULT_CAPACITY;                                       \
-      v->buf = realloc_checked(v->buf, v->cap * sizeof(__T));                  \
+      vector_reserve_##__NAME(v, vector_next_capacity(v->cap, v->len + 1));    \
     }                                                                          \
     v->buf[v->len] = e;                                                        \
     v->len++;                                                                  \
   }
 
+#define VECTOR_EXTEND_DEF(__T, __NAME)                                         \
+  void vector_extend_##__NAME(struct vector_##__NAME *v, const __T *src,       \
+                              size_t n) {                                      \
+    if (v->cap < v->len + n) {                                                 \
+      vector_reserve_##__NAME(v, vector_next_capacity(v->cap, v->len + n));    \
+    }                                                                          \
+    memcpy(v->buf + v->len, src, n * sizeof(__T));                             \
+    v->len += n;                                                               \
+  }
+
+#define VECTOR_CLEAR_DEF(__T, __NAME)                                          \
+  void vector_clear_##__NAME(struct vector_##__NAME *v) { v->len = 0; }
+
 #define VECTOR_POP_DEF(__T, __NAME)                                            \
   __T vector_pop_##__NAME(struct vector_##__NAME *v) {                         \
     assert(v->len > 0);                                                        \
@@ -45,22 +198,37 @@
     return v->buf[v->len];                                                     \
   }
 
-#define VECTOR_FREE_DEF(__T, __NAME)                                           \
-  void vector_free_##__NAME(struct vector_##__NAME *v) {                       \
-    free(v->buf);                                                              \
-    v->cap = 0;                                                                \
-    v->len = 0;                                                                \
-  }
+#define VECTOR_COMMON_DEF(__T, __NAME)                                         \
+  VECTOR_PUSH_DEF(__T, __NAME)                                                 \
+  VECTOR_EXTEND_DEF(__T, __NAME)                                               \
+  VECTOR_CLEAR_DEF(__T, __NAME)                                                \
+  VECTOR_POP_DEF(__T, __NAME)
 
 #define VECTOR_FUNC_DEF(__T, __NAME)                                           \
   VECTOR_INIT_DEF(__T, __NAME)                                                 \
   VECTOR_FREE_DEF(__T, __NAME)                                                 \
-  VECTOR_PUSH_DEF(__T, __NAME)                                                 \
-  VECTOR_POP_DEF(__T, __NAME)
+  VECTOR_RESERVE_DEF(__T, __NAME)                                              \
+  VECTOR_SHRINK_TO_FIT_DEF(__T, __NAME)                                        \
+  VECTOR_COMMON_DEF(__T, __NAME)
+
+#define VECTOR_SBO_FUNC_DEF(__T, __NAME)                                       \
+  VECTOR_SBO_INIT_DEF(__T, __NAME)                                             \
+  VECTOR_SBO_FREE_DEF(__T, __NAME)                                             \
+  VECTOR_SBO_RESERVE_DEF(__T, __NAME)                                          \
+  VECTOR_SBO_SHRINK_TO_FIT_DEF(__T, __NAME)                                    \
+  VECTOR_COMMON_DEF(__T, __NAME)
+
+#define VECTOR_SMALL_CAPACITY 32
 
 VECTOR_HEADER_DEF(TokenType, tokentype);
 VECTOR_HEADER_DEF(char, char);
 VECTOR_HEADER_DEF(Token, token);
 VECTOR_HEADER_DEF(double, double);
+VECTOR_SBO_HEADER_DEF(double, small_double, VECTOR_SMALL_CAPACITY);
+VECTOR_SBO_HEADER_DEF(Token, small_token, VECTOR_SMALL_CAPACITY);
+
+/* Appends the formatted text without a terminating null byte */
+void vector_char_printf(struct vector_char *v, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
 
 #endif /* __H_VECTOR */
@@ -0,0 +1,70 @@
+#ifndef __H_VM
+#define __H_VM 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evaluator.h"
+#include "mem.h"
+#include "vector.h"
+
+/* Programs with more registers than this run on a heap allocated file */
+#define VM_INLINE_REGISTERS 256
+#define VM_MAX_REGISTERS 0x3fff
+
+typedef enum {
+  OP_RET,
+  OP_NEG,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_POW,
+#define FUNCTION(__name, __tt, __arity, __expr) OP_##__tt,
+#include "functions.def"
+#undef FUNCTION
+  N_OPCODES
+} Opcode;
+
+/* `dst = a <op> b`, operands are register indices */
+typedef struct {
+  uint16_t op;
+  uint16_t dst;
+  uint16_t a;
+  uint16_t b;
+} Instruction;
+
+/* Register file layout: constants first, then the variables, followed by the
+ * temporaries. Variable i is register `n_consts + i` and the temporary for
+ * stack slot n is register `n_consts + n_vars + n`. Variable registers are
+ * never written by the program. */
+struct vm_program {
+  Instruction *code;
+  size_t len;
+  double *consts;
+  uint16_t n_consts;
+  uint16_t n_vars;
+  uint16_t n_regs;
+  struct arena *arena;
+};
+
+/* Compiles the program produced by `parse_math()`, failing the way its
+ * header says it would. Operand counts and the stack depth are checked here
+ * once more, so running the program can't fail. When `arena` is not NULL the
+ * program is allocated from it. */
+EvaluatorResult vm_compile(const struct rpn_program *rpn, struct arena *arena,
+                           struct vm_program *program);
+
+/* `regs` must hold at least `program->n_regs` doubles, with the variables
+ * already stored in their registers. */
+double vm_run(const struct vm_program *program, double *regs);
+
+/* Runs the program on a register file on the stack if it fits. `vars` holds
+ * `program->n_vars` values and may be NULL when there are none. */
+double vm_execute(const struct vm_program *program, const double *vars);
+
+/* Moves an arena allocated program to exactly sized heap storage. */
+void vm_program_to_heap(struct vm_program *program);
+void vm_program_free(struct vm_program *program);
+
+#endif /* __H_VM */
@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <concord/discord.h>
+
+#include "include/calc_cache.h"
+#include "include/clock.h"
+#include "include/command.h"
+#include "include/dispatch.h"
+#include "include/gnuplot.h"
+#include "include/histogram.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/plot.h"
+#include "include/plot_cache.h"
+#include "include/ratelimit.h"
+#include "include/trace.h"
+
+/* Message ids start here so none of them is 0 */
+#define LOADTEST_FIRST_ID 1000
+/* How long to keep waiting for replies once nothing arrives anymore */
+#define LOADTEST_DRAIN_MS 2000
+
+/* Stands in for the gateway client. The command handlers only ever hand it
+ * back to the functions below. */
+struct discord {
+  /* Simulated round trip of a REST call */
+  uint64_t send_ns;
+  size_t replies;
+  size_t reply_bytes;
+};
+
+struct request {
+  struct discord_message msg;
+  struct discord_user author;
+  size_t command;
+  /* When the message was due to arrive, latencies count from here so a
+   * sender that falls behind doesn't hide the delay */
+  uint64_t due_ns;
+  /* First reply, 0 until there is one */
+  uint64_t replied_ns;
+};
+
+static struct {
+  struct request *requests;
+  size_t len;
+  size_t threads;
+  uint64_t interval_ns;
+  uint64_t start_ns;
+  size_t answered;
+} replay;
+
+/* Replies without a message reference (`+ping`, `+help`) belong to the
+ * request the sending thread is running inline */
+static __thread struct request *current_request;
+
+static void sleep_until(uint64_t ns) {
+  struct timespec ts = {.tv_sec = ns / 1000000000ULL,
+                        .tv_nsec = ns % 1000000000ULL};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+CCORDcode discord_create_message(struct discord *client,
+                                 u64snowflake channel_id,
+                                 struct discord_create_message *params,
+                                 struct discord_ret_message *ret) {
+  (void)channel_id;
+  (void)ret;
+  if (client->send_ns > 0) {
+    sleep_until(clock_now_ns() + client->send_ns);
+  }
+
+  size_t bytes = params->content != NULL ? strlen(params->content) : 0;
+  if (params->attachments != NULL) {
+    for (int i = 0; i < params->attachments->size; i++) {
+      bytes += params->attachments->array[i].size;
+    }
+  }
+  __atomic_add_fetch(&client->replies, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&client->reply_bytes, bytes, __ATOMIC_RELAXED);
+
+  struct request *r = current_request;
+  if (params->message_reference != NULL) {
+    uint64_t index = params->message_reference->message_id - LOADTEST_FIRST_ID;
+    r = index < replay.len ? &replay.requests[index] : NULL;
+  }
+  uint64_t unanswered = 0;
+  if (r != NULL &&
+      __atomic_compare_exchange_n(&r->replied_ns, &unanswered,
+                                  clock_now_ns(), false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&replay.answered, 1, __ATOMIC_RELAXED);
+  }
+  return CCORD_OK;
+}
+
+int discord_get_ping(struct discord *client) {
+  return (int)(client->send_ns / 1000000);
+}
+
+static int command_index(const char *name) {
+  for (size_t i = 0; i < N_COMMANDS; i++) {
+    if (strcmp(commands[i].longf, name) == 0 ||
+        strcmp(commands[i].shortf, name) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static void request_init(struct request *r, uint64_t user_id,
+                         uint64_t channel_id, size_t command,
+                         const char *content) {
+  *r = (struct request){.command = command,
+                        .author = {.id = user_id},
+                        .msg = {.channel_id = channel_id}};
+  r->msg.content = malloc_checked(strlen(content) + 1);
+  strcpy(r->msg.content, content);
+}
+
+/* What the synthetic log is made of, `%u` in the content is replaced by a
+ * random number below 100 so some requests repeat and some don't */
+static const struct {
+  const char *command;
+  const char *content;
+  unsigned weight;
+} synthetic_mix[] = {
+    {"calc", "%u + 2 * 3", 30},
+    {"calc", "sqrt(%u) * sin(1) + max(3, 4) ^ 2 / hypot(3, 4)", 15},
+    {"calc", "sin(1 + sin(1 + sin(1 + sin(1 + sin(1 + %u)))))", 5},
+    {"calc", "1 + + %u", 3},
+    {"calc", "3 ^ (100 + %u) - 1", 3},
+    {"calc", "exact 1 / %u + 1 / 7", 2},
+    {"plot", "sin(x) * %u", 4},
+    {"plot", "x ^ 2 / %u, cos(x)", 2},
+    {"tohex", "%u", 10},
+    {"tobin", "%u", 10},
+    {"tobin", "0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF%u", 2},
+    {"todec", "0x%u", 6},
+    {"todec", "0x%u 0b101 36#ZZ%u 7", 2},
+    {"tobase", "36 %u", 2},
+    {"ping", "", 10},
+    {"help", "", 3},
+    {"stats", "", 2},
+};
+#define N_SYNTHETIC                                                            \
+  (sizeof(synthetic_mix) / sizeof(synthetic_mix[0]))
+
+static uint64_t next_random(uint64_t *state) {
+  /* xorshift64* */
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void generate(size_t n, unsigned users, unsigned channels,
+                     uint64_t seed) {
+  unsigned total_weight = 0;
+  for (size_t i = 0; i < N_SYNTHETIC; i++) {
+    total_weight += synthetic_mix[i].weight;
+  }
+  uint64_t state = seed != 0 ? seed : 1;
+  replay.requests = malloc_checked(n * sizeof(struct request));
+  replay.len = n;
+  for (size_t i = 0; i < n; i++) {
+    unsigned pick = next_random(&state) % total_weight;
+    size_t m = 0;
+    while (pick >= synthetic_mix[m].weight) {
+      pick -= synthetic_mix[m].weight;
+      m++;
+    }
+    char content[128];
+    snprintf(content, sizeof(content), synthetic_mix[m].content,
+             (unsigned)(next_random(&state) % 100));
+    request_init(&replay.requests[i], next_random(&state) % users + 1,
+                 next_random(&state) % channels + 1,
+                 (size_t)command_index(synthetic_mix[m].command), content);
+  }
+}
+
+/* One message per line: `<user id> <channel id> <command> <content>`, blank
+ * lines and lines starting with `#` are skipped. The log is repeated until
+ * `n` messages were read, all of it is used when `n` is 0. */
+static bool load_log(const char *path, size_t n) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  size_t cap = n > 0 ? n : 1024;
+  replay.requests = malloc_checked(cap * sizeof(struct request));
+  replay.len = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  size_t line_no = 0;
+  bool read_any = false;
+  while (n == 0 || replay.len < n) {
+    ssize_t len = getline(&line, &line_cap, f);
+    if (len == -1) {
+      if (n == 0 || !read_any) {
+        break;
+      }
+      rewind(f);
+      line_no = 0;
+      continue;
+    }
+    line_no++;
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+
+    uint64_t user_id;
+    uint64_t channel_id;
+    char command[32];
+    int content_start = 0;
+    if (sscanf(line, "%" SCNu64 " %" SCNu64 " %31s %n", &user_id, &channel_id,
+               command, &content_start) != 3 ||
+        command_index(command) < 0) {
+      fprintf(stderr, "%s:%zu: not a message, skipping it\n", path, line_no);
+      continue;
+    }
+    if (replay.len == cap) {
+      cap *= 2;
+      replay.requests =
+          realloc_checked(replay.requests, cap * sizeof(struct request));
+    }
+    request_init(&replay.requests[replay.len++], user_id, channel_id,
+                 (size_t)command_index(command), line + content_start);
+    read_any = true;
+  }
+  free(line);
+  fclose(f);
+  return replay.len > 0;
+}
+
+static bool save_log(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  fprintf(f, "# user channel command content\n");
+  for (size_t i = 0; i < replay.len; i++) {
+    const struct request *r = &replay.requests[i];
+    fprintf(f, "%" PRIu64 " %" PRIu64 " %s %s\n", r->author.id,
+            r->msg.channel_id, commands[r->command].longf, r->msg.content);
+  }
+  fclose(f);
+  return true;
+}
+
+/* Sender `i` delivers messages i, i + threads, ... on their schedule */
+static void *sender_main(void *arg) {
+  struct discord *client = arg;
+  static size_t next_sender;
+  size_t first = __atomic_fetch_add(&next_sender, 1, __ATOMIC_RELAXED);
+  for (size_t i = first; i < replay.len; i += replay.threads) {
+    struct request *r = &replay.requests[i];
+    if (replay.interval_ns > 0) {
+      r->due_ns = replay.start_ns + i * replay.interval_ns;
+      sleep_until(r->due_ns);
+    } else {
+      r->due_ns = clock_now_ns();
+    }
+    current_request = r;
+    dispatch_callbacks[r->command](client, &r->msg);
+    current_request = NULL;
+  }
+  return NULL;
+}
+
+/* Waits for replies still in flight, a request that was dropped silently
+ * (rate limited after the notice) never gets one */
+static void drain(void) {
+  size_t answered = __atomic_load_n(&replay.answered, __ATOMIC_RELAXED);
+  uint64_t quiet_since = clock_now_ns();
+  while (answered < replay.len &&
+         clock_now_ns() - quiet_since < LOADTEST_DRAIN_MS * 1000000ULL) {
+    sleep_until(clock_now_ns() + 10000000);
+    size_t now_answered = __atomic_load_n(&replay.answered, __ATOMIC_RELAXED);
+    if (now_answered != answered) {
+      answered = now_answered;
+      quiet_since = clock_now_ns();
+    }
+  }
+}
+
+static void print_latency_row(const char *name, size_t sent, size_t answered,
+                              const struct histogram *h, double elapsed_s) {
+  printf("%-8s %8zu %8zu %8zu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name,
+         sent, answered, sent - answered, answered / elapsed_s,
+         histogram_quantile(h, 0.5) / 1e6, histogram_quantile(h, 0.9) / 1e6,
+         histogram_quantile(h, 0.99) / 1e6, histogram_quantile(h, 0.999) / 1e6,
+         h->max / 1e6);
+}
+
+static void report(const struct discord *client, uint64_t send_end_ns) {
+  struct histogram *per_command =
+      calloc(N_COMMANDS + 1, sizeof(struct histogram));
+  if (per_command == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  struct histogram *all = &per_command[N_COMMANDS];
+  size_t sent[N_COMMANDS] = {0};
+  size_t answered[N_COMMANDS] = {0};
+  uint64_t last_reply_ns = replay.start_ns;
+  for (size_t i = 0; i < replay.len; i++) {
+    const struct request *r = &replay.requests[i];
+    sent[r->command]++;
+    if (r->replied_ns == 0) {
+      continue;
+    }
+    uint64_t latency =
+        r->replied_ns > r->due_ns ? r->replied_ns - r->due_ns : 0;
+    histogram_record(&per_command[r->command], latency);
+    histogram_record(all, latency);
+    answered[r->command]++;
+    if (r->replied_ns > last_reply_ns) {
+      last_reply_ns = r->replied_ns;
+    }
+  }
+
+  double send_s = (send_end_ns - replay.start_ns) / 1e9;
+  double elapsed_s = (last_reply_ns - replay.start_ns) / 1e9;
+  if (elapsed_s <= 0) {
+    elapsed_s = send_s;
+  }
+  printf("Sent %zu messages in %.2f s (%.1f/s) from %zu threads, %zu replies "
+         "(%.1f KiB) in %.2f s\n\n",
+         replay.len, send_s, replay.len / send_s, replay.threads,
+         client->replies, client->reply_bytes / 1024.0, elapsed_s);
+
+  printf("%-8s %8s %8s %8s %9s %9s %9s %9s %9s %9s\n", "command", "sent",
+         "answered", "silent", "replies/s", "p50 ms", "p90 ms", "p99 ms",
+         "p99.9 ms", "max ms");
+  size_t total_answered = 0;
+  for (size_t c = 0; c < N_COMMANDS; c++) {
+    if (sent[c] > 0) {
+      print_latency_row(commands[c].longf, sent[c], answered[c],
+                        &per_command[c], elapsed_s);
+      total_answered += answered[c];
+    }
+  }
+  print_latency_row("all", replay.len, total_answered, all, elapsed_s);
+  free(per_command);
+
+  struct dispatch_stats stats = dispatch_get_stats();
+  printf("\n%-12s %8s %8s %8s %9s %12s %12s\n", "class", "jobs", "shed",
+         "rejected", "max queue", "avg wait ms", "max wait ms");
+  for (int c = 0; c < N_COMMAND_CLASSES; c++) {
+    const struct dispatch_class_stats *s = &stats.classes[c];
+    printf("%-12s %8zu %8zu %8zu %9zu %12.2f %12.2f\n",
+           command_class_to_str((CommandClass)c), s->jobs, s->shed,
+           s->rejected, s->max_queue_depth,
+           s->jobs > 0 ? s->delay_ns / 1e6 / s->jobs : 0.0,
+           s->max_delay_ns / 1e6);
+  }
+
+  struct ratelimit_stats rl = ratelimit_get_stats();
+  if (rl.user_limited > 0 || rl.channel_limited > 0) {
+    printf("\nRate limit: %zu admitted, %zu user limited, %zu channel "
+           "limited\n",
+           rl.admitted, rl.user_limited, rl.channel_limited);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --log FILE         replay FILE instead of a synthetic log\n"
+          "  --save FILE        write the messages to FILE in log format\n"
+          "  --messages N       messages to send (default 20000, or the whole "
+          "log)\n"
+          "  --rate N           messages per second, 0 for as fast as "
+          "possible (default 1000)\n"
+          "  --threads N        sending threads (default 4)\n"
+          "  --workers N        dispatch workers (default %d)\n"
+          "  --users N          distinct synthetic users (default 1000)\n"
+          "  --channels N       distinct synthetic channels (default 50)\n"
+          "  --send-us N        simulated latency of a reply (default 0)\n"
+          "  --backend NAME     native or gnuplot (default native)\n"
+          "  --ratelimit        apply the default rate limits\n"
+          "  --seed N           seed of the synthetic log (default 1)\n",
+          argv0, DISPATCH_DEFAULT_WORKERS);
+  exit(EXIT_FAILURE);
+}
+
+static unsigned long parse_number(const char *argv0, const char *str) {
+  char *end = NULL;
+  unsigned long n = strtoul(str, &end, 10);
+  if (*str == '\0' || *end != '\0') {
+    usage(argv0);
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  const char *log_path = NULL;
+  const char *save_path = NULL;
+  size_t messages = 0;
+  unsigned long rate = 1000;
+  size_t threads = 4;
+  size_t workers = DISPATCH_DEFAULT_WORKERS;
+  unsigned long users = 1000;
+  unsigned long channels = 50;
+  unsigned long send_us = 0;
+  PlotBackend backend = PB_NATIVE;
+  bool limit = false;
+  uint64_t seed = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ratelimit") == 0) {
+      limit = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    }
+    const char *opt = argv[i];
+    const char *value = argv[++i];
+    if (strcmp(opt, "--log") == 0) {
+      log_path = value;
+    } else if (strcmp(opt, "--save") == 0) {
+      save_path = value;
+    } else if (strcmp(opt, "--messages") == 0) {
+      messages = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--rate") == 0) {
+      rate = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--threads") == 0) {
+      threads = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--workers") == 0) {
+      workers = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--users") == 0) {
+      users = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--channels") == 0) {
+      channels = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--send-us") == 0) {
+      send_us = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--seed") == 0) {
+      seed = parse_number(argv[0], value);
+    } else if (strcmp(opt, "--backend") == 0) {
+      if (!plot_backend_from_str(value, &backend)) {
+        usage(argv[0]);
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (threads == 0 || users == 0 || channels == 0) {
+    usage(argv[0]);
+  }
+
+  if (log_path != NULL) {
+    if (!load_log(log_path, messages)) {
+      fprintf(stderr, "No messages in %s\n", log_path);
+      return EXIT_FAILURE;
+    }
+  } else {
+    generate(messages > 0 ? messages : 20000, users, channels, seed);
+  }
+  /* The array doesn't move anymore */
+  for (size_t i = 0; i < replay.len; i++) {
+    struct request *r = &replay.requests[i];
+    r->msg.id = LOADTEST_FIRST_ID + i;
+    r->msg.author = &r->author;
+  }
+  if (save_path != NULL && !save_log(save_path)) {
+    return EXIT_FAILURE;
+  }
+
+  calc_cache_init(CALC_CACHE_DEFAULT_CAPACITY);
+  plot_init(backend);
+  plot_cache_init(PLOT_CACHE_DEFAULT_BUDGET);
+  gnuplot_pool_init(GNUPLOT_DEFAULT_WORKERS);
+  /* A burst of 0 turns a limit off */
+  struct ratelimit_config ratelimit_config = {0};
+  if (limit) {
+    ratelimit_config = (struct ratelimit_config){
+        .user_burst = RATELIMIT_DEFAULT_USER_BURST,
+        .user_per_minute = RATELIMIT_DEFAULT_USER_PER_MINUTE,
+        .channel_burst = RATELIMIT_DEFAULT_CHANNEL_BURST,
+        .channel_per_minute = RATELIMIT_DEFAULT_CHANNEL_PER_MINUTE};
+  }
+  ratelimit_init(&ratelimit_config);
+  struct dispatch_config dispatch_config = {
+      .workers = workers,
+      .queue_size = DISPATCH_DEFAULT_QUEUE_SIZE,
+      .slo_ms = DISPATCH_DEFAULT_SLO_MS};
+  dispatch_config.limits[CC_RENDER] = DISPATCH_DEFAULT_RENDER_LIMIT;
+  dispatch_init(&dispatch_config);
+
+  struct discord client = {.send_ns = (uint64_t)send_us * 1000};
+  replay.threads = threads;
+  replay.interval_ns = rate > 0 ? 1000000000ULL / rate : 0;
+  pthread_t *senders = malloc_checked(threads * sizeof(pthread_t));
+  replay.start_ns = clock_now_ns();
+  for (size_t i = 0; i < threads; i++) {
+    if (pthread_create(&senders[i], NULL, sender_main, &client) != 0) {
+      fprintf(stderr, "Failed to start sender %zu\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+  for (size_t i = 0; i < threads; i++) {
+    pthread_join(senders[i], NULL);
+  }
+  uint64_t send_end_ns = clock_now_ns();
+  free_checked(senders);
+
+  /* Runs everything still queued, then waits for plots in the gnuplot pool */
+  dispatch_cleanup();
+  drain();
+  report(&client, send_end_ns);
+
+  ratelimit_cleanup();
+  calc_cache_cleanup();
+  gnuplot_pool_cleanup();
+  plot_cache_cleanup();
+  metrics_cleanup();
+  trace_cleanup();
+  for (size_t i = 0; i < replay.len; i++) {
+    free_checked(replay.requests[i].msg.content);
+  }
+  free_checked(replay.requests);
+  /* Every reply has been sent and every module cleaned up */
+  return mem_leak_report() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,7 +7,17 @@
 #include <concord/discord.h>
 #include <concord/log.h>
 
+#include "include/calc_cache.h"
 #include "include/command.h"
+#include "include/config.h"
+#include "include/dispatch.h"
+#include "include/gnuplot.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/plot.h"
+#include "include/plot_cache.h"
+#include "include/ratelimit.h"
+#include "include/trace.h"
 
 void on_ready(struct discord *client, const struct discord_ready *event) {
   (void)client;
@@ -34,20 +44,174 @@ void on_ready(struct discord *client, const struct discord_ready *event) {
   discord_update_presence(client, &status);
 }
 
+static unsigned ratelimit_config_get(struct discord *client, char *field,
+                                     long default_value) {
+  long value = config_get_long(client, (char *const[]){"ratelimit", field}, 2,
+                               default_value);
+  return value > 0 ? (unsigned)value : 0;
+}
+
+static size_t dispatch_config_get(struct discord *client, char *const path[],
+                                  unsigned depth, long default_value) {
+  long value = config_get_long(client, path, depth, default_value);
+  return value > 0 ? (size_t)value : 0;
+}
+
+static void dispatch_cleanup_and_log(void) {
+  struct dispatch_stats stats = dispatch_get_stats();
+  struct dispatch_worker_stats workers[stats.workers];
+  dispatch_get_worker_stats(workers, stats.workers);
+  dispatch_cleanup();
+
+  for (int c = 0; c < N_COMMAND_CLASSES; c++) {
+    struct dispatch_class_stats *class_stats = &stats.classes[c];
+    log_info("Dispatch %s: %zu jobs, %zu rejected, %zu shed, max queue depth "
+             "%zu/%zu, queue delay %.2f ms avg / %.2f ms max",
+             command_class_to_str(c), class_stats->jobs, class_stats->rejected,
+             class_stats->shed, class_stats->max_queue_depth,
+             stats.queue_capacity,
+             class_stats->jobs > 0
+                 ? class_stats->delay_ns / 1e6 / class_stats->jobs
+                 : 0.0,
+             class_stats->max_delay_ns / 1e6);
+  }
+  for (size_t i = 0; i < stats.workers; i++) {
+    log_info("Dispatch worker %zu: %zu jobs, %.1f%% busy", i, workers[i].jobs,
+             stats.uptime_ns > 0
+                 ? 100.0 * (double)workers[i].busy_ns / (double)stats.uptime_ns
+                 : 0.0);
+  }
+}
+
 int main(void) {
   ccord_global_init();
   struct discord *client = discord_config_init("config.json");
   assert(client != NULL);
 
+  long request_limit =
+      config_get_long(client, (char *const[]){"mem", "request_limit"}, 2,
+                      MEM_DEFAULT_REQUEST_LIMIT);
+  mem_set_request_limit(request_limit > 0 ? (size_t)request_limit : 0);
+  bool leak_report =
+      config_get_long(client, (char *const[]){"mem", "leak_report"}, 2, 0) != 0;
+
+  long calc_cache_size =
+      config_get_long(client, (char *const[]){"calc", "cache_size"}, 2,
+                      CALC_CACHE_DEFAULT_CAPACITY);
+  calc_cache_init(calc_cache_size > 0 ? (size_t)calc_cache_size : 0);
+
+  char plot_backend_str[16];
+  config_get_string(client, (char *const[]){"plot", "backend"}, 2,
+                    plot_backend_str, sizeof(plot_backend_str),
+                    plot_backend_to_str(PB_NATIVE));
+  PlotBackend plot_backend;
+  if (!plot_backend_from_str(plot_backend_str, &plot_backend)) {
+    log_warn("Unknown plot backend `%s`, using %s", plot_backend_str,
+             plot_backend_to_str(PB_NATIVE));
+    plot_backend = PB_NATIVE;
+  }
+  plot_init(plot_backend);
+
+  long plot_cache_budget =
+      config_get_long(client, (char *const[]){"plot", "cache_bytes"}, 2,
+                      PLOT_CACHE_DEFAULT_BUDGET);
+  plot_cache_init(plot_cache_budget > 0 ? (size_t)plot_cache_budget : 0);
+
+  long gnuplot_workers =
+      config_get_long(client, (char *const[]){"plot", "gnuplot_workers"}, 2,
+                      GNUPLOT_DEFAULT_WORKERS);
+  gnuplot_pool_init(gnuplot_workers > 0 ? (size_t)gnuplot_workers : 1);
+
+  struct ratelimit_config ratelimit_config = {
+      .user_burst = ratelimit_config_get(client, "user_burst",
+                                         RATELIMIT_DEFAULT_USER_BURST),
+      .user_per_minute = ratelimit_config_get(
+          client, "user_per_minute", RATELIMIT_DEFAULT_USER_PER_MINUTE),
+      .channel_burst = ratelimit_config_get(client, "channel_burst",
+                                            RATELIMIT_DEFAULT_CHANNEL_BURST),
+      .channel_per_minute = ratelimit_config_get(
+          client, "channel_per_minute", RATELIMIT_DEFAULT_CHANNEL_PER_MINUTE)};
+  ratelimit_init(&ratelimit_config);
+
+  struct dispatch_config dispatch_config = {
+      .workers = dispatch_config_get(
+          client, (char *const[]){"dispatch", "workers"}, 2,
+          DISPATCH_DEFAULT_WORKERS),
+      .queue_size = dispatch_config_get(
+          client, (char *const[]){"dispatch", "queue_size"}, 2,
+          DISPATCH_DEFAULT_QUEUE_SIZE),
+      .slo_ms = dispatch_config_get(client,
+                                    (char *const[]){"dispatch", "slo_ms"}, 2,
+                                    DISPATCH_DEFAULT_SLO_MS)};
+  dispatch_config.limits[CC_COMPUTE] = dispatch_config_get(
+      client, (char *const[]){"dispatch", "limits", "compute"}, 3, 0);
+  dispatch_config.limits[CC_RENDER] = dispatch_config_get(
+      client, (char *const[]){"dispatch", "limits", "render"}, 3,
+      DISPATCH_DEFAULT_RENDER_LIMIT);
+  dispatch_init(&dispatch_config);
+
+  long trace_sample_every =
+      config_get_long(client, (char *const[]){"trace", "sample_every"}, 2,
+                      TRACE_DEFAULT_SAMPLE_EVERY);
+  trace_init(trace_sample_every > 0 ? (unsigned)trace_sample_every : 0);
+
+  long metrics_port = config_get_long(
+      client, (char *const[]){"metrics", "port"}, 2, METRICS_DEFAULT_PORT);
+  if (metrics_port > 0 && metrics_port <= 65535) {
+    metrics_server_start((unsigned)metrics_port);
+  }
+
   discord_set_on_ready(client, &on_ready);
   for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
     discord_set_on_commands(
         client, (char *const[]){commands[i].longf, commands[i].shortf}, 2,
-        commands[i].callback);
+        dispatch_callbacks[i]);
   }
 
   discord_run(client);
 
+  metrics_server_stop();
+  dispatch_cleanup_and_log();
+
+  struct ratelimit_stats ratelimit_stats = ratelimit_get_stats();
+  log_info("Rate limit: %zu admitted, %zu user limited, %zu channel limited, "
+           "%zu buckets (%zu evicted, %zu displaced)",
+           ratelimit_stats.admitted, ratelimit_stats.user_limited,
+           ratelimit_stats.channel_limited, ratelimit_stats.live,
+           ratelimit_stats.evictions, ratelimit_stats.displaced);
+  ratelimit_cleanup();
+
+  struct calc_cache_stats cache_stats = calc_cache_get_stats();
+  log_info("Calc cache: %zu hits, %zu misses, %zu evictions", cache_stats.hits,
+           cache_stats.misses, cache_stats.evictions);
+  calc_cache_cleanup();
+
+  struct gnuplot_pool_stats gnuplot_stats = gnuplot_pool_get_stats();
+  log_info("Gnuplot pool: %zu requests, %zu reuses, %zu respawns, %zu "
+           "failures, %zu max in flight, queue wait %.2f ms avg / %.2f ms max",
+           gnuplot_stats.requests, gnuplot_stats.reuses,
+           gnuplot_stats.respawns, gnuplot_stats.failures,
+           gnuplot_stats.max_in_flight,
+           gnuplot_stats.requests > 0 ? gnuplot_stats.queue_wait_ns / 1e6 /
+                                            gnuplot_stats.requests
+                                      : 0.0,
+           gnuplot_stats.max_queue_wait_ns / 1e6);
+  gnuplot_pool_cleanup();
+
+  struct plot_cache_stats plot_stats = plot_cache_get_stats();
+  log_info("Plot cache: %zu hits (%zu coalesced), %zu misses, %zu evictions, "
+           "%zu images in %zu bytes",
+           plot_stats.hits, plot_stats.coalesced, plot_stats.misses,
+           plot_stats.evictions, plot_stats.len, plot_stats.bytes);
+  plot_cache_cleanup();
+
+  metrics_cleanup();
+  trace_cleanup();
+  /* Everything above should have given its memory back by now */
+  if (leak_report && mem_leak_report() == 0) {
+    log_info("No leaks");
+  }
+
   discord_cleanup(client);
   ccord_global_cleanup();
 }
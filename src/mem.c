@@ -1,21 +1,272 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <concord/log.h>
 
+#include "include/mem.h"
+
+#define MEM_MAGIC 0x6d656d21u
+
+/* Padded to the strictest alignment malloc() guarantees, so the block after
+ * it stays suitably aligned */
+union mem_header {
+  struct {
+    size_t size;
+    uint32_t tag;
+    uint32_t magic;
+  } info;
+  long double align;
+  void *align_ptr;
+};
+
+static struct mem_tag_stats stats[N_MEM_TAGS];
+static size_t request_limit = MEM_DEFAULT_REQUEST_LIMIT;
+
+static __thread MemTag current_tag;
+/* Net growth of the heap since the thread's request began */
+static __thread struct {
+  bool active;
+  bool exceeded;
+  int64_t bytes;
+} request;
+
+const char *mem_tag_to_str(MemTag tag) {
+  switch (tag) {
+  case MT_OTHER:
+    return "other";
+  case MT_PARSER:
+    return "parser";
+  case MT_EVALUATOR:
+    return "evaluator";
+  case MT_CONVERSION:
+    return "conversion";
+  case MT_PLOT:
+    return "plot";
+  case MT_COMMAND:
+    return "command";
+  }
+  return "N/A";
+}
+
+MemTag mem_tag_swap(MemTag tag) {
+  MemTag previous = current_tag;
+  current_tag = tag;
+  return previous;
+}
+
+static void charge_request(int64_t bytes) {
+  if (!request.active) {
+    return;
+  }
+  request.bytes += bytes;
+  size_t limit = __atomic_load_n(&request_limit, __ATOMIC_RELAXED);
+  if (!request.exceeded && limit > 0 && request.bytes > (int64_t)limit) {
+    request.exceeded = true;
+    log_warn("Request went over its memory limit of %zu bytes", limit);
+  }
+}
+
+static void charge_tag(MemTag tag, int64_t bytes, int64_t blocks) {
+  struct mem_tag_stats *s = &stats[tag];
+  size_t live = __atomic_add_fetch(&s->live_bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->live_blocks, blocks, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&s->peak_bytes, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&s->peak_bytes, &peak, live, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  charge_request(bytes);
+}
+
+static union mem_header *header_of(void *ptr) {
+  union mem_header *header = (union mem_header *)ptr - 1;
+  if (header->info.magic != MEM_MAGIC) {
+    log_fatal("%p wasn't allocated by malloc_checked()", ptr);
+    exit(1);
+  }
+  return header;
+}
+
 void *malloc_checked(size_t size) {
-  void *ptr = malloc(size);
-  if (ptr == NULL) {
-    log_fatal("Failed to allocate %ld bytes", size);
+  union mem_header *header = malloc(sizeof(union mem_header) + size);
+  if (header == NULL) {
+    log_fatal("Failed to allocate %zu bytes", size);
     exit(1);
   }
-  return ptr;
+  header->info.size = size;
+  header->info.tag = current_tag;
+  header->info.magic = MEM_MAGIC;
+  __atomic_add_fetch(&stats[current_tag].allocations, 1, __ATOMIC_RELAXED);
+  charge_tag(current_tag, (int64_t)size, 1);
+  return header + 1;
 }
 
 void *realloc_checked(void *ptr, size_t size) {
-  void *new_ptr = realloc(ptr, size);
-  if (new_ptr == NULL) {
-    log_fatal("Failed to reallocate %ld bytes", size);
+  if (ptr == NULL) {
+    return malloc_checked(size);
+  }
+  union mem_header *header = header_of(ptr);
+  size_t old_size = header->info.size;
+  header = realloc(header, sizeof(union mem_header) + size);
+  if (header == NULL) {
+    log_fatal("Failed to reallocate %zu bytes", size);
     exit(1);
   }
+  header->info.size = size;
+  __atomic_add_fetch(&stats[header->info.tag].reallocs, 1, __ATOMIC_RELAXED);
+  charge_tag(header->info.tag, (int64_t)size - (int64_t)old_size, 0);
+  return header + 1;
+}
+
+void free_checked(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  union mem_header *header = header_of(ptr);
+  charge_tag(header->info.tag, -(int64_t)header->info.size, -1);
+  /* Catches a second free of the same block */
+  header->info.magic = 0;
+  free(header);
+}
+
+struct mem_tag_stats mem_get_stats(MemTag tag) {
+  const struct mem_tag_stats *s = &stats[tag];
+  return (struct mem_tag_stats){
+      .live_bytes = __atomic_load_n(&s->live_bytes, __ATOMIC_RELAXED),
+      .peak_bytes = __atomic_load_n(&s->peak_bytes, __ATOMIC_RELAXED),
+      .live_blocks = __atomic_load_n(&s->live_blocks, __ATOMIC_RELAXED),
+      .allocations = __atomic_load_n(&s->allocations, __ATOMIC_RELAXED),
+      .reallocs = __atomic_load_n(&s->reallocs, __ATOMIC_RELAXED)};
+}
+
+size_t mem_leak_report(void) {
+  size_t total = 0;
+  for (int tag = 0; tag < N_MEM_TAGS; tag++) {
+    struct mem_tag_stats s = mem_get_stats(tag);
+    if (s.live_blocks > 0) {
+      log_warn("Leaked %zu bytes in %zu blocks tagged %s", s.live_bytes,
+               s.live_blocks, mem_tag_to_str(tag));
+      total += s.live_bytes;
+    }
+  }
+  return total;
+}
+
+void mem_set_request_limit(size_t bytes) {
+  __atomic_store_n(&request_limit, bytes, __ATOMIC_RELAXED);
+}
+
+void mem_request_begin(void) {
+  request.active = true;
+  request.exceeded = false;
+  request.bytes = 0;
+}
+
+bool mem_request_exceeded(void) { return request.exceeded; }
+
+void mem_request_end(void) { request.active = false; }
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  /* Keeps `data` aligned to ARENA_ALIGNMENT */
+  unsigned char pad[ARENA_ALIGNMENT - 2 * sizeof(size_t) % ARENA_ALIGNMENT];
+  unsigned char data[];
+};
+
+static inline size_t align_up(size_t n) {
+  return (n + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void arena_init(struct arena *a, void *initial, size_t initial_size,
+                size_t chunk_size) {
+  a->initial = initial;
+  a->initial_size = initial != NULL ? initial_size : 0;
+  a->chunk_size = chunk_size > 0 ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+  a->chunks = NULL;
+  a->high_water = 0;
+  arena_reset(a);
+}
+
+static void arena_new_chunk(struct arena *a, size_t min_size) {
+  size_t size = a->chunk_size > min_size ? a->chunk_size : min_size;
+  struct arena_chunk *chunk =
+      malloc_checked(sizeof(struct arena_chunk) + size);
+  chunk->size = size;
+  chunk->next = a->chunks;
+  a->chunks = chunk;
+  a->buf = chunk->data;
+  a->cap = size;
+  a->used = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+  size = align_up(size > 0 ? size : 1);
+
+  size_t offset = 0;
+  if (a->buf != NULL) {
+    /* The initial buffer can be unaligned, so align the address itself */
+    offset = align_up((uintptr_t)(a->buf + a->used)) - (uintptr_t)a->buf;
+  }
+  if (a->buf == NULL || offset + size > a->cap) {
+    arena_new_chunk(a, size);
+    offset = 0;
+  }
+
+  void *ptr = a->buf + offset;
+  a->used = offset + size;
+  a->last = ptr;
+
+  a->allocated += size;
+  if (a->allocated > a->high_water) {
+    a->high_water = a->allocated;
+  }
+
+  return ptr;
+}
+
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size,
+                    size_t new_size) {
+  if (ptr == NULL) {
+    return arena_alloc(a, new_size);
+  }
+
+  if (ptr == a->last) {
+    size_t offset = (unsigned char *)ptr - a->buf;
+    size_t old_aligned = align_up(old_size > 0 ? old_size : 1);
+    size_t new_aligned = align_up(new_size > 0 ? new_size : 1);
+    if (offset + new_aligned <= a->cap) {
+      a->used = offset + new_aligned;
+      a->allocated = a->allocated - old_aligned + new_aligned;
+      if (a->allocated > a->high_water) {
+        a->high_water = a->allocated;
+      }
+      return ptr;
+    }
+  }
+
+  void *new_ptr = arena_alloc(a, new_size);
+  memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
   return new_ptr;
 }
+
+void arena_reset(struct arena *a) {
+  struct arena_chunk *chunk = a->chunks;
+  while (chunk != NULL) {
+    struct arena_chunk *next = chunk->next;
+    free_checked(chunk);
+    chunk = next;
+  }
+  a->chunks = NULL;
+  a->buf = a->initial;
+  a->cap = a->initial_size;
+  a->used = 0;
+  a->last = NULL;
+  a->allocated = 0;
+}
+
+void arena_free(struct arena *a) {
+  arena_reset(a);
+  a->buf = NULL;
+  a->cap = 0;
+}
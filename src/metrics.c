@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <concord/log.h>
+
+#include "include/command.h"
+#include "include/histogram.h"
+#include "include/mem.h"
+#include "include/metrics.h"
+#include "include/trace.h"
+#include "include/vector.h"
+
+#define METRICS_BACKLOG 8
+/* A stuck scraper can't hold up the next one for longer */
+#define METRICS_IO_TIMEOUT_S 1
+#define METRICS_REQUEST_MAX 4096
+
+/* Command histograms first, then the stages */
+#define N_HISTOGRAMS (N_COMMANDS + N_METRIC_STAGES)
+
+struct metrics_shard {
+  struct histogram histograms[N_HISTOGRAMS];
+  uint64_t counters[N_METRIC_COUNTERS];
+  struct metrics_shard *next;
+};
+
+/* Shards are only ever added until `metrics_cleanup()` */
+static struct metrics_shard *shards;
+static __thread struct metrics_shard *local_shard;
+
+static struct {
+  int listen_fd;
+  int wake_fd;
+  pthread_t thread;
+  bool running;
+} server;
+
+const char *metric_stage_to_str(MetricStage ms) {
+  switch (ms) {
+  case MS_PARSE:
+    return "parse";
+  case MS_EVALUATE:
+    return "evaluate";
+  case MS_PLOT_RENDER:
+    return "plot_render";
+  case MS_GNUPLOT_FORK:
+    return "gnuplot_fork";
+  case MS_GNUPLOT_WAIT:
+    return "gnuplot_wait";
+  case MS_GNUPLOT_READ:
+    return "gnuplot_read";
+  case MS_DISCORD_SEND:
+    return "discord_send";
+  }
+  return "N/A";
+}
+
+const char *metric_counter_to_str(MetricCounter mc) {
+  switch (mc) {
+  case MC_REPLIES:
+    return "replies";
+  case MC_REPLY_ERRORS:
+    return "reply_errors";
+  case MC_PARSE_ERRORS:
+    return "parse_errors";
+  }
+  return "N/A";
+}
+
+static struct metrics_shard *shard_get(void) {
+  if (local_shard == NULL) {
+    struct metrics_shard *shard = malloc_checked(sizeof(struct metrics_shard));
+    memset(shard, 0, sizeof(struct metrics_shard));
+    shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    local_shard = shard;
+  }
+  return local_shard;
+}
+
+void metrics_record_command(size_t command, uint64_t ns) {
+  histogram_record(&shard_get()->histograms[command], ns);
+}
+
+void metrics_record_stage(MetricStage stage, uint64_t ns) {
+  histogram_record(&shard_get()->histograms[N_COMMANDS + stage], ns);
+}
+
+void metrics_count(MetricCounter counter) {
+  uint64_t *value = &shard_get()->counters[counter];
+  __atomic_store_n(value, *value + 1, __ATOMIC_RELAXED);
+}
+
+static struct metrics_summary summarize(size_t index) {
+  struct histogram merged = {0};
+  for (struct metrics_shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+       shard != NULL; shard = shard->next) {
+    histogram_merge(&merged, &shard->histograms[index]);
+  }
+  return (struct metrics_summary){.count = merged.count,
+                                  .sum_ns = merged.sum,
+                                  .p50_ns = histogram_quantile(&merged, 0.5),
+                                  .p95_ns = histogram_quantile(&merged, 0.95),
+                                  .p99_ns = histogram_quantile(&merged, 0.99),
+                                  .max_ns = merged.max};
+}
+
+struct metrics_summary metrics_command_summary(size_t command) {
+  return summarize(command);
+}
+
+struct metrics_summary metrics_stage_summary(MetricStage stage) {
+  return summarize(N_COMMANDS + stage);
+}
+
+uint64_t metrics_counter_get(MetricCounter counter) {
+  uint64_t total = 0;
+  for (struct metrics_shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+       shard != NULL; shard = shard->next) {
+    total += __atomic_load_n(&shard->counters[counter], __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+static void append_row(struct vector_char *out, const char *prefix,
+                       const char *name, const struct metrics_summary *s) {
+  vector_char_printf(out, "%s%-13s %7llu %8.3f %8.3f %8.3f %8.3f\n", prefix,
+                     name, (unsigned long long)s->count, s->p50_ns / 1e6,
+                     s->p95_ns / 1e6, s->p99_ns / 1e6, s->max_ns / 1e6);
+}
+
+void metrics_format_table(struct vector_char *out) {
+  vector_char_printf(out, "```\n%-14s %7s %8s %8s %8s %8s\n", "ms", "count",
+                     "p50", "p95", "p99", "max");
+  for (size_t i = 0; i < N_COMMANDS; i++) {
+    struct metrics_summary s = metrics_command_summary(i);
+    if (s.count > 0) {
+      append_row(out, "+", commands[i].longf, &s);
+    }
+  }
+  for (int i = 0; i < N_METRIC_STAGES; i++) {
+    struct metrics_summary s = metrics_stage_summary(i);
+    if (s.count > 0) {
+      append_row(out, " ", metric_stage_to_str(i), &s);
+    }
+  }
+  for (int i = 0; i < N_METRIC_COUNTERS; i++) {
+    vector_char_printf(out, "%s%s %llu", i > 0 ? ", " : "",
+                       metric_counter_to_str(i),
+                       (unsigned long long)metrics_counter_get(i));
+  }
+  vector_char_printf(out, "\nKiB live/peak:");
+  for (int i = 0; i < N_MEM_TAGS; i++) {
+    struct mem_tag_stats s = mem_get_stats(i);
+    vector_char_printf(out, " %s %zu/%zu", mem_tag_to_str(i),
+                       s.live_bytes / 1024, s.peak_bytes / 1024);
+  }
+  vector_char_printf(out, "\n```");
+}
+
+static void append_summary(struct vector_char *out, const char *name,
+                           const char *label, const char *value,
+                           const struct metrics_summary *s) {
+  const struct {
+    const char *quantile;
+    uint64_t ns;
+  } quantiles[] = {{"0.5", s->p50_ns}, {"0.95", s->p95_ns},
+                   {"0.99", s->p99_ns}, {"1", s->max_ns}};
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    vector_char_printf(out, "%s{%s=\"%s\",quantile=\"%s\"} ", name, label,
+                       value, quantiles[i].quantile);
+    /* Quantiles of nothing are undefined */
+    if (s->count > 0) {
+      vector_char_printf(out, "%.9g\n", quantiles[i].ns / 1e9);
+    } else {
+      vector_char_printf(out, "NaN\n");
+    }
+  }
+  vector_char_printf(out, "%s_sum{%s=\"%s\"} %.9g\n", name, label, value,
+                     s->sum_ns / 1e9);
+  vector_char_printf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value,
+                     (unsigned long long)s->count);
+}
+
+void metrics_format_prometheus(struct vector_char *out) {
+  vector_char_printf(out,
+                     "# HELP bprogbot_command_duration_seconds Time spent in "
+                     "command callbacks.\n"
+                     "# TYPE bprogbot_command_duration_seconds summary\n");
+  for (size_t i = 0; i < N_COMMANDS; i++) {
+    struct metrics_summary s = metrics_command_summary(i);
+    append_summary(out, "bprogbot_command_duration_seconds", "command",
+                   commands[i].longf, &s);
+  }
+
+  vector_char_printf(out,
+                     "# HELP bprogbot_stage_duration_seconds Time spent in the "
+                     "stages of a command.\n"
+                     "# TYPE bprogbot_stage_duration_seconds summary\n");
+  for (int i = 0; i < N_METRIC_STAGES; i++) {
+    struct metrics_summary s = metrics_stage_summary(i);
+    append_summary(out, "bprogbot_stage_duration_seconds", "stage",
+                   metric_stage_to_str(i), &s);
+  }
+
+  for (int i = 0; i < N_METRIC_COUNTERS; i++) {
+    const char *name = metric_counter_to_str(i);
+    vector_char_printf(
+        out, "# TYPE bprogbot_%s_total counter\nbprogbot_%s_total %llu\n",
+        name, name, (unsigned long long)metrics_counter_get(i));
+  }
+
+  const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+  } mem_metrics[] = {
+      {"memory_live_bytes", "gauge", "Bytes currently allocated."},
+      {"memory_peak_bytes", "gauge", "Most bytes allocated at once."},
+      {"memory_live_blocks", "gauge", "Blocks currently allocated."},
+      {"memory_allocations_total", "counter", "Blocks allocated."},
+      {"memory_reallocs_total", "counter", "Blocks resized."}};
+  struct mem_tag_stats mem[N_MEM_TAGS];
+  for (int i = 0; i < N_MEM_TAGS; i++) {
+    mem[i] = mem_get_stats(i);
+  }
+  for (size_t m = 0; m < sizeof(mem_metrics) / sizeof(mem_metrics[0]); m++) {
+    vector_char_printf(out, "# HELP bprogbot_%s %s\n# TYPE bprogbot_%s %s\n",
+                       mem_metrics[m].name, mem_metrics[m].help,
+                       mem_metrics[m].name, mem_metrics[m].type);
+    for (int i = 0; i < N_MEM_TAGS; i++) {
+      size_t values[] = {mem[i].live_bytes, mem[i].peak_bytes,
+                         mem[i].live_blocks, mem[i].allocations,
+                         mem[i].reallocs};
+      vector_char_printf(out, "bprogbot_%s{tag=\"%s\"} %zu\n",
+                         mem_metrics[m].name, mem_tag_to_str(i), values[m]);
+    }
+  }
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+/* `GET /trace` gets the trace rings, every other request the metrics */
+static void serve(int fd) {
+  struct timeval timeout = {.tv_sec = METRICS_IO_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* Closing with unread request bytes would reset the connection and could
+   * cut off the response */
+  char request[METRICS_REQUEST_MAX + 1];
+  size_t request_len = 0;
+  while (request_len < METRICS_REQUEST_MAX) {
+    ssize_t n = recv(fd, request + request_len,
+                     METRICS_REQUEST_MAX - request_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    request_len += (size_t)n;
+    request[request_len] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
+  }
+
+  bool trace = request_len >= strlen("GET /trace ") &&
+               strncmp(request, "GET /trace ", strlen("GET /trace ")) == 0;
+  struct vector_char body;
+  vector_init_char(&body);
+  if (trace) {
+    trace_format_json(&body);
+  } else {
+    metrics_format_prometheus(&body);
+  }
+  char header[128];
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n",
+                            trace ? "application/json"
+                                  : "text/plain; version=0.0.4",
+                            body.len);
+  if (!send_all(fd, header, (size_t)header_len) ||
+      !send_all(fd, body.buf, body.len)) {
+    log_warn("Sending metrics failed: %s", strerror(errno));
+  }
+  vector_free_char(&body);
+}
+
+static void *server_main(void *arg) {
+  (void)arg;
+  struct pollfd fds[2] = {{.fd = server.listen_fd, .events = POLLIN},
+                          {.fd = server.wake_fd, .events = POLLIN}};
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Polling the metrics socket failed: %s", strerror(errno));
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if (fds[0].revents == 0) {
+      continue;
+    }
+    int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        log_warn("Accepting a metrics connection failed: %s", strerror(errno));
+      }
+      continue;
+    }
+    serve(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+void metrics_server_start(unsigned port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    log_error("Metrics socket creation failed: %s", strerror(errno));
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons((uint16_t)port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, METRICS_BACKLOG) == -1) {
+    log_error("Serving metrics on 127.0.0.1:%u failed: %s", port,
+              strerror(errno));
+    close(fd);
+    return;
+  }
+
+  server.listen_fd = fd;
+  server.wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (server.wake_fd == -1) {
+    log_fatal("Metrics eventfd creation failed: %s", strerror(errno));
+    exit(1);
+  }
+  int err = pthread_create(&server.thread, NULL, server_main, NULL);
+  if (err != 0) {
+    log_fatal("Starting the metrics server failed: %s", strerror(err));
+    exit(1);
+  }
+  server.running = true;
+  log_info("Serving metrics on 127.0.0.1:%u", port);
+}
+
+void metrics_server_stop(void) {
+  if (!server.running) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(server.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    log_error("Waking the metrics server failed: %s", strerror(errno));
+  }
+  pthread_join(server.thread, NULL);
+  close(server.listen_fd);
+  close(server.wake_fd);
+  server.running = false;
+}
+
+void metrics_cleanup(void) {
+  struct metrics_shard *shard = __atomic_exchange_n(&shards, NULL,
+                                                    __ATOMIC_ACQ_REL);
+  while (shard != NULL) {
+    struct metrics_shard *next = shard->next;
+    free_checked(shard);
+    shard = next;
+  }
+  local_shard = NULL;
+}
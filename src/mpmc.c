@@ -0,0 +1,84 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "include/mem.h"
+#include "include/mpmc.h"
+
+void mpmc_init(struct mpmc_queue *q, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  q->cells = malloc_checked(size * sizeof(struct mpmc_cell));
+  for (size_t i = 0; i < size; i++) {
+    q->cells[i] = (struct mpmc_cell){.seq = i, .data = NULL};
+  }
+  q->mask = size - 1;
+  q->enqueue_pos = 0;
+  q->dequeue_pos = 0;
+}
+
+void mpmc_free(struct mpmc_queue *q) {
+  free_checked(q->cells);
+  q->cells = NULL;
+  q->mask = 0;
+}
+
+bool mpmc_push(struct mpmc_queue *q, void *data) {
+  struct mpmc_cell *cell;
+  size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+  while (true) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      /* The cell is free, claim it */
+      if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Still holds the element from one lap ago */
+      return false;
+    } else {
+      pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->data = data;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void *mpmc_pop(struct mpmc_queue *q) {
+  struct mpmc_cell *cell;
+  size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+  while (true) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  void *data = cell->data;
+  /* Free for the producer one lap ahead */
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return data;
+}
+
+size_t mpmc_capacity(const struct mpmc_queue *q) { return q->mask + 1; }
+
+size_t mpmc_size(const struct mpmc_queue *q) {
+  size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+  return tail > head ? tail - head : 0;
+}
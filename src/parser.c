@@ -1,11 +1,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "include/clock.h"
+#include "include/evaluator.h"
+#include "include/functions.h"
+#include "include/mem.h"
 #include "include/parser.h"
+#include "include/trace.h"
 #include "include/vector.h"
 
 static void unreachable() { assert("UNREACHABLE" == NULL); }
@@ -28,6 +34,12 @@ const char *parse_error_to_str(ParseError pe) {
     return "UNCLOSED_PARENTHESES";
   case PE_INVALID_FUNCTION:
     return "INVALID_FUNCTION";
+  case PE_UNEXPECTED_COMMA:
+    return "UNEXPECTED_COMMA";
+  case PE_WRONG_ARGUMENT_COUNT:
+    return "WRONG_ARGUMENT_COUNT";
+  case PE_UNKNOWN_VARIABLE:
+    return "UNKNOWN_VARIABLE";
   }
   return "N/A";
 }
@@ -44,175 +56,376 @@ static int tt_to_precedence(TokenType tt) {
     return 3;
   case TT_POW:
     return 4;
-  case TT_SQRT:
-  case TT_SIN:
-  case TT_COS:
-  case TT_TAN:
+  case TT_NEG:
+    return -1;
+#define FUNCTION(__name, __tt, __arity, __expr) case __tt:
+#include "include/functions.def"
+#undef FUNCTION
     return 5;
   case TT_EOF:
   case TT_EMPTY:
   case TT_ERROR:
   case TT_NUM:
+  case TT_INT:
+  case TT_VAR:
   case TT_OPENPAR:
   case TT_CLOSEPAR:
+  case TT_COMMA:
     return -1;
   }
   return 0;
 }
 
+int tt_to_arity(TokenType tt) {
+  switch (tt) {
+#define FUNCTION(__name, __tt, __arity, __expr)                                \
+  case __tt:                                                                   \
+    return __arity;
+#include "include/functions.def"
+#undef FUNCTION
+  default:
+    return 0;
+  }
+}
+
+static inline bool is_function(TokenType tt) { return tt_to_arity(tt) > 0; }
+
+const char *const variables[N_VARIABLES] = {"x"};
+
+int variable_index(const char *name, size_t len) {
+  for (int i = 0; i < N_VARIABLES; i++) {
+    if (strlen(variables[i]) == len && memcmp(variables[i], name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 struct FunctionTableEntry {
-  char *label;
+  const char *label;
+  size_t len;
   TokenType tt;
 };
 
-const struct FunctionTableEntry functions_table[] = {
-    {.label = "sqrt", .tt = TT_SQRT},
-    {.label = "sin", .tt = TT_SIN},
-    {.label = "cos", .tt = TT_COS},
-    {.label = "tan", .tt = TT_TAN}};
+/* Defines FUNCTION_HASH_SEED, FUNCTION_HASH_SIZE and the collision free
+ * `functions_table`, generated from functions.def by src/gen_function_hash.c */
+#include "include/function_hash.h"
+
+/* Powers of ten that are exactly representable as a double */
+static const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
 
-#define RET_TOKEN(__tt)                                                        \
-  (*str)++;                                                                    \
-  (*error_index)++;                                                            \
-  return (Token) { .type = __tt }
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+#define MAX_MANTISSA_DIGITS 19
+/* 767 significant digits are enough to round any decimal correctly, the
+ * digit after that only has to tell whether anything non-zero was cut off */
+#define MAX_SIGNIFICANT_DIGITS 768
 
-static Token next_token(char **str, ParseError *error, size_t *error_index) {
-  if (isspace(**str)) {
-    RET_TOKEN(TT_EMPTY);
+/* Slow path for literals the fast path can't round exactly. The significant
+ * digits are rewritten as `<digits>e<exponent>` into a buffer on the stack so
+ * strtod() never sees anything past the literal. */
+static double parse_decimal_slow(const char *str, size_t len) {
+  char buf[MAX_SIGNIFICANT_DIGITS + 32];
+  size_t n_digits = 0;
+  long exponent = 0;
+  bool seen_dot = false;
+  bool truncated = false;
+
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] == '.') {
+      seen_dot = true;
+      continue;
+    }
+    if (str[i] == '0' && n_digits == 0) {
+      exponent -= seen_dot;
+      continue;
+    }
+    if (n_digits < MAX_SIGNIFICANT_DIGITS) {
+      buf[n_digits++] = str[i];
+      exponent -= seen_dot;
+    } else {
+      truncated |= str[i] != '0';
+      exponent += !seen_dot;
+    }
   }
 
-  switch (**str) {
+  if (n_digits == 0) {
+    return 0.0;
+  }
+  if (truncated) {
+    buf[n_digits++] = '1';
+    exponent--;
+  }
+  snprintf(buf + n_digits, sizeof(buf) - n_digits, "e%ld", exponent);
+
+  return strtod(buf, NULL);
+}
+
+double parse_decimal(const char *str, size_t len) {
+  uint64_t mantissa = 0;
+  int n_digits = 0;
+  int exponent = 0;
+  bool seen_dot = false;
+
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] == '.') {
+      seen_dot = true;
+      continue;
+    }
+    if (str[i] == '0' && n_digits == 0) {
+      exponent -= seen_dot;
+      continue;
+    }
+    if (n_digits == MAX_MANTISSA_DIGITS) {
+      return parse_decimal_slow(str, len);
+    }
+    mantissa = mantissa * 10 + (uint64_t)(str[i] - '0');
+    n_digits++;
+    exponent -= seen_dot;
+  }
+
+  if (mantissa == 0) {
+    return 0.0;
+  }
+
+  /* Clinger's fast path: both operands are exact, so the single IEEE
+   * multiplication or division is correctly rounded */
+  if (mantissa <= MAX_EXACT_MANTISSA && exponent >= -22 && exponent <= 22) {
+    return exponent >= 0 ? (double)mantissa * exact_powers_of_ten[exponent]
+                         : (double)mantissa / exact_powers_of_ten[-exponent];
+  }
+
+  return parse_decimal_slow(str, len);
+}
+
+/* Fails on a dot or when the value doesn't fit */
+static bool parse_integer(const char *str, size_t len, int64_t *value) {
+  int64_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] == '.' || __builtin_mul_overflow(n, 10, &n) ||
+        __builtin_add_overflow(n, str[i] - '0', &n)) {
+      return false;
+    }
+  }
+  *value = n;
+  return true;
+}
+
+static bool lookup_function(const char *name, size_t len, TokenType *tt) {
+  const struct FunctionTableEntry *entry =
+      &functions_table[function_hash(name, len, FUNCTION_HASH_SEED) &
+                       (FUNCTION_HASH_SIZE - 1)];
+  if (entry->len != len || memcmp(name, entry->label, len) != 0) {
+    return false;
+  }
+  *tt = entry->tt;
+  return true;
+}
+
+struct constant {
+  const char *name;
+  double value;
+};
+
+static const struct constant constants[] = {{"pi", FUNCTION_PI},
+                                            {"e", FUNCTION_E}};
+
+static bool lookup_constant(const char *name, size_t len, double *value) {
+  for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++) {
+    if (strlen(constants[i].name) == len &&
+        memcmp(constants[i].name, name, len) == 0) {
+      *value = constants[i].value;
+      return true;
+    }
+  }
+  return false;
+}
+
+void lexer_init(struct lexer *lx, const char *src) {
+  lx->src = src;
+  lx->pos = 0;
+}
+
+#define RET_LEXEME(__tt, __len)                                                \
+  lx->pos += (__len);                                                          \
+  return (Lexeme) { .type = (__tt), .offset = start, .len = (__len) }
+
+#define RET_LEXER_ERROR(__pe, __index)                                         \
+  *error = (__pe);                                                             \
+  *error_index = (__index);                                                    \
+  return (Lexeme) { .type = TT_ERROR, .offset = start, .len = 0 }
+
+Lexeme lexer_next(struct lexer *lx, ParseError *error, size_t *error_index) {
+  const char *src = lx->src;
+  while (isspace((unsigned char)src[lx->pos])) {
+    lx->pos++;
+  }
+
+  size_t start = lx->pos;
+  size_t end = start;
+
+  switch (src[start]) {
   case '\0':
-    RET_TOKEN(TT_EOF);
+    RET_LEXEME(TT_EOF, 0);
   case '(':
-    RET_TOKEN(TT_OPENPAR);
+    RET_LEXEME(TT_OPENPAR, 1);
   case ')':
-    RET_TOKEN(TT_CLOSEPAR);
+    RET_LEXEME(TT_CLOSEPAR, 1);
+  case ',':
+    RET_LEXEME(TT_COMMA, 1);
   case '+':
-    RET_TOKEN(TT_ADD);
+    RET_LEXEME(TT_ADD, 1);
   case '-':
-    RET_TOKEN(TT_SUB);
+    RET_LEXEME(TT_SUB, 1);
   case '*':
-    RET_TOKEN(TT_MULTIPLY);
+    /* gnuplot's spelling of `^` */
+    if (src[start + 1] == '*') {
+      RET_LEXEME(TT_POW, 2);
+    }
+    RET_LEXEME(TT_MULTIPLY, 1);
   case '/':
-    RET_TOKEN(TT_DIVIDE);
+    RET_LEXEME(TT_DIVIDE, 1);
   case '^':
-    RET_TOKEN(TT_POW);
-  case '0' ... '9':
-    struct vector_char numbuf;
-    vector_init_char(&numbuf);
+    RET_LEXEME(TT_POW, 1);
+  case '0' ... '9': {
     bool has_dot = false;
-    while ((**str >= '0' && **str <= '9') || **str == '.') {
-      (*error_index)++;
-      if (**str == '.' && has_dot) {
-        *error = PE_MULTIPLE_DECIMAL_SPEARATORS;
-        return (Token){.type = TT_ERROR};
-      } else if (**str == '.') {
+    while ((src[end] >= '0' && src[end] <= '9') || src[end] == '.') {
+      if (src[end] == '.') {
+        if (has_dot) {
+          RET_LEXER_ERROR(PE_MULTIPLE_DECIMAL_SPEARATORS, end + 1);
+        }
         has_dot = true;
       }
-      vector_push_char(&numbuf, **str);
-      (*str)++;
+      end++;
     }
-    vector_push_char(&numbuf, '\0');
-    char *endptr;
-    double n = strtod(numbuf.buf, &endptr);
-    if (numbuf.buf == endptr) {
-      vector_free_char(&numbuf);
-      *error = PE_STR_TO_DOUBLE_CONVERSION;
-      return (Token){.type = TT_ERROR};
-    }
-    vector_free_char(&numbuf);
-    return (Token){.type = TT_NUM, .num = n};
-  case 'a' ... 'z':
-    size_t function_start = *error_index;
-    struct vector_char funcbuf;
-    vector_init_char(&funcbuf);
-    while (**str >= 'a' && **str <= 'z') {
-      vector_push_char(&funcbuf, **str);
-      (*error_index)++;
-      (*str)++;
-    }
-
-    if (**str != '(') {
-      *error_index = function_start;
-      *error = PE_INVALID_FUNCTION;
-      return (Token){.type = TT_ERROR};
+    RET_LEXEME(TT_NUM, end - start);
+  }
+  case 'a' ... 'z': {
+    while ((src[end] >= 'a' && src[end] <= 'z') ||
+           (src[end] >= '0' && src[end] <= '9')) {
+      end++;
     }
 
-    for (size_t ft_i = 0;
-         ft_i < sizeof(functions_table) / sizeof(functions_table[0]); ft_i++) {
-      if (strlen(functions_table[ft_i].label) != funcbuf.len) {
-        continue;
+    TokenType tt;
+    bool found = lookup_function(src + start, end - start, &tt);
+    if (src[end] != '(') {
+      if (variable_index(src + start, end - start) != -1) {
+        RET_LEXEME(TT_VAR, end - start);
       }
-      if (strncmp(funcbuf.buf, functions_table[ft_i].label, funcbuf.len) == 0) {
-        vector_free_char(&funcbuf);
-        return (Token){.type = functions_table[ft_i].tt};
+      double value;
+      if (lookup_constant(src + start, end - start, &value)) {
+        RET_LEXEME(TT_NUM, end - start);
       }
+      RET_LEXER_ERROR(found ? PE_INVALID_FUNCTION : PE_UNKNOWN_VARIABLE,
+                      start + 1);
     }
-
-    vector_free_char(&funcbuf);
-
-    *error_index = function_start;
-    *error = PE_INVALID_FUNCTION;
-    return (Token){.type = TT_ERROR};
+    if (!found) {
+      RET_LEXER_ERROR(PE_INVALID_FUNCTION, start + 1);
+    }
+    RET_LEXEME(tt, end - start);
+  }
   default:
-    (*error_index)++;
-    *error = PE_INVALID_LEXEME;
-    return (Token){.type = TT_ERROR};
+    RET_LEXER_ERROR(PE_INVALID_LEXEME, start + 1);
   }
 }
 
-struct vector_token parse_math(char *expr, ParseError *error,
-                               size_t *error_index) {
-  struct vector_token out;
-  vector_init_token(&out);
-  struct vector_token ops;
-  vector_init_token(&ops);
+/* `lex_ns` is NULL unless the parse is traced */
+static void shunting_yard(char *expr, struct vector_small_token *out,
+                          ParseError *error, size_t *error_index,
+                          uint64_t *lex_ns) {
+  struct vector_small_token ops;
+  vector_init_arena_small_token(&ops, out->arena);
 
   int open_pars = 0;
   size_t last_open_par = 0;
 
+  struct lexer lx;
+  lexer_init(&lx, expr);
+
   while (true) {
-    Token tok = next_token(&expr, error, error_index);
-    if (tok.type == TT_EOF) {
+    uint64_t lex_start = lex_ns != NULL ? clock_now_ns() : 0;
+    Lexeme lexeme = lexer_next(&lx, error, error_index);
+    if (lex_ns != NULL) {
+      *lex_ns += clock_now_ns() - lex_start;
+    }
+    if (lexeme.type == TT_EOF) {
       break;
-    } else if (tok.type == TT_ERROR) {
-      vector_free_token(&ops);
-      return out;
+    } else if (lexeme.type == TT_ERROR) {
+      vector_free_small_token(&ops);
+      return;
+    }
+    /* Errors found by the parser point at the last character of the token */
+    *error_index = lexeme.offset + lexeme.len;
+
+    Token tok = {.type = lexeme.type, .offset = (uint32_t)lexeme.offset};
+    if (tok.type == TT_NUM && islower((unsigned char)expr[lexeme.offset])) {
+      lookup_constant(expr + lexeme.offset, lexeme.len, &tok.num);
+    } else if (tok.type == TT_NUM &&
+               parse_integer(expr + lexeme.offset, lexeme.len, &tok.integer)) {
+      tok.type = TT_INT;
+    } else if (tok.type == TT_NUM) {
+      tok.num = parse_decimal(expr + lexeme.offset, lexeme.len);
+    } else if (tok.type == TT_VAR) {
+      tok.num = variable_index(expr + lexeme.offset, lexeme.len);
     }
 
     switch (tok.type) {
     case TT_EOF:
     case TT_ERROR:
+    case TT_NEG:
       unreachable();
     case TT_EMPTY:
       break;
     case TT_NUM:
-      vector_push_token(&out, tok);
+    case TT_INT:
+    case TT_VAR:
+      vector_push_small_token(out, tok);
       break;
-    case TT_SQRT:
-    case TT_SIN:
-    case TT_COS:
-    case TT_TAN:
-      vector_push_token(&ops, tok);
+#define FUNCTION(__name, __tt, __arity, __expr) case __tt:
+#include "include/functions.def"
+#undef FUNCTION
+      vector_push_small_token(&ops, tok);
       break;
     case TT_OPENPAR:
       if (open_pars == 0) {
         last_open_par = *error_index;
       }
       open_pars++;
-      vector_push_token(&ops, tok);
+      /* On the operator stack `num` of a parenthesis counts the commas seen */
+      tok.num = 0;
+      vector_push_small_token(&ops, tok);
+      break;
+    case TT_COMMA:
+      while (ops.len > 0 && ops.buf[ops.len - 1].type != TT_OPENPAR) {
+        vector_push_small_token(out, vector_pop_small_token(&ops));
+      }
+      if (ops.len < 2 || !is_function(ops.buf[ops.len - 2].type)) {
+        vector_free_small_token(&ops);
+        *error = PE_UNEXPECTED_COMMA;
+        return;
+      }
+      ops.buf[ops.len - 1].num++;
       break;
     case TT_CLOSEPAR:
       while (ops.len > 0 && ops.buf[ops.len - 1].type != TT_OPENPAR) {
-        vector_push_token(&out, vector_pop_token(&ops));
+        vector_push_small_token(out, vector_pop_small_token(&ops));
       }
-      if (ops.len == 0 || vector_pop_token(&ops).type != TT_OPENPAR) {
-        vector_free_token(&ops);
+      if (ops.len == 0) {
+        vector_free_small_token(&ops);
         *error = PE_MISSING_OPEN_PARENTHESES;
-        return out;
+        return;
       }
+      Token open_par = vector_pop_small_token(&ops);
       open_pars--;
+      if (ops.len > 0 && is_function(ops.buf[ops.len - 1].type)) {
+        if ((int)open_par.num + 1 != tt_to_arity(ops.buf[ops.len - 1].type)) {
+          vector_free_small_token(&ops);
+          *error = PE_WRONG_ARGUMENT_COUNT;
+          return;
+        }
+        vector_push_small_token(out, vector_pop_small_token(&ops));
+      }
       break;
     case TT_ADD:
     case TT_SUB:
@@ -222,39 +435,234 @@ struct vector_token parse_math(char *expr, ParseError *error,
       while (ops.len > 0 && ops.buf[ops.len - 1].type != TT_OPENPAR) {
         int op_precedence = tt_to_precedence(ops.buf[ops.len - 1].type);
         if (op_precedence == -1) {
-          vector_free_token(&ops);
+          vector_free_small_token(&ops);
           *error = PE_NOT_AN_OPERATOR;
-          return out;
+          return;
         }
         int tok_precedence = tt_to_precedence(tok.type);
         if (tok_precedence == -1) {
-          vector_free_token(&ops);
+          vector_free_small_token(&ops);
           *error = PE_NOT_AN_OPERATOR;
-          return out;
+          return;
         }
-        if (op_precedence >= tok_precedence) {
-          vector_push_token(&out, vector_pop_token(&ops));
+        /* `^` and `**` group to the right, like in gnuplot */
+        if (op_precedence > tok_precedence ||
+            (op_precedence == tok_precedence && tok.type != TT_POW)) {
+          vector_push_small_token(out, vector_pop_small_token(&ops));
         } else {
           break;
         }
       }
-      vector_push_token(&ops, tok);
+      vector_push_small_token(&ops, tok);
       break;
     }
   }
 
   if (open_pars > 0) {
     *error_index = last_open_par;
-    vector_free_token(&ops);
+    vector_free_small_token(&ops);
     *error = PE_UNCLOSED_PARENTHESES;
-    return out;
+    return;
   }
 
   while (ops.len > 0) {
-    vector_push_token(&out, vector_pop_token(&ops));
+    vector_push_small_token(out, vector_pop_small_token(&ops));
+  }
+
+  vector_free_small_token(&ops);
+}
+
+/* Tracks the stack depth the way running the program would. The depth
+ * doesn't depend on any values, so unary operators and missing operands are
+ * known before the program runs. Stops at the first error, the program is
+ * only fit to be freed after that. */
+static void check_program(struct vector_small_token *rpn,
+                          struct rpn_header *header) {
+  *header = (struct rpn_header){.result = ER_OK};
+  size_t depth = 0;
+  size_t out = 0;
+  for (size_t i = 0; i < rpn->len; i++) {
+    Token tok = rpn->buf[i];
+    /* Operands taken off the stack, the result goes back on */
+    size_t arity = 2;
+    switch (tok.type) {
+    case TT_NUM:
+    case TT_INT:
+      header->n_consts++;
+      arity = 0;
+      break;
+    case TT_VAR:
+      if ((size_t)tok.num + 1 > header->n_vars) {
+        header->n_vars = (size_t)tok.num + 1;
+      }
+      arity = 0;
+      break;
+    case TT_ADD:
+      if (depth < 2) {
+        continue;
+      }
+      break;
+    case TT_SUB:
+      if (depth == 1) {
+        tok.type = TT_NEG;
+        arity = 1;
+      }
+      break;
+    case TT_MULTIPLY:
+    case TT_DIVIDE:
+    case TT_POW:
+      break;
+    default:
+      if (tt_to_arity(tok.type) == 0) {
+        header->result = ER_INVALID_OPERATOR;
+        return;
+      }
+      arity = (size_t)tt_to_arity(tok.type);
+      break;
+    }
+    if (depth < arity) {
+      header->result = ER_MISSING_OPERAND;
+      return;
+    }
+    depth = depth - arity + 1;
+    if (depth > header->max_depth) {
+      header->max_depth = depth;
+    }
+    rpn->buf[out++] = tok;
+  }
+  rpn->len = out;
+  if (depth != 1) {
+    header->result = ER_MULTIPLE_RESULTS;
+  }
+}
+
+/* Token types are stored in a byte each */
+#define FUNCTION(__name, __tt, __arity, __expr) +1
+enum {
+  N_TOKEN_TYPES = TT_NEG + 1
+#include "include/functions.def"
+};
+#undef FUNCTION
+typedef char token_types_fit_in_a_byte[N_TOKEN_TYPES <= 256 ? 1 : -1];
+
+static void *program_alloc(struct arena *arena, size_t size) {
+  return arena != NULL ? arena_alloc(arena, size) : malloc_checked(size);
+}
+
+static void pack_program(const char *expr,
+                         const struct vector_small_token *rpn,
+                         struct rpn_program *program) {
+  size_t n_operands = 0;
+  size_t n_literals = 0;
+  for (size_t i = 0; i < rpn->len; i++) {
+    TokenType tt = rpn->buf[i].type;
+    n_operands += tt == TT_NUM || tt == TT_INT || tt == TT_VAR;
+    n_literals += tt == TT_NUM;
+  }
+
+  size_t consts_size = n_operands * sizeof(union rpn_const);
+  size_t literals_size = n_literals * sizeof(struct rpn_literal);
+  program->consts =
+      program_alloc(program->arena, consts_size + literals_size + rpn->len);
+  program->literals =
+      (struct rpn_literal *)((uint8_t *)program->consts + consts_size);
+  program->ops = (uint8_t *)program->literals + literals_size;
+  program->len = rpn->len;
+  program->n_operands = n_operands;
+  program->n_literals = n_literals;
+
+  union rpn_const *operand = program->consts;
+  struct rpn_literal *literal = program->literals;
+  for (size_t i = 0; i < rpn->len; i++) {
+    Token tok = rpn->buf[i];
+    program->ops[i] = (uint8_t)tok.type;
+    if (tok.type == TT_NUM) {
+      (operand++)->num = tok.num;
+      /* The lexer already checked the literal, constants get no slice */
+      const char *src = expr + tok.offset;
+      *literal++ = (struct rpn_literal){
+          .offset = tok.offset,
+          .len = isdigit((unsigned char)*src)
+                     ? (uint32_t)strspn(src, "0123456789.")
+                     : 0};
+    } else if (tok.type == TT_INT) {
+      (operand++)->integer = tok.integer;
+    } else if (tok.type == TT_VAR) {
+      (operand++)->integer = (int64_t)tok.num;
+    }
+  }
+}
+
+static void parse_program(char *expr, struct rpn_program *program,
+                          ParseError *error, size_t *error_index,
+                          uint64_t *lex_ns) {
+  struct vector_small_token rpn;
+  vector_init_arena_small_token(&rpn, program->arena);
+  shunting_yard(expr, &rpn, error, error_index, lex_ns);
+  if (*error == PE_OK) {
+    check_program(&rpn, &program->header);
+  }
+  if (*error == PE_OK && program->header.result == ER_OK) {
+    pack_program(expr, &rpn, program);
+  }
+  vector_free_small_token(&rpn);
+}
+
+void parse_math(char *expr, struct arena *arena, struct rpn_program *program,
+                ParseError *error, size_t *error_index) {
+  MemTag tag = mem_tag_swap(MT_PARSER);
+  *program = (struct rpn_program){.header = {.result = ER_OK},
+                                  .arena = arena};
+  uint64_t start = trace_begin();
+  if (start == 0) {
+    parse_program(expr, program, error, error_index, NULL);
+    mem_tag_swap(tag);
+    return;
+  }
+
+  /* Lexing is interleaved with the shunting-yard, so a traced parse times
+   * every lexeme and reports the split as arguments of a single span */
+  uint64_t lex_ns = 0;
+  parse_program(expr, program, error, error_index, &lex_ns);
+  uint64_t total = clock_now_ns() - start;
+  struct trace_arg args[] = {{"lex", lex_ns},
+                             {"shunting_yard", total - lex_ns}};
+  trace_end_args("parse", start, args, 2);
+  mem_tag_swap(tag);
+}
+
+size_t rpn_program_size(const struct rpn_program *program) {
+  return program->n_operands * sizeof(union rpn_const) +
+         program->n_literals * sizeof(struct rpn_literal) + program->len;
+}
+
+void rpn_program_to_heap(struct rpn_program *program) {
+  if (program->arena == NULL) {
+    return;
+  }
+  program->arena = NULL;
+  if (program->consts == NULL) {
+    return;
   }
 
-  vector_free_token(&ops);
+  size_t consts_size = program->n_operands * sizeof(union rpn_const);
+  MemTag tag = mem_tag_swap(MT_PARSER);
+  union rpn_const *consts = malloc_checked(rpn_program_size(program));
+  mem_tag_swap(tag);
+  memcpy(consts, program->consts, rpn_program_size(program));
+  program->consts = consts;
+  program->literals = (struct rpn_literal *)((uint8_t *)consts + consts_size);
+  program->ops = (uint8_t *)(program->literals + program->n_literals);
+}
 
-  return out;
+void rpn_program_free(struct rpn_program *program) {
+  if (program->arena == NULL) {
+    free_checked(program->consts);
+  }
+  program->consts = NULL;
+  program->ops = NULL;
+  program->len = 0;
+  program->n_operands = 0;
+  program->literals = NULL;
+  program->n_literals = 0;
 }
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "include/clock.h"
+#include "include/pipe_reader.h"
+#include "include/vector.h"
+
+const char *pipe_read_result_to_str(PipeReadResult pr) {
+  switch (pr) {
+  case PR_OK:
+    return "OK";
+  case PR_EOF:
+    return "EOF";
+  case PR_WOULD_BLOCK:
+    return "WOULD_BLOCK";
+  case PR_TIMEOUT:
+    return "TIMEOUT";
+  case PR_TOO_LARGE:
+    return "TOO_LARGE";
+  case PR_IO_ERROR:
+    return "IO_ERROR";
+  }
+  return "N/A";
+}
+
+void pipe_reader_init(struct pipe_reader *r, int fd, size_t max_size,
+                      unsigned timeout_ms) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && !(flags & O_NONBLOCK)) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+  r->fd = fd;
+  r->max_size = max_size;
+  r->syscalls = 0;
+  pipe_reader_rearm(r, timeout_ms);
+}
+
+void pipe_reader_rearm(struct pipe_reader *r, unsigned timeout_ms) {
+  r->deadline_ns = clock_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+}
+
+/* One read() into the spare capacity of `out`. Without `wait` an empty pipe
+ * is reported as PR_WOULD_BLOCK. */
+static PipeReadResult read_some(struct pipe_reader *r, struct vector_char *out,
+                                bool wait) {
+  if (out->len > r->max_size) {
+    return PR_TOO_LARGE;
+  }
+  if (out->cap - out->len < PIPE_READER_MIN_READ) {
+    vector_reserve_char(out, vector_next_capacity(
+                                 out->cap, out->len + PIPE_READER_MIN_READ));
+  }
+  /* Never read past the limit, one byte over is enough to detect it */
+  size_t space = out->cap - out->len;
+  if (space > r->max_size + 1 - out->len) {
+    space = r->max_size + 1 - out->len;
+  }
+
+  while (true) {
+    r->syscalls++;
+    ssize_t n = read(r->fd, out->buf + out->len, space);
+    if (n > 0) {
+      out->len += (size_t)n;
+      return out->len > r->max_size ? PR_TOO_LARGE : PR_OK;
+    }
+    if (n == 0) {
+      return PR_EOF;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return PR_IO_ERROR;
+    }
+    if (!wait) {
+      return PR_WOULD_BLOCK;
+    }
+
+    uint64_t now = clock_now_ns();
+    if (now >= r->deadline_ns) {
+      return PR_TIMEOUT;
+    }
+    struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+    r->syscalls++;
+    int ready = poll(&pfd, 1, (int)((r->deadline_ns - now) / 1000000) + 1);
+    if (ready < 0 && errno != EINTR) {
+      return PR_IO_ERROR;
+    }
+  }
+}
+
+PipeReadResult pipe_reader_fill(struct pipe_reader *r, struct vector_char *out,
+                                size_t len) {
+  if (len > r->max_size) {
+    return PR_TOO_LARGE;
+  }
+  while (out->len < len) {
+    PipeReadResult res = read_some(r, out, true);
+    if (res != PR_OK) {
+      return res;
+    }
+  }
+  return PR_OK;
+}
+
+PipeReadResult pipe_reader_read_all(struct pipe_reader *r,
+                                    struct vector_char *out) {
+  while (true) {
+    PipeReadResult res = read_some(r, out, true);
+    if (res == PR_EOF) {
+      return PR_OK;
+    }
+    if (res != PR_OK) {
+      return res;
+    }
+  }
+}
+
+PipeReadResult pipe_reader_read_available(struct pipe_reader *r,
+                                          struct vector_char *out) {
+  while (true) {
+    PipeReadResult res = read_some(r, out, false);
+    if (res != PR_OK) {
+      return res;
+    }
+  }
+}
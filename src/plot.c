@@ -0,0 +1,632 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/batch.h"
+#include "include/mem.h"
+#include "include/parser.h"
+#include "include/plot.h"
+#include "include/png.h"
+#include "include/vector.h"
+#include "include/vm.h"
+
+#define PLOT_ARENA_SIZE 4096
+#define PLOT_MARGIN_TOP 20
+#define PLOT_MARGIN_RIGHT 20
+#define PLOT_MARGIN_BOTTOM 40
+#define PLOT_LABEL_GAP 8
+#define PLOT_TICK_LEN 6
+#define PLOT_TARGET_TICKS 8
+#define PLOT_MAX_TICKS 64
+#define PLOT_LABEL_LEN 32
+/* Pixel coordinates are clamped to this before clipping so samples like
+ * 1e300 don't turn the clipping math into inf - inf */
+#define PLOT_MAX_COORD 1e7
+
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+#define FONT_SCALE 2
+#define FONT_ADVANCE ((GLYPH_WIDTH + 1) * FONT_SCALE)
+
+enum { COLOR_BACKGROUND, COLOR_FOREGROUND, COLOR_GRID, COLOR_CURVE };
+
+/* The curve colors are gnuplot's default line colors, in the same order */
+static const unsigned char palette[COLOR_CURVE + PLOT_MAX_CURVES][3] = {
+    {0xff, 0xff, 0xff}, {0x00, 0x00, 0x00}, {0xc8, 0xc8, 0xc8},
+    {0x94, 0x00, 0xd3}, {0x00, 0x9e, 0x73}, {0x56, 0xb4, 0xe9},
+    {0xe6, 0x9f, 0x00}, {0xf0, 0xe4, 0x42}, {0x00, 0x72, 0xb2},
+    {0xe5, 0x1e, 0x10}, {0x00, 0x00, 0x00}};
+
+/* Rows of a 5x7 glyph, most significant of the low 5 bits is the left column.
+ * Only what tick labels need. */
+static const struct {
+  char c;
+  unsigned char rows[GLYPH_HEIGHT];
+} font[] = {
+    {'0', {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}},
+    {'1', {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}},
+    {'2', {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}},
+    {'3', {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}},
+    {'4', {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}},
+    {'5', {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}},
+    {'6', {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}},
+    {'7', {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}},
+    {'8', {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}},
+    {'9', {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}},
+    {'-', {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}},
+    {'+', {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}},
+    {'.', {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}},
+    {'e', {0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e}},
+};
+
+static PlotBackend backend = PB_NATIVE;
+
+const char *plot_backend_to_str(PlotBackend pb) {
+  switch (pb) {
+  case PB_NATIVE:
+    return "native";
+  case PB_GNUPLOT:
+    return "gnuplot";
+  }
+  return "N/A";
+}
+
+bool plot_backend_from_str(const char *str, PlotBackend *pb) {
+  if (strcmp(str, "native") == 0) {
+    *pb = PB_NATIVE;
+    return true;
+  }
+  if (strcmp(str, "gnuplot") == 0) {
+    *pb = PB_GNUPLOT;
+    return true;
+  }
+  return false;
+}
+
+const char *plot_error_to_str(PlotError pe) {
+  switch (pe) {
+  case PLE_OK:
+    return "OK";
+  case PLE_EMPTY:
+    return "EMPTY";
+  case PLE_TOO_MANY_CURVES:
+    return "TOO_MANY_CURVES";
+  case PLE_UNSUPPORTED:
+    return "UNSUPPORTED";
+  case PLE_NO_FINITE_POINTS:
+    return "NO_FINITE_POINTS";
+  case PLE_RANGE_TOO_LARGE:
+    return "RANGE_TOO_LARGE";
+  }
+  return "N/A";
+}
+
+void plot_init(PlotBackend pb) { backend = pb; }
+
+PlotBackend plot_get_backend(void) { return backend; }
+
+/* How gnuplot types a value. Integers divide and take negative powers
+ * differently from reals, integer constants are known exactly. */
+typedef enum { GT_REAL, GT_INT, GT_CONST_INT } GnuplotType;
+
+struct gnuplot_value {
+  GnuplotType type;
+  int64_t value;
+};
+
+/* `exp` is not negative */
+static bool const_pow(int64_t base, int64_t exp, int64_t *out) {
+  if (base == 0 || base == 1 || base == -1) {
+    *out = exp == 0 ? 1 : base == -1 && exp % 2 == 0 ? 1 : base;
+    return true;
+  }
+  /* Any other base overflows within 63 steps */
+  int64_t result = 1;
+  for (; exp > 0; exp--) {
+    if (__builtin_mul_overflow(result, base, &result)) {
+      return false;
+    }
+  }
+  *out = result;
+  return true;
+}
+
+/* Folds integer constants the way gnuplot does, returns false where a
+ * binary operator of two integers would give a different result here */
+static bool int_binary(TokenType tt, struct gnuplot_value *a,
+                       const struct gnuplot_value *b) {
+  bool known = a->type == GT_CONST_INT && b->type == GT_CONST_INT;
+  switch (tt) {
+  case TT_ADD:
+    return !known || !__builtin_add_overflow(a->value, b->value, &a->value);
+  case TT_SUB:
+    return !known || !__builtin_sub_overflow(a->value, b->value, &a->value);
+  case TT_MULTIPLY:
+    return !known || !__builtin_mul_overflow(a->value, b->value, &a->value);
+  case TT_DIVIDE:
+    /* gnuplot truncates, only exact divisions agree */
+    if (!known || b->value == 0 ||
+        (a->value == INT64_MIN && b->value == -1) ||
+        a->value % b->value != 0) {
+      return false;
+    }
+    a->value /= b->value;
+    return true;
+  case TT_POW:
+    /* Negative powers of integers are integers too */
+    if (b->type != GT_CONST_INT || b->value < 0) {
+      return false;
+    }
+    return a->type != GT_CONST_INT || const_pow(a->value, b->value, &a->value);
+  default:
+    return false;
+  }
+}
+
+/* False if gnuplot would plot `rpn` differently, because of integer
+ * arithmetic our reals don't do */
+static bool matches_gnuplot(const struct rpn_program *rpn,
+                            struct arena *arena) {
+  struct gnuplot_value *stack = arena_alloc(
+      arena, (rpn->header.max_depth + 1) * sizeof(struct gnuplot_value));
+  size_t len = 0;
+  const union rpn_const *operand = rpn->consts;
+  for (size_t i = 0; i < rpn->len; i++) {
+    TokenType tt = (TokenType)rpn->ops[i];
+    struct gnuplot_value *top = stack + len;
+    switch (tt) {
+    case TT_INT:
+      stack[len++] = (struct gnuplot_value){GT_CONST_INT, operand++->integer};
+      break;
+    case TT_NUM:
+    case TT_VAR:
+      operand++;
+      stack[len++] = (struct gnuplot_value){GT_REAL, 0};
+      break;
+    case TT_NEG:
+      if (top[-1].type == GT_CONST_INT) {
+        if (top[-1].value == INT64_MIN) {
+          return false;
+        }
+        top[-1].value = -top[-1].value;
+      }
+      break;
+    case TT_ADD:
+    case TT_SUB:
+    case TT_MULTIPLY:
+    case TT_DIVIDE:
+    case TT_POW:
+      len--;
+      if (top[-2].type == GT_REAL || top[-1].type == GT_REAL) {
+        top[-2].type = GT_REAL;
+      } else if (!int_binary(tt, &top[-2], &top[-1])) {
+        return false;
+      } else if (top[-1].type != GT_CONST_INT) {
+        top[-2].type = GT_INT;
+      }
+      break;
+    case TT_ABS:
+      if (top[-1].type == GT_CONST_INT) {
+        if (top[-1].value == INT64_MIN) {
+          return false;
+        }
+        top[-1].value = top[-1].value < 0 ? -top[-1].value : top[-1].value;
+      }
+      break;
+    case TT_FLOOR:
+    case TT_CEIL:
+      /* Integers in gnuplot whatever the argument */
+      if (top[-1].type == GT_REAL) {
+        top[-1].type = GT_INT;
+      }
+      break;
+    default:
+      len -= (size_t)tt_to_arity(tt) - 1;
+      stack[len - 1].type = GT_REAL;
+      break;
+    }
+  }
+  return true;
+}
+
+static PlotError compile_curve(const char *src, size_t len,
+                               struct arena *arena,
+                               struct vm_program *program) {
+  char *curve = arena_alloc(arena, len + 1);
+  memcpy(curve, src, len);
+  curve[len] = '\0';
+  if (curve[strspn(curve, " \t\n\r\f\v")] == '\0') {
+    return PLE_EMPTY;
+  }
+
+  ParseError parse_error = PE_OK;
+  size_t error_index = 0;
+  struct rpn_program rpn;
+  parse_math(curve, arena, &rpn, &parse_error, &error_index);
+  if (parse_error != PE_OK || vm_compile(&rpn, arena, program) != ER_OK ||
+      !matches_gnuplot(&rpn, arena)) {
+    return PLE_UNSUPPORTED;
+  }
+  return PLE_OK;
+}
+
+/* Curves are separated by the commas outside of any parentheses */
+static PlotError compile_curves(const char *expr, struct arena *arena,
+                                struct vm_program *programs,
+                                size_t *n_curves) {
+  size_t start = 0;
+  int depth = 0;
+  for (size_t i = 0;; i++) {
+    char c = expr[i];
+    if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      depth--;
+    }
+    if (c != '\0' && (c != ',' || depth > 0)) {
+      continue;
+    }
+
+    if (*n_curves == PLOT_MAX_CURVES) {
+      return PLE_TOO_MANY_CURVES;
+    }
+    PlotError error =
+        compile_curve(expr + start, i - start, arena, &programs[*n_curves]);
+    if (error != PLE_OK) {
+      return error;
+    }
+    (*n_curves)++;
+
+    if (c == '\0') {
+      return PLE_OK;
+    }
+    start = i + 1;
+  }
+}
+
+/* 1, 2 or 5 times a power of ten, giving about `target` intervals */
+static double nice_step(double range, int target) {
+  double raw = range / target;
+  double magnitude = pow(10.0, floor(log10(raw)));
+  double norm = raw / magnitude;
+  double nice = norm < 1.5 ? 1.0 : norm < 3.0 ? 2.0 : norm < 7.0 ? 5.0 : 10.0;
+  return nice * magnitude;
+}
+
+struct axis {
+  double min;
+  double max;
+  double step;
+  int n_ticks;
+  double ticks[PLOT_MAX_TICKS];
+  char labels[PLOT_MAX_TICKS][PLOT_LABEL_LEN];
+};
+
+static void axis_ticks(struct axis *axis) {
+  long long first = (long long)ceil(axis->min / axis->step - 1e-9);
+  long long last = (long long)floor(axis->max / axis->step + 1e-9);
+  double magnitude = fmax(fabs(axis->min), fabs(axis->max));
+
+  axis->n_ticks = 0;
+  for (long long k = first; k <= last && axis->n_ticks < PLOT_MAX_TICKS; k++) {
+    double value = (double)k * axis->step;
+    char *label = axis->labels[axis->n_ticks];
+    if (magnitude >= 1e6 || axis->step < 1e-4) {
+      /* Enough significant digits to tell neighbouring ticks apart */
+      int digits = (int)ceil(log10(magnitude / axis->step)) + 1;
+      digits = digits < 1 ? 1 : digits > 17 ? 17 : digits;
+      snprintf(label, PLOT_LABEL_LEN, "%.*g", digits, value);
+    } else {
+      int decimals =
+          axis->step >= 1.0 ? 0 : (int)ceil(-log10(axis->step) - 1e-9);
+      snprintf(label, PLOT_LABEL_LEN, "%.*f", decimals, k == 0 ? 0.0 : value);
+    }
+    axis->ticks[axis->n_ticks++] = value;
+  }
+}
+
+struct canvas {
+  unsigned char *pixels;
+  int left;
+  int top;
+  int right;
+  int bottom;
+};
+
+static inline void put_pixel(struct canvas *canvas, int x, int y,
+                             unsigned char color) {
+  if (x >= 0 && x < PLOT_WIDTH && y >= 0 && y < PLOT_HEIGHT) {
+    canvas->pixels[y * PLOT_WIDTH + x] = color;
+  }
+}
+
+static int text_width(const char *text) {
+  return (int)strlen(text) * FONT_ADVANCE - FONT_SCALE;
+}
+
+static void draw_text(struct canvas *canvas, int x, int y, const char *text) {
+  for (; *text != '\0'; text++, x += FONT_ADVANCE) {
+    for (size_t g = 0; g < sizeof(font) / sizeof(font[0]); g++) {
+      if (font[g].c != *text) {
+        continue;
+      }
+      for (int row = 0; row < GLYPH_HEIGHT * FONT_SCALE; row++) {
+        for (int col = 0; col < GLYPH_WIDTH * FONT_SCALE; col++) {
+          if (font[g].rows[row / FONT_SCALE] &
+              (0x10 >> (col / FONT_SCALE))) {
+            put_pixel(canvas, x + col, y + row, COLOR_FOREGROUND);
+          }
+        }
+      }
+      break;
+    }
+  }
+}
+
+/* Curves are two pixels wide and never leave the plot area */
+static void put_curve_pixel(struct canvas *canvas, int x, int y,
+                            unsigned char color) {
+  for (int dy = 0; dy < 2; dy++) {
+    for (int dx = 0; dx < 2; dx++) {
+      if (x + dx >= canvas->left && x + dx <= canvas->right &&
+          y + dy >= canvas->top && y + dy <= canvas->bottom) {
+        canvas->pixels[(y + dy) * PLOT_WIDTH + x + dx] = color;
+      }
+    }
+  }
+}
+
+/* Liang-Barsky, returns false if nothing of the segment is visible */
+static bool clip_segment(const struct canvas *canvas, double *x0, double *y0,
+                         double *x1, double *y1) {
+  double dx = *x1 - *x0;
+  double dy = *y1 - *y0;
+  double p[4] = {-dx, dx, -dy, dy};
+  double q[4] = {*x0 - canvas->left, canvas->right - *x0, *y0 - canvas->top,
+                 canvas->bottom - *y0};
+  double t0 = 0.0;
+  double t1 = 1.0;
+
+  for (int i = 0; i < 4; i++) {
+    if (p[i] == 0.0) {
+      if (q[i] < 0.0) {
+        return false;
+      }
+      continue;
+    }
+    double t = q[i] / p[i];
+    if (p[i] < 0.0) {
+      if (t > t1) {
+        return false;
+      }
+      t0 = t > t0 ? t : t0;
+    } else {
+      if (t < t0) {
+        return false;
+      }
+      t1 = t < t1 ? t : t1;
+    }
+  }
+
+  double start_x = *x0;
+  double start_y = *y0;
+  *x0 = start_x + t0 * dx;
+  *y0 = start_y + t0 * dy;
+  *x1 = start_x + t1 * dx;
+  *y1 = start_y + t1 * dy;
+  return true;
+}
+
+static void draw_segment(struct canvas *canvas, double fx0, double fy0,
+                         double fx1, double fy1, unsigned char color) {
+  if (!clip_segment(canvas, &fx0, &fy0, &fx1, &fy1)) {
+    return;
+  }
+
+  int x0 = (int)lround(fx0);
+  int y0 = (int)lround(fy0);
+  int x1 = (int)lround(fx1);
+  int y1 = (int)lround(fy1);
+  int dx = abs(x1 - x0);
+  int dy = -abs(y1 - y0);
+  int sx = x0 < x1 ? 1 : -1;
+  int sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy;
+
+  while (true) {
+    put_curve_pixel(canvas, x0, y0, color);
+    if (x0 == x1 && y0 == y1) {
+      break;
+    }
+    int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y0 += sy;
+    }
+  }
+}
+
+static void draw_frame(struct canvas *canvas, const struct axis *x_axis,
+                       const struct axis *y_axis) {
+  int width = canvas->right - canvas->left;
+  int height = canvas->bottom - canvas->top;
+
+  for (int i = 0; i < x_axis->n_ticks; i++) {
+    int x = canvas->left + (int)lround((x_axis->ticks[i] - x_axis->min) /
+                                       (x_axis->max - x_axis->min) * width);
+    for (int y = canvas->top; y <= canvas->bottom; y += 2) {
+      put_pixel(canvas, x, y, COLOR_GRID);
+    }
+    for (int t = 0; t < PLOT_TICK_LEN; t++) {
+      put_pixel(canvas, x, canvas->bottom - t, COLOR_FOREGROUND);
+      put_pixel(canvas, x, canvas->top + t, COLOR_FOREGROUND);
+    }
+    draw_text(canvas, x - text_width(x_axis->labels[i]) / 2,
+              canvas->bottom + PLOT_LABEL_GAP, x_axis->labels[i]);
+  }
+
+  for (int i = 0; i < y_axis->n_ticks; i++) {
+    int y = canvas->bottom - (int)lround((y_axis->ticks[i] - y_axis->min) /
+                                         (y_axis->max - y_axis->min) * height);
+    for (int x = canvas->left; x <= canvas->right; x += 2) {
+      put_pixel(canvas, x, y, COLOR_GRID);
+    }
+    for (int t = 0; t < PLOT_TICK_LEN; t++) {
+      put_pixel(canvas, canvas->left + t, y, COLOR_FOREGROUND);
+      put_pixel(canvas, canvas->right - t, y, COLOR_FOREGROUND);
+    }
+    draw_text(canvas,
+              canvas->left - PLOT_LABEL_GAP - text_width(y_axis->labels[i]),
+              y - GLYPH_HEIGHT * FONT_SCALE / 2, y_axis->labels[i]);
+  }
+
+  for (int x = canvas->left; x <= canvas->right; x++) {
+    put_pixel(canvas, x, canvas->top, COLOR_FOREGROUND);
+    put_pixel(canvas, x, canvas->bottom, COLOR_FOREGROUND);
+  }
+  for (int y = canvas->top; y <= canvas->bottom; y++) {
+    put_pixel(canvas, canvas->left, y, COLOR_FOREGROUND);
+    put_pixel(canvas, canvas->right, y, COLOR_FOREGROUND);
+  }
+}
+
+static void draw_curve(struct canvas *canvas, const struct axis *x_axis,
+                       const struct axis *y_axis, const double *xs,
+                       const double *ys, unsigned char color) {
+  double x_scale = (canvas->right - canvas->left) / (x_axis->max - x_axis->min);
+  double y_scale = (canvas->bottom - canvas->top) / (y_axis->max - y_axis->min);
+
+  for (size_t i = 0; i < PLOT_SAMPLES; i++) {
+    if (!isfinite(ys[i])) {
+      continue;
+    }
+    double px = canvas->left + (xs[i] - x_axis->min) * x_scale;
+    double py = canvas->bottom - (ys[i] - y_axis->min) * y_scale;
+    py = fmax(-PLOT_MAX_COORD, fmin(PLOT_MAX_COORD, py));
+
+    if (i + 1 < PLOT_SAMPLES && isfinite(ys[i + 1])) {
+      double next_px = canvas->left + (xs[i + 1] - x_axis->min) * x_scale;
+      double next_py = canvas->bottom - (ys[i + 1] - y_axis->min) * y_scale;
+      next_py = fmax(-PLOT_MAX_COORD, fmin(PLOT_MAX_COORD, next_py));
+      draw_segment(canvas, px, py, next_px, next_py, color);
+    } else if (i == 0 || !isfinite(ys[i - 1])) {
+      /* Isolated point */
+      draw_segment(canvas, px, py, px, py, color);
+    }
+  }
+}
+
+static struct vector_char render(const char *expr, PlotError *error) {
+  struct vector_char png;
+  vector_init_char(&png);
+
+  unsigned char arena_buf[PLOT_ARENA_SIZE];
+  struct arena arena;
+  arena_init(&arena, arena_buf, sizeof(arena_buf), PLOT_ARENA_SIZE);
+
+  struct vm_program programs[PLOT_MAX_CURVES];
+  size_t n_curves = 0;
+  *error = compile_curves(expr, &arena, programs, &n_curves);
+  if (*error != PLE_OK) {
+    arena_free(&arena);
+    return png;
+  }
+
+  double xs[PLOT_SAMPLES];
+  for (size_t i = 0; i < PLOT_SAMPLES; i++) {
+    xs[i] = PLOT_X_MIN + (PLOT_X_MAX - PLOT_X_MIN) * (double)i /
+                             (double)(PLOT_SAMPLES - 1);
+  }
+  double *ys = malloc_checked(n_curves * PLOT_SAMPLES * sizeof(double));
+  for (size_t c = 0; c < n_curves; c++) {
+    evaluate_batch(&programs[c], xs, ys + c * PLOT_SAMPLES, PLOT_SAMPLES);
+  }
+  arena_free(&arena);
+
+  double y_min = INFINITY;
+  double y_max = -INFINITY;
+  for (size_t i = 0; i < n_curves * PLOT_SAMPLES; i++) {
+    if (isfinite(ys[i])) {
+      y_min = fmin(y_min, ys[i]);
+      y_max = fmax(y_max, ys[i]);
+    }
+  }
+  if (y_min > y_max) {
+    free_checked(ys);
+    *error = PLE_NO_FINITE_POINTS;
+    return png;
+  }
+  if (y_min == y_max) {
+    double pad = fmax(1.0, fabs(y_min) * 0.1);
+    y_min -= pad;
+    y_max += pad;
+  }
+
+  /* Like gnuplot's autoscaling the y range is widened to whole ticks */
+  struct axis *y_axis = malloc_checked(sizeof(struct axis));
+  y_axis->step = nice_step(y_max - y_min, PLOT_TARGET_TICKS);
+  y_axis->min = floor(y_min / y_axis->step) * y_axis->step;
+  y_axis->max = ceil(y_max / y_axis->step) * y_axis->step;
+  if (!isfinite(y_axis->max - y_axis->min) || !(y_axis->step > 0.0) ||
+      y_axis->max == y_axis->min) {
+    free_checked(y_axis);
+    free_checked(ys);
+    *error = PLE_RANGE_TOO_LARGE;
+    return png;
+  }
+  axis_ticks(y_axis);
+
+  struct axis *x_axis = malloc_checked(sizeof(struct axis));
+  x_axis->min = PLOT_X_MIN;
+  x_axis->max = PLOT_X_MAX;
+  x_axis->step = nice_step(PLOT_X_MAX - PLOT_X_MIN, PLOT_TARGET_TICKS);
+  axis_ticks(x_axis);
+
+  int label_width = 0;
+  for (int i = 0; i < y_axis->n_ticks; i++) {
+    int width = text_width(y_axis->labels[i]);
+    label_width = width > label_width ? width : label_width;
+  }
+
+  if (label_width > PLOT_WIDTH / 2) {
+    label_width = PLOT_WIDTH / 2;
+  }
+
+  struct canvas canvas = {
+      .pixels = malloc_checked(PLOT_WIDTH * PLOT_HEIGHT),
+      .left = label_width + 2 * PLOT_LABEL_GAP,
+      .top = PLOT_MARGIN_TOP,
+      .right = PLOT_WIDTH - 1 - PLOT_MARGIN_RIGHT,
+      .bottom = PLOT_HEIGHT - 1 - PLOT_MARGIN_BOTTOM};
+  memset(canvas.pixels, COLOR_BACKGROUND, PLOT_WIDTH * PLOT_HEIGHT);
+
+  draw_frame(&canvas, x_axis, y_axis);
+  for (size_t c = 0; c < n_curves; c++) {
+    draw_curve(&canvas, x_axis, y_axis, xs, ys + c * PLOT_SAMPLES,
+               COLOR_CURVE + c);
+  }
+
+  png_encode_indexed(canvas.pixels, PLOT_WIDTH, PLOT_HEIGHT, palette,
+                     COLOR_CURVE + n_curves, &png);
+
+  free_checked(canvas.pixels);
+  free_checked(x_axis);
+  free_checked(y_axis);
+  free_checked(ys);
+  *error = PLE_OK;
+  return png;
+}
+
+struct vector_char plot_render(const char *expr, PlotError *error) {
+  MemTag tag = mem_tag_swap(MT_PLOT);
+  struct vector_char png = render(expr, error);
+  mem_tag_swap(tag);
+  return png;
+}
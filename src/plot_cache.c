@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/calc_cache.h"
+#include "include/mem.h"
+#include "include/plot.h"
+#include "include/plot_cache.h"
+#include "include/vector.h"
+
+#define PLOT_CACHE_BUCKETS 256
+
+struct plot_cache_waiter {
+  plot_cache_waiter_cb done;
+  void *data;
+  struct plot_cache_waiter *next;
+};
+
+struct plot_cache_entry {
+  char *key;
+  uint64_t hash;
+  /* NULL while the plot is being rendered */
+  struct plot_image *image;
+  struct plot_cache_waiter *waiters;
+  /* Bytes charged against the budget */
+  size_t size;
+  /* Bucket chain */
+  struct plot_cache_entry *next_in_bucket;
+  /* LRU list of ready entries, most recently used first */
+  struct plot_cache_entry *prev;
+  struct plot_cache_entry *next;
+};
+
+static struct {
+  struct plot_cache_entry *buckets[PLOT_CACHE_BUCKETS];
+  struct plot_cache_entry *head;
+  struct plot_cache_entry *tail;
+  pthread_mutex_t lock;
+  struct plot_cache_stats stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+const char *plot_cache_result_to_str(PlotCacheResult pcr) {
+  switch (pcr) {
+  case PCR_HIT:
+    return "HIT";
+  case PCR_MISS:
+    return "MISS";
+  case PCR_PENDING:
+    return "PENDING";
+  }
+  return "N/A";
+}
+
+static uint64_t hash_key(const char *key) {
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*key != '\0') {
+    hash ^= (unsigned char)*key++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+char *plot_cache_key(const char *expr, PlotBackend backend) {
+  char *normalized = calc_cache_normalize(expr, NULL);
+  char *key = NULL;
+  assert(asprintf(&key, "%s:%dx%d:%g:%g:%d:%s", plot_backend_to_str(backend),
+                  PLOT_WIDTH, PLOT_HEIGHT, PLOT_X_MIN, PLOT_X_MAX,
+                  PLOT_SAMPLES, normalized) != -1);
+  free_checked(normalized);
+  return key;
+}
+
+void plot_image_release(struct plot_image *image) {
+  if (image != NULL &&
+      __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_checked(image->buf);
+    free_checked(image);
+  }
+}
+
+static void entry_free(struct plot_cache_entry *entry) {
+  plot_image_release(entry->image);
+  free_checked(entry->key);
+  free_checked(entry);
+}
+
+static void lru_unlink(struct plot_cache_entry *entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache.head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache.tail = entry->prev;
+  }
+}
+
+static void lru_push_front(struct plot_cache_entry *entry) {
+  entry->prev = NULL;
+  entry->next = cache.head;
+  if (cache.head != NULL) {
+    cache.head->prev = entry;
+  }
+  cache.head = entry;
+  if (cache.tail == NULL) {
+    cache.tail = entry;
+  }
+}
+
+static void bucket_remove(struct plot_cache_entry *entry) {
+  struct plot_cache_entry **link =
+      &cache.buckets[entry->hash & (PLOT_CACHE_BUCKETS - 1)];
+  while (*link != entry) {
+    link = &(*link)->next_in_bucket;
+  }
+  *link = entry->next_in_bucket;
+}
+
+static struct plot_cache_entry *find(const char *key, uint64_t hash) {
+  struct plot_cache_entry *entry =
+      cache.buckets[hash & (PLOT_CACHE_BUCKETS - 1)];
+  while (entry != NULL) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+    entry = entry->next_in_bucket;
+  }
+  return NULL;
+}
+
+/* Only rendered entries are ever evicted */
+static void evict(struct plot_cache_entry *entry) {
+  lru_unlink(entry);
+  bucket_remove(entry);
+  cache.stats.len--;
+  cache.stats.bytes -= entry->size;
+  cache.stats.evictions++;
+  entry_free(entry);
+}
+
+void plot_cache_init(size_t budget) {
+  pthread_mutex_lock(&cache.lock);
+  memset(cache.buckets, 0, sizeof(cache.buckets));
+  cache.head = NULL;
+  cache.tail = NULL;
+  cache.stats = (struct plot_cache_stats){.budget = budget};
+  pthread_mutex_unlock(&cache.lock);
+}
+
+void plot_cache_cleanup(void) {
+  pthread_mutex_lock(&cache.lock);
+  for (size_t i = 0; i < PLOT_CACHE_BUCKETS; i++) {
+    struct plot_cache_entry *entry = cache.buckets[i];
+    while (entry != NULL) {
+      struct plot_cache_entry *next = entry->next_in_bucket;
+      entry_free(entry);
+      entry = next;
+    }
+    cache.buckets[i] = NULL;
+  }
+  cache.head = NULL;
+  cache.tail = NULL;
+  cache.stats.len = 0;
+  cache.stats.bytes = 0;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+PlotCacheResult plot_cache_acquire(const char *key, struct plot_image **image,
+                                   plot_cache_waiter_cb waiter, void *data) {
+  *image = NULL;
+  uint64_t hash = hash_key(key);
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.stats.budget == 0) {
+    cache.stats.misses++;
+    pthread_mutex_unlock(&cache.lock);
+    return PCR_MISS;
+  }
+
+  struct plot_cache_entry *entry = find(key, hash);
+  if (entry == NULL) {
+    /* Everyone asking for the same plot from now on waits for us */
+    entry = malloc_checked(sizeof(struct plot_cache_entry));
+    *entry = (struct plot_cache_entry){.hash = hash};
+    entry->key = malloc_checked(strlen(key) + 1);
+    strcpy(entry->key, key);
+    size_t bucket = hash & (PLOT_CACHE_BUCKETS - 1);
+    entry->next_in_bucket = cache.buckets[bucket];
+    cache.buckets[bucket] = entry;
+    cache.stats.misses++;
+    pthread_mutex_unlock(&cache.lock);
+    return PCR_MISS;
+  }
+
+  if (entry->image == NULL) {
+    struct plot_cache_waiter *w = malloc_checked(sizeof(*w));
+    *w = (struct plot_cache_waiter){
+        .done = waiter, .data = data, .next = entry->waiters};
+    entry->waiters = w;
+    pthread_mutex_unlock(&cache.lock);
+    return PCR_PENDING;
+  }
+
+  if (entry != cache.head) {
+    lru_unlink(entry);
+    lru_push_front(entry);
+  }
+  __atomic_add_fetch(&entry->image->refs, 1, __ATOMIC_RELAXED);
+  *image = entry->image;
+  cache.stats.hits++;
+  pthread_mutex_unlock(&cache.lock);
+  return PCR_HIT;
+}
+
+/* Outside of the lock, the waiters are free to use the cache again */
+static void notify_waiters(struct plot_cache_waiter *w,
+                           struct plot_image *image) {
+  while (w != NULL) {
+    struct plot_cache_waiter *next = w->next;
+    w->done(image, w->data);
+    free_checked(w);
+    w = next;
+  }
+}
+
+struct plot_image *plot_cache_publish(const char *key,
+                                      struct vector_char *png) {
+  assert(png->arena == NULL);
+  /* Cached images live for a while, don't keep the reader's slack */
+  vector_shrink_to_fit_char(png);
+  struct plot_image *image = malloc_checked(sizeof(struct plot_image));
+  *image = (struct plot_image){.buf = png->buf, .len = png->len, .refs = 1};
+  png->buf = NULL;
+  png->len = 0;
+  png->cap = 0;
+
+  pthread_mutex_lock(&cache.lock);
+  struct plot_cache_entry *entry =
+      cache.stats.budget > 0 ? find(key, hash_key(key)) : NULL;
+  if (entry == NULL || entry->image != NULL) {
+    pthread_mutex_unlock(&cache.lock);
+    return image;
+  }
+
+  /* One reference for the cache and one for each waiter */
+  struct plot_cache_waiter *waiters = entry->waiters;
+  entry->waiters = NULL;
+  image->refs++;
+  for (struct plot_cache_waiter *w = waiters; w != NULL; w = w->next) {
+    image->refs++;
+    cache.stats.hits++;
+    cache.stats.coalesced++;
+  }
+  entry->image = image;
+  entry->size = sizeof(struct plot_cache_entry) + strlen(key) + 1 + image->len;
+  lru_push_front(entry);
+  cache.stats.len++;
+  cache.stats.bytes += entry->size;
+
+  /* An image bigger than the whole budget still goes to the waiters but is
+   * evicted right away */
+  while (cache.stats.bytes > cache.stats.budget) {
+    evict(cache.tail);
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  notify_waiters(waiters, image);
+  return image;
+}
+
+void plot_cache_abandon(const char *key) {
+  pthread_mutex_lock(&cache.lock);
+  struct plot_cache_entry *entry =
+      cache.stats.budget > 0 ? find(key, hash_key(key)) : NULL;
+  struct plot_cache_waiter *waiters = NULL;
+  if (entry != NULL && entry->image == NULL) {
+    /* Failures aren't cached, the next request tries again */
+    waiters = entry->waiters;
+    bucket_remove(entry);
+    entry_free(entry);
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  notify_waiters(waiters, NULL);
+}
+
+struct plot_cache_stats plot_cache_get_stats(void) {
+  pthread_mutex_lock(&cache.lock);
+  struct plot_cache_stats stats = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+  return stats;
+}
@@ -0,0 +1,277 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/mem.h"
+#include "include/png.h"
+#include "include/vector.h"
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+/* Candidates tried per position, plots are mostly long runs so a short chain
+ * already finds nearly every match */
+#define DEFLATE_MAX_CHAIN 16
+
+static const unsigned short length_base[] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short dist_base[] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const unsigned char dist_extra[] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                           3, 3, 4,  4,  5,  5,  6,  6,
+                                           7, 7, 8,  8,  9,  9,  10, 10,
+                                           11, 11, 12, 12, 13, 13};
+
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+static void crc_table_init(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+  __atomic_store_n(&crc_table_ready, true, __ATOMIC_RELEASE);
+}
+
+uint32_t png_crc32(uint32_t crc, const unsigned char *buf, size_t len) {
+  if (!__atomic_load_n(&crc_table_ready, __ATOMIC_ACQUIRE)) {
+    crc_table_init();
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+uint32_t png_adler32(uint32_t adler, const unsigned char *buf, size_t len) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+  while (len > 0) {
+    /* 5552 is the most bytes that can't overflow `b` before the modulo */
+    size_t n = len < 5552 ? len : 5552;
+    len -= n;
+    while (n-- > 0) {
+      a += *buf++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+struct bit_writer {
+  struct vector_char *out;
+  uint32_t bits;
+  unsigned n_bits;
+};
+
+static void put_bits(struct bit_writer *bw, uint32_t value, unsigned n) {
+  bw->bits |= value << bw->n_bits;
+  bw->n_bits += n;
+  while (bw->n_bits >= 8) {
+    vector_push_char(bw->out, (char)(bw->bits & 0xff));
+    bw->bits >>= 8;
+    bw->n_bits -= 8;
+  }
+}
+
+/* Huffman codes are packed starting from their most significant bit */
+static void put_huffman(struct bit_writer *bw, uint32_t code, unsigned n) {
+  uint32_t reversed = 0;
+  for (unsigned i = 0; i < n; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  put_bits(bw, reversed, n);
+}
+
+static void put_symbol(struct bit_writer *bw, unsigned sym) {
+  if (sym < 144) {
+    put_huffman(bw, 0x30 + sym, 8);
+  } else if (sym < 256) {
+    put_huffman(bw, 0x190 + sym - 144, 9);
+  } else if (sym < 280) {
+    put_huffman(bw, sym - 256, 7);
+  } else {
+    put_huffman(bw, 0xc0 + sym - 280, 8);
+  }
+}
+
+static void put_match(struct bit_writer *bw, size_t len, size_t dist) {
+  unsigned l = 0;
+  while (l + 1 < sizeof(length_base) / sizeof(length_base[0]) &&
+         length_base[l + 1] <= len) {
+    l++;
+  }
+  put_symbol(bw, 257 + l);
+  put_bits(bw, len - length_base[l], length_extra[l]);
+
+  unsigned d = 0;
+  while (d + 1 < sizeof(dist_base) / sizeof(dist_base[0]) &&
+         dist_base[d + 1] <= dist) {
+    d++;
+  }
+  put_huffman(bw, d, 5);
+  put_bits(bw, dist - dist_base[d], dist_extra[d]);
+}
+
+static inline uint32_t hash3(const unsigned char *p) {
+  uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+  return (v * 0x9e3779b1u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+void png_deflate(const unsigned char *data, size_t len,
+                 struct vector_char *out) {
+  /* CMF: deflate with a 32K window, FLG: no dictionary, fastest level */
+  vector_push_char(out, 0x78);
+  vector_push_char(out, 0x01);
+
+  int32_t *head = malloc_checked((1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+  int32_t *prev = malloc_checked(DEFLATE_WINDOW * sizeof(int32_t));
+  memset(head, 0xff, (1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+
+  struct bit_writer bw = {.out = out};
+  /* A single final block with the fixed codes */
+  put_bits(&bw, 1, 1);
+  put_bits(&bw, 1, 2);
+
+  size_t i = 0;
+  while (i < len) {
+    size_t best_len = 0;
+    size_t best_dist = 0;
+
+    if (i + DEFLATE_MIN_MATCH <= len) {
+      uint32_t h = hash3(data + i);
+      size_t max = len - i < DEFLATE_MAX_MATCH ? len - i : DEFLATE_MAX_MATCH;
+      int32_t cand = head[h];
+      for (int chain = 0; cand >= 0 && i - (size_t)cand <= DEFLATE_WINDOW &&
+                          chain < DEFLATE_MAX_CHAIN;
+           chain++) {
+        size_t l = 0;
+        while (l < max && data[cand + l] == data[i + l]) {
+          l++;
+        }
+        if (l > best_len) {
+          best_len = l;
+          best_dist = i - cand;
+          if (l == max) {
+            break;
+          }
+        }
+        int32_t next = prev[cand & (DEFLATE_WINDOW - 1)];
+        if (next >= cand) {
+          break;
+        }
+        cand = next;
+      }
+      prev[i & (DEFLATE_WINDOW - 1)] = head[h];
+      head[h] = (int32_t)i;
+    }
+
+    if (best_len < DEFLATE_MIN_MATCH) {
+      put_symbol(&bw, data[i]);
+      i++;
+      continue;
+    }
+
+    put_match(&bw, best_len, best_dist);
+    for (size_t j = i + 1; j < i + best_len && j + DEFLATE_MIN_MATCH <= len;
+         j++) {
+      uint32_t h = hash3(data + j);
+      prev[j & (DEFLATE_WINDOW - 1)] = head[h];
+      head[h] = (int32_t)j;
+    }
+    i += best_len;
+  }
+
+  put_symbol(&bw, 256);
+  if (bw.n_bits > 0) {
+    put_bits(&bw, 0, 8 - bw.n_bits);
+  }
+
+  free_checked(head);
+  free_checked(prev);
+
+  uint32_t adler = png_adler32(1, data, len);
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    vector_push_char(out, (char)(adler >> shift));
+  }
+}
+
+static void put_u32(struct vector_char *out, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    vector_push_char(out, (char)(value >> shift));
+  }
+}
+
+/* Writes the chunk header, lets `out` grow with the payload and then adds
+ * the CRC over type and payload */
+static size_t chunk_begin(struct vector_char *out, const char type[4]) {
+  put_u32(out, 0);
+  size_t start = out->len;
+  vector_extend_char(out, (char *)type, 4);
+  return start;
+}
+
+static void chunk_end(struct vector_char *out, size_t start) {
+  uint32_t len = (uint32_t)(out->len - start - 4);
+  unsigned char *len_field = (unsigned char *)out->buf + start - 4;
+  for (int i = 0; i < 4; i++) {
+    len_field[i] = (unsigned char)(len >> (24 - 8 * i));
+  }
+  put_u32(out, png_crc32(0, (unsigned char *)out->buf + start, len + 4));
+}
+
+void png_encode_indexed(const unsigned char *pixels, uint32_t width,
+                        uint32_t height, const unsigned char (*palette)[3],
+                        size_t n_colors, struct vector_char *out) {
+  vector_extend_char(out, "\x89PNG\r\n\x1a\n", 8);
+
+  size_t chunk = chunk_begin(out, "IHDR");
+  put_u32(out, width);
+  put_u32(out, height);
+  /* 8 bit depth, palette color, deflate, adaptive filtering, no interlace */
+  vector_extend_char(out, "\x08\x03\x00\x00\x00", 5);
+  chunk_end(out, chunk);
+
+  chunk = chunk_begin(out, "PLTE");
+  vector_extend_char(out, (char *)palette, n_colors * 3);
+  chunk_end(out, chunk);
+
+  /* Every row uses the Up filter, which turns the rows of a plot that only
+   * differ in a few pixels into runs of zeros */
+  size_t stride = (size_t)width + 1;
+  unsigned char *filtered = malloc_checked(stride * height);
+  for (uint32_t y = 0; y < height; y++) {
+    unsigned char *row = filtered + y * stride;
+    const unsigned char *cur = pixels + (size_t)y * width;
+    row[0] = 2;
+    if (y == 0) {
+      memcpy(row + 1, cur, width);
+      continue;
+    }
+    const unsigned char *up = cur - width;
+    for (uint32_t x = 0; x < width; x++) {
+      row[x + 1] = (unsigned char)(cur[x] - up[x]);
+    }
+  }
+
+  chunk = chunk_begin(out, "IDAT");
+  png_deflate(filtered, stride * height, out);
+  chunk_end(out, chunk);
+  free_checked(filtered);
+
+  chunk = chunk_begin(out, "IEND");
+  chunk_end(out, chunk);
+}
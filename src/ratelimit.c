@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/clock.h"
+#include "include/mem.h"
+#include "include/ratelimit.h"
+
+/* Probes per lookup, beyond that the stalest bucket in the window is
+ * replaced */
+#define RATELIMIT_PROBES 16
+/* Slots the incremental sweep looks at per admission */
+#define RATELIMIT_SWEEP 2
+#define RATELIMIT_CLAIM_RETRIES 4
+
+/* Bucket state is a single word so it can be updated with one CAS:
+ * | last refill in ms (39 bits) | notified (1 bit) | tokens (24 bits) | */
+#define TOKEN_FRAC_BITS 8
+#define TOKEN_BITS 24
+#define TOKEN_MASK ((UINT64_C(1) << TOKEN_BITS) - 1)
+#define NOTIFIED_BIT (UINT64_C(1) << TOKEN_BITS)
+#define TIME_SHIFT (TOKEN_BITS + 1)
+
+#define KEY_EMPTY 0
+#define KEY_TOMBSTONE UINT64_MAX
+
+struct ratelimit_slot {
+  uint64_t key;
+  uint64_t state;
+};
+
+struct ratelimit_table {
+  struct ratelimit_slot *slots;
+  uint64_t burst;
+  uint64_t per_minute;
+  /* Time for an empty bucket to refill completely */
+  uint64_t full_ms;
+  size_t cursor;
+};
+
+static struct {
+  struct ratelimit_table users;
+  struct ratelimit_table channels;
+  uint64_t epoch_ns;
+  struct ratelimit_stats stats;
+} limiter;
+
+const char *ratelimit_result_to_str(RateLimitResult rlr) {
+  switch (rlr) {
+  case RL_OK:
+    return "OK";
+  case RL_USER_LIMITED:
+    return "USER_LIMITED";
+  case RL_CHANNEL_LIMITED:
+    return "CHANNEL_LIMITED";
+  }
+  return "N/A";
+}
+
+uint64_t ratelimit_now_ms(void) {
+  return (clock_now_ns() - limiter.epoch_ns) / 1000000;
+}
+
+static void table_init(struct ratelimit_table *table, unsigned burst,
+                       unsigned per_minute) {
+  table->slots =
+      malloc_checked(RATELIMIT_SLOTS * sizeof(struct ratelimit_slot));
+  memset(table->slots, 0, RATELIMIT_SLOTS * sizeof(struct ratelimit_slot));
+  if (burst > RATELIMIT_MAX_BURST) {
+    burst = RATELIMIT_MAX_BURST;
+  }
+  table->burst = (uint64_t)burst << TOKEN_FRAC_BITS;
+  table->per_minute = per_minute;
+  table->full_ms =
+      per_minute > 0 ? (uint64_t)burst * 60000 / per_minute + 1 : UINT64_MAX;
+  table->cursor = 0;
+}
+
+void ratelimit_init(const struct ratelimit_config *config) {
+  table_init(&limiter.users, config->user_burst, config->user_per_minute);
+  table_init(&limiter.channels, config->channel_burst,
+             config->channel_per_minute);
+  limiter.epoch_ns = clock_now_ns();
+  memset(&limiter.stats, 0, sizeof(limiter.stats));
+}
+
+void ratelimit_cleanup(void) {
+  free_checked(limiter.users.slots);
+  free_checked(limiter.channels.slots);
+  limiter.users.slots = NULL;
+  limiter.channels.slots = NULL;
+}
+
+static inline uint64_t pack(uint64_t ms, bool notified, uint64_t tokens) {
+  return ms << TIME_SHIFT | (notified ? NOTIFIED_BIT : 0) | tokens;
+}
+
+static inline uint64_t state_ms(uint64_t state) { return state >> TIME_SHIFT; }
+
+/* Credits the tokens earned since the last refill and moves `*ms` forward by
+ * the time they took to earn, so frequent calls don't round the refill
+ * away. */
+static uint64_t refill(const struct ratelimit_table *table, uint64_t state,
+                       uint64_t now, uint64_t *ms) {
+  uint64_t last = state_ms(state);
+  uint64_t tokens = state & TOKEN_MASK;
+  uint64_t rate = table->per_minute << TOKEN_FRAC_BITS;
+  *ms = last;
+  if (now <= last || rate == 0) {
+    return tokens;
+  }
+  uint64_t elapsed = now - last;
+  uint64_t gained =
+      elapsed >= table->full_ms ? table->burst : elapsed * rate / 60000;
+  if (tokens + gained >= table->burst) {
+    *ms = now;
+    return table->burst;
+  }
+  *ms = last + gained * 60000 / rate;
+  return tokens + gained;
+}
+
+static inline uint64_t hash_id(uint64_t id) {
+  /* splitmix64 finalizer, snowflakes share their high bits */
+  id ^= id >> 30;
+  id *= 0xbf58476d1ce4e5b9ULL;
+  id ^= id >> 27;
+  id *= 0x94d049bb133111ebULL;
+  id ^= id >> 31;
+  return id;
+}
+
+/* Returns the bucket for `id`, claiming a slot for it if there is none. A
+ * bucket of an id seen for the first time starts out full. */
+static struct ratelimit_slot *table_get(struct ratelimit_table *table,
+                                        uint64_t id, uint64_t now) {
+  size_t start = hash_id(id) & (RATELIMIT_SLOTS - 1);
+  for (int attempt = 0; attempt < RATELIMIT_CLAIM_RETRIES; attempt++) {
+    struct ratelimit_slot *victim = NULL;
+    uint64_t victim_key = KEY_EMPTY;
+    uint64_t victim_ms = UINT64_MAX;
+    bool victim_free = false;
+    for (size_t i = 0; i < RATELIMIT_PROBES; i++) {
+      struct ratelimit_slot *slot =
+          &table->slots[(start + i) & (RATELIMIT_SLOTS - 1)];
+      uint64_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+      if (key == id) {
+        return slot;
+      }
+      if (key == KEY_EMPTY || key == KEY_TOMBSTONE) {
+        if (!victim_free) {
+          victim = slot;
+          victim_key = key;
+          victim_free = true;
+        }
+        if (key == KEY_EMPTY) {
+          /* Nothing was ever stored past here */
+          break;
+        }
+        continue;
+      }
+      uint64_t ms = state_ms(__atomic_load_n(&slot->state, __ATOMIC_RELAXED));
+      if (!victim_free && ms < victim_ms) {
+        victim = slot;
+        victim_key = key;
+        victim_ms = ms;
+      }
+    }
+
+    if (__atomic_compare_exchange_n(&victim->key, &victim_key, id, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      /* Anyone reading the slot between the two stores sees the previous
+       * owner's state, at worst one request is judged against it */
+      __atomic_store_n(&victim->state, pack(now, false, table->burst),
+                       __ATOMIC_RELEASE);
+      if (victim_free) {
+        __atomic_add_fetch(&limiter.stats.live, 1, __ATOMIC_RELAXED);
+      } else {
+        __atomic_add_fetch(&limiter.stats.displaced, 1, __ATOMIC_RELAXED);
+      }
+      return victim;
+    }
+  }
+  return NULL;
+}
+
+/* Returns false without taking anything if there aren't enough tokens */
+static bool bucket_take(const struct ratelimit_table *table,
+                        struct ratelimit_slot *slot, uint64_t cost,
+                        uint64_t now, bool *notify) {
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  while (true) {
+    uint64_t ms;
+    uint64_t tokens = refill(table, state, now, &ms);
+    bool ok = tokens >= cost;
+    uint64_t next =
+        ok ? pack(ms, false, tokens - cost) : pack(ms, true, tokens);
+    if (__atomic_compare_exchange_n(&slot->state, &state, next, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      if (!ok) {
+        *notify = !(state & NOTIFIED_BIT);
+      }
+      return ok;
+    }
+  }
+}
+
+static void bucket_refund(const struct ratelimit_table *table,
+                          struct ratelimit_slot *slot, uint64_t cost) {
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  while (true) {
+    uint64_t tokens = (state & TOKEN_MASK) + cost;
+    if (tokens > table->burst) {
+      tokens = table->burst;
+    }
+    uint64_t next = (state & ~TOKEN_MASK) | tokens;
+    if (__atomic_compare_exchange_n(&slot->state, &state, next, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+}
+
+/* A bucket that has refilled completely is no different from a missing one,
+ * so it can be dropped. Tombstones keep the probe chains behind it intact and
+ * are reused by later claims. */
+static void table_sweep(struct ratelimit_table *table, uint64_t now) {
+  for (int i = 0; i < RATELIMIT_SWEEP; i++) {
+    size_t index = __atomic_fetch_add(&table->cursor, 1, __ATOMIC_RELAXED) &
+                   (RATELIMIT_SLOTS - 1);
+    struct ratelimit_slot *slot = &table->slots[index];
+    uint64_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if (key == KEY_EMPTY || key == KEY_TOMBSTONE) {
+      continue;
+    }
+    uint64_t ms = state_ms(__atomic_load_n(&slot->state, __ATOMIC_RELAXED));
+    if (now >= ms && now - ms >= table->full_ms &&
+        __atomic_compare_exchange_n(&slot->key, &key, KEY_TOMBSTONE, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&limiter.stats.evictions, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&limiter.stats.live, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+RateLimitResult ratelimit_admit(uint64_t user_id, uint64_t channel_id,
+                                unsigned cost, uint64_t now_ms, bool *notify) {
+  *notify = false;
+  table_sweep(&limiter.users, now_ms);
+  table_sweep(&limiter.channels, now_ms);
+
+  uint64_t cost_fp = (uint64_t)cost << TOKEN_FRAC_BITS;
+  /* A saturated table fails open rather than blocking everyone */
+  struct ratelimit_slot *user =
+      user_id != 0 && limiter.users.burst > 0
+          ? table_get(&limiter.users, user_id, now_ms)
+          : NULL;
+  if (user != NULL &&
+      !bucket_take(&limiter.users, user, cost_fp, now_ms, notify)) {
+    __atomic_add_fetch(&limiter.stats.user_limited, 1, __ATOMIC_RELAXED);
+    return RL_USER_LIMITED;
+  }
+
+  struct ratelimit_slot *channel =
+      channel_id != 0 && limiter.channels.burst > 0
+          ? table_get(&limiter.channels, channel_id, now_ms)
+          : NULL;
+  if (channel != NULL &&
+      !bucket_take(&limiter.channels, channel, cost_fp, now_ms, notify)) {
+    if (user != NULL) {
+      bucket_refund(&limiter.users, user, cost_fp);
+    }
+    __atomic_add_fetch(&limiter.stats.channel_limited, 1, __ATOMIC_RELAXED);
+    return RL_CHANNEL_LIMITED;
+  }
+
+  __atomic_add_fetch(&limiter.stats.admitted, 1, __ATOMIC_RELAXED);
+  return RL_OK;
+}
+
+struct ratelimit_stats ratelimit_get_stats(void) {
+  return (struct ratelimit_stats){
+      .admitted = __atomic_load_n(&limiter.stats.admitted, __ATOMIC_RELAXED),
+      .user_limited =
+          __atomic_load_n(&limiter.stats.user_limited, __ATOMIC_RELAXED),
+      .channel_limited =
+          __atomic_load_n(&limiter.stats.channel_limited, __ATOMIC_RELAXED),
+      .evictions = __atomic_load_n(&limiter.stats.evictions, __ATOMIC_RELAXED),
+      .displaced = __atomic_load_n(&limiter.stats.displaced, __ATOMIC_RELAXED),
+      .live = __atomic_load_n(&limiter.stats.live, __ATOMIC_RELAXED)};
+}
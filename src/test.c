@@ -1,12 +1,32 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
 
-#include "include/vector.h"
+#include "include/batch.h"
+#include "include/bignum.h"
+#include "include/calc_cache.h"
+#include "include/conversion.h"
+#include "include/evaluator.h"
+#include "include/gnuplot.h"
+#include "include/histogram.h"
+#include "include/mem.h"
+#include "include/mpmc.h"
+#include "include/parser.h"
+#include "include/pipe_reader.h"
+#include "include/plot.h"
+#include "include/plot_cache.h"
+#include "include/png.h"
+#include "include/ratelimit.h"
+#include "include/trace.h"
+#include "include/vm.h"
 
-VECTOR_HEADER_DEF(double, double);
-VECTOR_FUNC_DEF(double, double);
+#include "include/vector.h"
 
-int main() {
+static void test_vector_double(void) {
   struct vector_double vec;
   vector_init_double(&vec);
   assert(vec.len == 0);
@@ -23,6 +43,874 @@ int main() {
   vector_pop_double(&vec);
   assert(vec.len == 0);
 
+  vector_free_double(&vec);
+}
+
+static void test_vector_char_api(void) {
+  struct vector_char vec;
+  vector_init_char(&vec);
+
+  for (size_t i = 0; i < 1000; i++) {
+    vector_push_char(&vec, 'a');
+  }
+  assert(vec.len == 1000);
+  assert(vec.cap >= 1000 && vec.cap < 2000);
+
+  vector_extend_char(&vec, "hello", 5);
+  assert(vec.len == 1005);
+  assert(vec.buf[1000] == 'h' && vec.buf[1004] == 'o');
+
+  vector_clear_char(&vec);
+  assert(vec.len == 0);
+  assert(vec.cap >= 1005);
+
+  vector_reserve_char(&vec, 5000);
+  assert(vec.cap >= 5000);
+  vector_push_char(&vec, 'x');
+  vector_shrink_to_fit_char(&vec);
+  assert(vec.cap == 1 && vec.buf[0] == 'x');
+
+  vector_free_char(&vec);
+}
+
+static void test_vector_small_double(void) {
+  struct vector_small_double vec;
+  vector_init_small_double(&vec);
+  assert(vec.buf == vec.inline_buf);
+
+  for (size_t i = 0; i < VECTOR_SMALL_CAPACITY; i++) {
+    vector_push_small_double(&vec, (double)i);
+  }
+  assert(vec.buf == vec.inline_buf);
+
+  vector_push_small_double(&vec, -1.0);
+  assert(vec.buf != vec.inline_buf);
+  assert(vec.len == VECTOR_SMALL_CAPACITY + 1);
+  assert(vec.buf[3] == 3.0);
+
+  vector_pop_small_double(&vec);
+  vector_shrink_to_fit_small_double(&vec);
+  assert(vec.buf == vec.inline_buf);
+  assert(vec.buf[VECTOR_SMALL_CAPACITY - 1] == VECTOR_SMALL_CAPACITY - 1);
+
+  vector_free_small_double(&vec);
+}
+
+static void test_arena(void) {
+  unsigned char initial[64];
+  struct arena arena;
+  arena_init(&arena, initial, sizeof(initial), 128);
+
+  void *a = arena_alloc(&arena, 10);
+  void *b = arena_alloc(&arena, 10);
+  assert((uintptr_t)a % ARENA_ALIGNMENT == 0);
+  assert((uintptr_t)b % ARENA_ALIGNMENT == 0);
+  assert(a != b);
+
+  /* The last allocation grows in place */
+  assert(arena_realloc(&arena, b, 10, 20) == b);
+
+  struct vector_char vec;
+  vector_init_arena_char(&vec, &arena);
+  for (size_t i = 0; i < 1000; i++) {
+    vector_push_char(&vec, (char)i);
+  }
+  assert(vec.len == 1000 && vec.buf[999] == (char)999);
+  vector_free_char(&vec);
+  assert(arena.high_water >= 1000);
+
+  size_t high_water = arena.high_water;
+  arena_reset(&arena);
+  assert(arena.allocated == 0 && arena.high_water == high_water);
+  assert(arena_alloc(&arena, 8) == a);
+
+  arena_free(&arena);
+}
+
+static void test_parse_decimal(void) {
+  const char *literals[] = {"0",
+                            "1",
+                            "1.5",
+                            "0.1",
+                            "007.250",
+                            "3.",
+                            "9007199254740993",
+                            "123456789012345678901234567890",
+                            "0.000000000000000000000000000001",
+                            "2.2250738585072011"};
+  for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    double expected = strtod(literals[i], NULL);
+    double parsed = parse_decimal(literals[i], strlen(literals[i]));
+    assert(memcmp(&expected, &parsed, sizeof(double)) == 0);
+  }
+}
+
+static ParseError parse_error_of(const char *expr) {
+  ParseError error = PE_OK;
+  size_t error_index = 0;
+  struct rpn_program program;
+  parse_math((char *)expr, NULL, &program, &error, &error_index);
+  rpn_program_free(&program);
+  return error;
+}
+
+static void test_parse_functions(void) {
+  assert(parse_error_of("sqrt(4) + log10(100)") == PE_OK);
+  assert(parse_error_of("max(1, min(2, 3))") == PE_OK);
+  assert(parse_error_of("max(1)") == PE_WRONG_ARGUMENT_COUNT);
+  assert(parse_error_of("sin(1, 2)") == PE_WRONG_ARGUMENT_COUNT);
+  assert(parse_error_of("(1, 2)") == PE_UNEXPECTED_COMMA);
+  assert(parse_error_of("foo(1)") == PE_INVALID_FUNCTION);
+  assert(parse_error_of("sin 1") == PE_INVALID_FUNCTION);
+  assert(parse_error_of("2 * x + sin(x)") == PE_OK);
+  assert(parse_error_of("y + 1") == PE_UNKNOWN_VARIABLE);
+  assert(parse_error_of("x(1)") == PE_INVALID_FUNCTION);
+  assert(parse_error_of("2 ** pi - e") == PE_OK);
+}
+
+static void assert_normalizes_to(const char *expr, const char *key) {
+  char *normalized = calc_cache_normalize(expr, NULL);
+  assert(strcmp(normalized, key) == 0);
+  free_checked(normalized);
+}
+
+static void test_calc_cache(void) {
+  assert_normalizes_to(" 1 +  2 ", "1+2");
+  assert_normalizes_to("max( 1 , 2 )", "max(1,2)");
+  assert_normalizes_to("1 2", "1 2");
+  assert_normalizes_to("x (1)", "x (1)");
+  assert_normalizes_to("1 + Foo  bar", "1+Foo  bar");
+
+  /* Only the form without the space parses, it must not answer for the
+   * other one */
+  assert(parse_error_of("sin (1)") == PE_INVALID_FUNCTION);
+  assert_normalizes_to("sin (1)", "sin (1)");
+  calc_cache_init(4);
+  char *key = calc_cache_normalize("sin( 1 )", NULL);
+  struct calc_cache_value value = {.result = sin(1), .error = ER_OK};
+  calc_cache_insert(key, &value);
+  assert(calc_cache_lookup(key, &value) && value.result == sin(1));
+  char *spaced_key = calc_cache_normalize("sin (1)", NULL);
+  assert(!calc_cache_lookup(spaced_key, &value));
+  free_checked(spaced_key);
+  free_checked(key);
+  calc_cache_cleanup();
+
+  /* A missing operand, not a power */
+  ParseError error = PE_OK;
+  size_t error_index = 0;
+  struct rpn_program program;
+  parse_math("2 * * 3", NULL, &program, &error, &error_index);
+  assert(program.header.result == ER_MISSING_OPERAND);
+  rpn_program_free(&program);
+  assert_normalizes_to("2 * * 3", "2* *3");
+  assert_normalizes_to("2 ** 3", "2**3");
+  assert_normalizes_to("2***3", "2***3");
+  char *plot_key = plot_cache_key("x * * 2", PB_NATIVE);
+  char *pow_key = plot_cache_key("x**2", PB_NATIVE);
+  assert(strcmp(plot_key, pow_key) != 0);
+  free(plot_key);
+  free(pow_key);
+}
+
+static void test_rpn_header(void) {
+  const struct {
+    const char *expr;
+    EvaluatorResult result;
+    size_t max_depth;
+    size_t n_consts;
+    size_t len;
+  } cases[] = {
+      {"1 + 2 * 3", ER_OK, 3, 3, 5},
+      /* Unary minus becomes TT_NEG and unary plus goes away */
+      {"-3 + +4", ER_OK, 2, 2, 4},
+      {"1 + + 2", ER_OK, 2, 2, 3},
+      {"max(1, 2) * x", ER_OK, 2, 2, 5},
+      /* Programs that fail their checks are left empty */
+      {"1 2", ER_MULTIPLE_RESULTS, 2, 2, 0},
+      {"*", ER_MISSING_OPERAND, 0, 0, 0},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math((char *)cases[i].expr, NULL, &rpn, &error, &error_index);
+    assert(error == PE_OK);
+    assert(rpn.header.result == cases[i].result);
+    assert(rpn.header.max_depth == cases[i].max_depth);
+    assert(rpn.header.n_consts == cases[i].n_consts);
+    assert(rpn.len == cases[i].len);
+    rpn_program_free(&rpn);
+  }
+
+  /* One byte per token next to a pool of the three literals */
+  unsigned char arena_buf[256];
+  struct arena arena;
+  arena_init(&arena, arena_buf, sizeof(arena_buf), sizeof(arena_buf));
+  ParseError error = PE_OK;
+  size_t error_index = 0;
+  struct rpn_program rpn;
+  parse_math("-(2 ^ 10) / 4", &arena, &rpn, &error, &error_index);
+  assert(rpn.len == 6 && rpn.ops[rpn.len - 1] == TT_NEG);
+  assert(rpn.n_operands == 3 && rpn.consts[1].integer == 10);
+  assert(rpn_program_size(&rpn) == 3 * sizeof(union rpn_const) + 6);
+  rpn_program_to_heap(&rpn);
+  arena_free(&arena);
+  double stack[2];
+  EvaluatorResult er;
+  assert(rpn.header.max_depth <= 2 &&
+         evaluate(&rpn, stack, &er) == -256.0 && er == ER_OK);
+  rpn_program_free(&rpn);
+
+  /* Decimals keep a slice of their source, constants an empty one */
+  parse_math("0.25 * pi + 2", NULL, &rpn, &error, &error_index);
+  assert(rpn.n_literals == 2 && rpn.literals[0].offset == 0 &&
+         rpn.literals[0].len == 4 && rpn.literals[1].len == 0);
+  assert(rpn_program_size(&rpn) == 3 * sizeof(union rpn_const) +
+                                       2 * sizeof(struct rpn_literal) + 5);
+  rpn_program_free(&rpn);
+}
+
+static void test_vm_matches_evaluator(void) {
+  const char *exprs[] = {"1 + 2 * 3",
+                         "-(2 ^ 10) / 4",
+                         "max(1, 2) - hypot(3, 4)",
+                         "sqrt(2) * sin(1 + cos(2))",
+                         "-3",
+                         "1 2",
+                         "*"};
+  for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math((char *)exprs[i], NULL, &rpn, &error, &error_index);
+    assert(error == PE_OK);
+
+    EvaluatorResult expected_er;
+    double expected = evaluate(&rpn, NULL, &expected_er);
+    struct vm_program program;
+    assert(vm_compile(&rpn, NULL, &program) == expected_er);
+    if (expected_er == ER_OK) {
+      assert(vm_execute(&program, NULL) == expected);
+    }
+
+    vm_program_free(&program);
+    rpn_program_free(&rpn);
+  }
+}
+
+static void test_evaluate_int(void) {
+  const struct {
+    const char *expr;
+    bool exact;
+    bool overflow;
+    int64_t result;
+  } cases[] = {
+      {"2^40 * 3 - 7", true, false, 3298534883321},
+      {"-(2 ^ 10) / 4", true, false, -256},
+      {"9007199254740993 + 0", true, false, 9007199254740993},
+      {"3 ^ 39", true, false, 4052555153018976267},
+      /* Powers group to the right */
+      {"2 ^ 3 ^ 2", true, false, 512},
+      {"2 ** 3 ** 2 / 2 ^ 3", true, false, 64},
+      {"9223372036854775807", true, false, INT64_MAX},
+      /* Promoted to arbitrary precision */
+      {"3 ^ 40", false, true, 0},
+      {"2 ^ 62 + 2 ^ 62", false, true, 0},
+      {"9223372036854775808", false, true, 0},
+      {"-9223372036854775807 - 1 - 1", false, true, 0},
+      /* Everything else is left to `evaluate()` */
+      {"7 / 2", false, false, 0},
+      {"1 / 0", false, false, 0},
+      {"2 ^ -1", false, false, 0},
+      {"1.0 + 2", false, false, 0},
+      {"pi * 2", false, false, 0},
+      {"max(1, 2)", false, false, 0},
+      {"1 2", false, false, 0},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math((char *)cases[i].expr, NULL, &rpn, &error, &error_index);
+    assert(error == PE_OK);
+    int64_t result = 0;
+    bool overflow = false;
+    assert(evaluate_int(&rpn, &result, &overflow) == cases[i].exact);
+    assert(overflow == cases[i].overflow);
+    assert(!cases[i].exact || result == cases[i].result);
+    rpn_program_free(&rpn);
+  }
+}
+
+static void test_bignum(void) {
+  struct bignum a, b;
+  bignum_init(&a);
+  bignum_init(&b);
+  struct vector_char out;
+  vector_init_char(&out);
+
+  assert(bignum_from_string(&a, "ffffffffffffffffFFFFFFFFFFFFFFFF", 32, 16));
+  bignum_to_string(&a, 10, &out);
+  vector_push_char(&out, '\0');
+  assert(strcmp(out.buf, "340282366920938463463374607431768211455") == 0);
+  assert(!bignum_from_string(&a, "12g", 3, 16));
+
+  /* Large enough for Karatsuba and the divide and conquer conversions */
+  char digits[1002];
+  memset(digits, '0', sizeof(digits));
+  digits[0] = '1';
+  bignum_set_i64(&b, 10);
+  bignum_pow(&a, &b, 1001);
+  assert(bignum_from_string(&b, digits, sizeof(digits), 10));
+  assert(bignum_cmp(&a, &b) == 0);
+  bignum_mul(&a, &a, &b);
+  vector_clear_char(&out);
+  bignum_to_string(&a, 10, &out);
+  assert(out.len == 2003 && out.buf[0] == '1' && out.buf[2002] == '0');
+  bignum_divmod(&a, &b, &a, &b);
+  assert(b.len == 0 && bignum_bits(&a) == 3326);
+
+  vector_free_char(&out);
+  bignum_free(&a);
+  bignum_free(&b);
+}
+
+static void test_conversion(void) {
+  const struct {
+    const char *str;
+    unsigned base;
+    enum ConversionError error;
+    const char *result;
+  } cases[] = {
+      {"-0x1f", 10, CE_OK, "-31"},
+      {"36#zz", 16, CE_OK, "0x50F"},
+      {"0o17", 2, CE_OK, "0b1111"},
+      {"255", 36, CE_OK, "36#73"},
+      {"-0", 16, CE_OK, "0x0"},
+      {"0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF1", 16, CE_OK,
+       "0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF1"},
+      {"0b10000000000000000000000000000000000000000000000000000000000000001",
+       2, CE_OK,
+       "0b10000000000000000000000000000000000000000000000000000000000000001"},
+      {"123456789012345678901234567890", 10, CE_OK,
+       "123456789012345678901234567890"},
+      {"12345678901234567890123456789:", 10, CE_STR_CONVERSION_FAILED, NULL},
+      {"1.5", 10, CE_ATTEMPT_TO_CONVERT_FLOAT, NULL},
+      {"37#1", 10, CE_INVALID_BASE, NULL},
+      {"0x", 10, CE_STR_CONVERSION_FAILED, NULL},
+  };
+  struct bignum num;
+  bignum_init(&num);
+  struct vector_char out;
+  vector_init_char(&out);
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    enum ConversionError error;
+    convert_from_string(cases[i].str, strlen(cases[i].str), &num, &error);
+    assert(error == cases[i].error);
+    if (error == CE_OK) {
+      vector_clear_char(&out);
+      convert_to_base(&num, cases[i].base, &out);
+      vector_push_char(&out, '\0');
+      assert(strcmp(out.buf, cases[i].result) == 0);
+    }
+  }
+  vector_free_char(&out);
+  bignum_free(&num);
+}
+
+static void test_evaluate_exact(void) {
+  const struct {
+    const char *expr;
+    const char *result;
+  } cases[] = {
+      {"2 ^ 100", "1267650600228229401496703205376"},
+      {"9223372036854775807 + 1", "9223372036854775808"},
+      {"-(2 ^ 64) / 2 ^ 63", "-2"},
+      {"1/3 + 1/6", "1/2"},
+      {"0.1 + 0.2", "3/10"},
+      {"e + 0.5 - e", NULL},
+      {"123456789012345678901234567890.5 * 2", "246913578024691357802469135781"},
+      {"2 ^ (0 - 2)", "1/4"},
+      /* Left to floating point */
+      {"pi * 2", NULL},
+      {"2 ^ 0.5", NULL},
+      {"1 / (1 - 1)", NULL},
+      {"10 ^ 100000", NULL},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math((char *)cases[i].expr, NULL, &rpn, &error, &error_index);
+    assert(error == PE_OK);
+    struct bigrat q;
+    bigrat_init(&q);
+    bool exact = evaluate_exact(&rpn, cases[i].expr, &q);
+    assert(exact == (cases[i].result != NULL));
+    if (exact) {
+      struct vector_char out;
+      vector_init_char(&out);
+      bignum_to_string(&q.num, 10, &out);
+      if (!bigrat_is_integer(&q)) {
+        vector_push_char(&out, '/');
+        bignum_to_string(&q.den, 10, &out);
+      }
+      vector_push_char(&out, '\0');
+      assert(strcmp(out.buf, cases[i].result) == 0);
+      vector_free_char(&out);
+    }
+    bigrat_free(&q);
+    rpn_program_free(&rpn);
+  }
+}
+
+static void test_evaluate_batch(void) {
+  const char *exprs[] = {"x",
+                         "3",
+                         "x ^ 2 - 2 * x + 1",
+                         "-x / (1 + abs(x))",
+                         "sqrt(x) + floor(x) * ceil(-x) - trunc(x / 3)",
+                         "max(x, 0.5) * min(x, sin(x)) + hypot(x, 2)"};
+  double xs[1003];
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); i++) {
+    xs[i] = (double)i / 37.0 - 13.0;
+  }
+  xs[7] = NAN;
+
+  for (size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+    ParseError error = PE_OK;
+    size_t error_index = 0;
+    struct rpn_program rpn;
+    parse_math((char *)exprs[i], NULL, &rpn, &error, &error_index);
+    assert(error == PE_OK);
+
+    EvaluatorResult er;
+    evaluate(&rpn, NULL, &er);
+    struct vm_program program;
+    assert(vm_compile(&rpn, NULL, &program) == ER_OK);
+    assert(er == (program.n_vars > 0 ? ER_UNBOUND_VARIABLE : ER_OK));
+
+    /* Odd lengths exercise the padded last block */
+    size_t lengths[] = {0, 1, 5, sizeof(xs) / sizeof(xs[0])};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+      double out[sizeof(xs) / sizeof(xs[0])];
+      evaluate_batch(&program, xs, out, lengths[l]);
+      for (size_t j = 0; j < lengths[l]; j++) {
+        double expected = vm_execute(&program, &xs[j]);
+        assert(memcmp(&expected, &out[j], sizeof(double)) == 0 ||
+               (isnan(expected) && isnan(out[j])));
+      }
+    }
+
+    vm_program_free(&program);
+    rpn_program_free(&rpn);
+  }
+}
+
+static void test_png_checksums(void) {
+  const unsigned char text[] = "123456789";
+  assert(png_crc32(0, text, 9) == 0xcbf43926u);
+  assert(png_crc32(png_crc32(0, text, 4), text + 4, 5) == 0xcbf43926u);
+  assert(png_adler32(1, (const unsigned char *)"Wikipedia", 9) == 0x11e60398u);
+}
+
+static void test_plot_render(void) {
+  PlotError error;
+  struct vector_char png = plot_render("sin(x), x ** 2 / 10", &error);
+  assert(error == PLE_OK);
+  assert(png.len > 8 && memcmp(png.buf, "\x89PNG\r\n\x1a\n", 8) == 0);
+  vector_free_char(&png);
+
+  png = plot_render("max(x, (1, 2))", &error);
+  assert(error == PLE_UNSUPPORTED && png.len == 0);
+  vector_free_char(&png);
+  png = plot_render("sin(x),", &error);
+  assert(error == PLE_EMPTY);
+  vector_free_char(&png);
+  png = plot_render("sqrt(-1 - x * x)", &error);
+  assert(error == PLE_NO_FINITE_POINTS);
+  vector_free_char(&png);
+
+  /* Whatever gnuplot would compute in integers is left to it */
+  const struct {
+    const char *expr;
+    PlotError error;
+  } cases[] = {
+      {"2**3**2 + x", PLE_OK},
+      {"x/2 + 4/2", PLE_OK},
+      {"(-1)**3 / 1 * x", PLE_OK},
+      {"x ** (1 - 2)", PLE_OK},
+      {"1/2*x", PLE_UNSUPPORTED},
+      {"floor(x)/2", PLE_UNSUPPORTED},
+      {"2**-1 * x", PLE_UNSUPPORTED},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    png = plot_render(cases[i].expr, &error);
+    assert(error == cases[i].error);
+    vector_free_char(&png);
+  }
+}
+
+struct gnuplot_result {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  size_t png_len;
+};
+
+static void on_gnuplot_done(struct vector_char *png, void *data) {
+  struct gnuplot_result *r = data;
+  pthread_mutex_lock(&r->lock);
+  r->png_len = png->len;
+  r->done = true;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  vector_free_char(png);
+}
+
+/* Length of the PNG, 0 if the plot failed */
+static size_t gnuplot_plot_wait(const char *expr) {
+  struct gnuplot_result r = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                             .cond = PTHREAD_COND_INITIALIZER};
+  gnuplot_plot_async(expr, on_gnuplot_done, &r);
+  pthread_mutex_lock(&r.lock);
+  while (!r.done) {
+    pthread_cond_wait(&r.cond, &r.lock);
+  }
+  pthread_mutex_unlock(&r.lock);
+  return r.png_len;
+}
+
+static void test_gnuplot_isolation(void) {
+  /* A single worker serves both plots */
+  gnuplot_pool_init(1);
+  if (gnuplot_plot_wait("f(x)=x*0, f(x)") == 0) {
+    /* Not installed on every machine that builds the bot */
+    fprintf(stderr, "Skipping the gnuplot tests, gnuplot is not available\n");
+  } else {
+    assert(gnuplot_pool_get_stats().respawns == 0);
+    assert(gnuplot_plot_wait("f(x)") == 0);
+    assert(gnuplot_plot_wait("sin(x)") > 0);
+    struct gnuplot_pool_stats stats = gnuplot_pool_get_stats();
+    assert(stats.reuses == 2 && stats.respawns == 0);
+  }
+  gnuplot_pool_cleanup();
+}
+
+static void test_pipe_reader(void) {
+  int fds[2];
+  assert(pipe(fds) == 0);
+  char data[3000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)i;
+  }
+  assert(write(fds[1], data, sizeof(data)) == (ssize_t)sizeof(data));
+
+  struct pipe_reader reader;
+  pipe_reader_init(&reader, fds[0], sizeof(data), 50);
+  struct vector_char out;
+  vector_init_char(&out);
+  assert(pipe_reader_fill(&reader, &out, 10) == PR_OK);
+  /* Everything that was in the pipe came with a single read */
+  assert(out.len == sizeof(data) && reader.syscalls == 1);
+  assert(memcmp(out.buf, data, sizeof(data)) == 0);
+
+  /* Nothing more arrives before the deadline */
+  assert(pipe_reader_fill(&reader, &out, sizeof(data)) == PR_OK);
+  assert(pipe_reader_read_all(&reader, &out) == PR_TIMEOUT);
+
+  assert(write(fds[1], "x", 1) == 1);
+  pipe_reader_rearm(&reader, 50);
+  assert(pipe_reader_read_all(&reader, &out) == PR_TOO_LARGE);
+
+  close(fds[1]);
+  vector_clear_char(&out);
+  reader.max_size = 1 << 20;
+  assert(pipe_reader_read_all(&reader, &out) == PR_OK && out.len == 0);
+
+  close(fds[0]);
+  vector_free_char(&out);
+}
+
+static void plot_cache_waiter(struct plot_image *image, void *data) {
+  *(struct plot_image **)data = image;
+}
+
+static void test_plot_cache(void) {
+  plot_cache_init(4096);
+  char *key = plot_cache_key(" sin( x ) ", PB_NATIVE);
+  char *same_key = plot_cache_key("sin(x)", PB_NATIVE);
+  char *other_key = plot_cache_key("sin(x)", PB_GNUPLOT);
+  assert(strcmp(key, same_key) == 0 && strcmp(key, other_key) != 0);
+
+  struct plot_image *image;
+  assert(plot_cache_acquire(key, &image, NULL, NULL) == PCR_MISS);
+  assert(image == NULL);
+  /* Identical requests are answered once the render is published */
+  struct plot_image *shared = NULL;
+  assert(plot_cache_acquire(same_key, &image, plot_cache_waiter, &shared) ==
+         PCR_PENDING);
+  struct vector_char png;
+  vector_init_char(&png);
+  vector_extend_char(&png, "png", 3);
+  image = plot_cache_publish(key, &png);
+  assert(png.buf == NULL && image->len == 3);
+  assert(shared == image);
+  plot_image_release(shared);
+  plot_image_release(image);
+
+  /* A failed render isn't cached */
+  assert(plot_cache_acquire(other_key, &image, NULL, NULL) == PCR_MISS);
+  shared = image;
+  assert(plot_cache_acquire(other_key, &image, plot_cache_waiter, &shared) ==
+         PCR_PENDING);
+  plot_cache_abandon(other_key);
+  assert(shared == NULL);
+  assert(plot_cache_acquire(other_key, &image, NULL, NULL) == PCR_MISS);
+
+  /* Doesn't fit next to the first image */
+  vector_init_char(&png);
+  vector_reserve_char(&png, 3940);
+  png.len = 3940;
+  struct plot_image *big = plot_cache_publish(other_key, &png);
+  struct plot_cache_stats stats = plot_cache_get_stats();
+  assert(stats.evictions == 1 && stats.len == 1 && stats.bytes <= 4096);
+  assert(stats.coalesced == 1);
+  assert(plot_cache_acquire(other_key, &image, NULL, NULL) == PCR_HIT);
+  assert(image == big);
+  plot_image_release(image);
+  plot_image_release(big);
+  assert(plot_cache_acquire(key, &image, NULL, NULL) == PCR_MISS);
+  plot_cache_abandon(key);
+
+  free(key);
+  free(same_key);
+  free(other_key);
+  plot_cache_cleanup();
+}
+
+#define MPMC_TEST_ITEMS 100000
+
+static void *mpmc_producer(void *arg) {
+  struct mpmc_queue *q = arg;
+  for (uintptr_t i = 1; i <= MPMC_TEST_ITEMS; i++) {
+    while (!mpmc_push(q, (void *)i)) {
+    }
+  }
+  return NULL;
+}
+
+static void *mpmc_consumer(void *arg) {
+  struct mpmc_queue *q = arg;
+  uintptr_t sum = 0;
+  for (size_t n = 0; n < MPMC_TEST_ITEMS; n++) {
+    void *item;
+    while ((item = mpmc_pop(q)) == NULL) {
+    }
+    sum += (uintptr_t)item;
+  }
+  return (void *)sum;
+}
+
+static void test_mpmc(void) {
+  struct mpmc_queue q;
+  mpmc_init(&q, 3);
+  assert(mpmc_capacity(&q) == 4 && mpmc_pop(&q) == NULL);
+  int items[5];
+  for (int i = 0; i < 4; i++) {
+    assert(mpmc_push(&q, &items[i]));
+  }
+  assert(!mpmc_push(&q, &items[4]) && mpmc_size(&q) == 4);
+  assert(mpmc_pop(&q) == &items[0]);
+  assert(mpmc_push(&q, &items[4]));
+  for (int i = 1; i < 5; i++) {
+    assert(mpmc_pop(&q) == &items[i]);
+  }
+  assert(mpmc_pop(&q) == NULL);
+  mpmc_free(&q);
+
+  /* Every item arrives exactly once */
+  mpmc_init(&q, 64);
+  pthread_t producers[2];
+  pthread_t consumers[2];
+  for (int i = 0; i < 2; i++) {
+    assert(pthread_create(&producers[i], NULL, mpmc_producer, &q) == 0);
+    assert(pthread_create(&consumers[i], NULL, mpmc_consumer, &q) == 0);
+  }
+  uintptr_t total = 0;
+  for (int i = 0; i < 2; i++) {
+    void *sum;
+    assert(pthread_join(producers[i], NULL) == 0);
+    assert(pthread_join(consumers[i], &sum) == 0);
+    total += (uintptr_t)sum;
+  }
+  assert(total == (uintptr_t)MPMC_TEST_ITEMS * (MPMC_TEST_ITEMS + 1));
+  assert(mpmc_pop(&q) == NULL);
+  mpmc_free(&q);
+}
+
+static void test_ratelimit(void) {
+  ratelimit_init(&(struct ratelimit_config){.user_burst = 2,
+                                            .user_per_minute = 60,
+                                            .channel_burst = 3,
+                                            .channel_per_minute = 60});
+  bool notify;
+  assert(ratelimit_admit(1, 10, 1, 1000, &notify) == RL_OK);
+  assert(ratelimit_admit(1, 10, 1, 1000, &notify) == RL_OK);
+  /* Only the first rejection of a run asks for a reply */
+  assert(ratelimit_admit(1, 10, 1, 1000, &notify) == RL_USER_LIMITED &&
+         notify);
+  assert(ratelimit_admit(1, 10, 1, 1500, &notify) == RL_USER_LIMITED &&
+         !notify);
+  /* One token per second */
+  assert(ratelimit_admit(1, 10, 1, 2000, &notify) == RL_OK && !notify);
+
+  /* The channel has one token left, a rejected request costs the user
+   * nothing */
+  assert(ratelimit_admit(2, 10, 1, 2000, &notify) == RL_OK);
+  assert(ratelimit_admit(3, 10, 2, 2000, &notify) == RL_CHANNEL_LIMITED &&
+         notify);
+  assert(ratelimit_admit(3, 11, 2, 2000, &notify) == RL_OK);
+
+  struct ratelimit_stats stats = ratelimit_get_stats();
+  assert(stats.admitted == 5 && stats.user_limited == 2 &&
+         stats.channel_limited == 1 && stats.live == 5);
+
+  /* Refilled buckets are swept away */
+  for (size_t i = 0; i < RATELIMIT_SLOTS; i++) {
+    ratelimit_admit(0, 0, 1, 60000, &notify);
+  }
+  stats = ratelimit_get_stats();
+  assert(stats.live == 0 && stats.evictions == 5 && stats.displaced == 0);
+  ratelimit_cleanup();
+}
+
+static void test_histogram(void) {
+  struct histogram h = {0};
+  assert(histogram_quantile(&h, 0.5) == 0);
+  for (uint64_t i = 1; i <= 10000; i++) {
+    histogram_record(&h, i * 1000);
+  }
+  assert(h.count == 10000 && h.max == 10000000);
+  /* Reported values are never below the real ones and at most 1/16 above */
+  uint64_t p50 = histogram_quantile(&h, 0.5);
+  uint64_t p99 = histogram_quantile(&h, 0.99);
+  assert(p50 >= 5000000 && p50 <= 5000000 + 5000000 / 16);
+  assert(p99 >= 9900000 && p99 <= 9900000 + 9900000 / 16);
+  assert(histogram_quantile(&h, 1) == 10000000);
+
+  /* Small values are exact, huge ones are clamped */
+  struct histogram merged = {0};
+  histogram_record(&merged, 3);
+  histogram_record(&merged, UINT64_MAX);
+  histogram_merge(&merged, &h);
+  assert(merged.count == 10002 && merged.max == UINT64_MAX);
+  assert(histogram_quantile(&merged, 0) == 3);
+  assert(histogram_quantile(&merged, 0.5) == p50);
+}
+
+static void test_trace(void) {
+  /* Off by default, a request isn't traced and spans cost a branch */
+  assert(trace_sample(42) == 0);
+  trace_set_current(0);
+  assert(trace_begin() == 0);
+
+  trace_init(2);
+  assert(trace_sample(42) == 42 && trace_sample(43) == 0);
+  trace_set_current(42);
+  ParseError error = PE_OK;
+  size_t error_index = 0;
+  struct rpn_program rpn;
+  parse_math("sin(1) + 2 * 3", NULL, &rpn, &error, &error_index);
+  assert(error == PE_OK);
+  rpn_program_free(&rpn);
+  trace_record(7, "reply", 1000, 3000);
+  trace_set_current(0);
+  /* Nothing is recorded without a current trace */
+  trace_end("ignored", 1);
+
+  struct vector_char json;
+  vector_init_char(&json);
+  trace_format_json(&json);
+  vector_push_char(&json, '\0');
+  assert(strstr(json.buf, "\"name\":\"parse\"") != NULL);
+  assert(strstr(json.buf, "\"request\":\"42\",\"lex_us\":") != NULL);
+  assert(strstr(json.buf, "\"shunting_yard_us\":") != NULL);
+  assert(strstr(json.buf, "\"ts\":1.000,\"dur\":2.000") != NULL);
+  assert(strstr(json.buf, "ignored") == NULL);
+  vector_free_char(&json);
+
+  /* The ring keeps the newest spans */
+  for (int i = 0; i < TRACE_RING_SIZE; i++) {
+    trace_record(8, "filler", 0, 1);
+  }
+  vector_init_char(&json);
+  trace_format_json(&json);
+  vector_push_char(&json, '\0');
+  assert(strstr(json.buf, "parse") == NULL);
+  vector_free_char(&json);
+  trace_cleanup();
+}
+
+static void test_mem(void) {
+  struct mem_tag_stats before = mem_get_stats(MT_CONVERSION);
+  MemTag tag = mem_tag_swap(MT_CONVERSION);
+  char *buf = malloc_checked(100);
+  mem_tag_swap(tag);
+  /* Resizing keeps the tag the block was allocated under */
+  buf = realloc_checked(buf, 300);
+  struct mem_tag_stats during = mem_get_stats(MT_CONVERSION);
+  assert(during.live_bytes == before.live_bytes + 300);
+  assert(during.live_blocks == before.live_blocks + 1);
+  assert(during.peak_bytes >= during.live_bytes);
+  assert(during.allocations == before.allocations + 1);
+  assert(during.reallocs == before.reallocs + 1);
+  free_checked(buf);
+  assert(mem_get_stats(MT_CONVERSION).live_bytes == before.live_bytes);
+
+  mem_set_request_limit(1000);
+  mem_request_begin();
+  buf = malloc_checked(600);
+  assert(!mem_request_exceeded());
+  /* Freed memory is given back to the request */
+  free_checked(buf);
+  buf = malloc_checked(600);
+  assert(!mem_request_exceeded());
+  char *more = malloc_checked(600);
+  assert(mem_request_exceeded());
+  mem_request_end();
+  free_checked(more);
+  free_checked(buf);
+  mem_set_request_limit(MEM_DEFAULT_REQUEST_LIMIT);
+}
+
+int main() {
+  test_vector_double();
+  test_vector_char_api();
+  test_vector_small_double();
+  test_arena();
+  test_parse_decimal();
+  test_parse_functions();
+  test_calc_cache();
+  test_rpn_header();
+  test_vm_matches_evaluator();
+  test_evaluate_int();
+  test_bignum();
+  test_conversion();
+  test_evaluate_exact();
+  test_evaluate_batch();
+  test_png_checksums();
+  test_plot_render();
+  test_pipe_reader();
+  test_gnuplot_isolation();
+  test_plot_cache();
+  test_mpmc();
+  test_ratelimit();
+  test_histogram();
+  test_trace();
+  test_mem();
+
   printf("All tests passed\n");
 
   return 0;
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "include/clock.h"
+#include "include/mem.h"
+#include "include/trace.h"
+#include "include/vector.h"
+
+struct trace_event {
+  const char *name;
+  uint64_t id;
+  uint64_t start;
+  uint64_t end;
+  const char *arg_names[TRACE_MAX_ARGS];
+  uint64_t arg_ns[TRACE_MAX_ARGS];
+};
+
+/* Written by its thread only. Readers copy an event and then check that
+ * `head` hasn't lapped it in the meantime. */
+struct trace_ring {
+  struct trace_event events[TRACE_RING_SIZE];
+  uint64_t head;
+  pid_t tid;
+  struct trace_ring *next;
+};
+
+static struct {
+  unsigned sample_every;
+  uint64_t requests;
+  /* Rings are only ever added until `trace_cleanup()` */
+  struct trace_ring *rings;
+} tracer;
+
+static __thread struct trace_ring *local_ring;
+static __thread uint64_t current_id;
+
+void trace_init(unsigned sample_every) {
+  __atomic_store_n(&tracer.sample_every, sample_every, __ATOMIC_RELAXED);
+}
+
+void trace_cleanup(void) {
+  __atomic_store_n(&tracer.sample_every, 0, __ATOMIC_RELAXED);
+  struct trace_ring *ring =
+      __atomic_exchange_n(&tracer.rings, NULL, __ATOMIC_ACQ_REL);
+  while (ring != NULL) {
+    struct trace_ring *next = ring->next;
+    free_checked(ring);
+    ring = next;
+  }
+  local_ring = NULL;
+}
+
+uint64_t trace_sample(uint64_t request_id) {
+  unsigned every = __atomic_load_n(&tracer.sample_every, __ATOMIC_RELAXED);
+  if (every == 0) {
+    return 0;
+  }
+  uint64_t n = __atomic_fetch_add(&tracer.requests, 1, __ATOMIC_RELAXED);
+  if (n % every != 0) {
+    return 0;
+  }
+  return request_id != 0 ? request_id : n + 1;
+}
+
+void trace_set_current(uint64_t id) { current_id = id; }
+
+uint64_t trace_current(void) { return current_id; }
+
+uint64_t trace_begin(void) {
+  return current_id != 0 ? clock_now_ns() : 0;
+}
+
+static struct trace_ring *ring_get(void) {
+  if (local_ring == NULL) {
+    struct trace_ring *ring = malloc_checked(sizeof(struct trace_ring));
+    memset(ring, 0, sizeof(struct trace_ring));
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    ring->next = __atomic_load_n(&tracer.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&tracer.rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    local_ring = ring;
+  }
+  return local_ring;
+}
+
+static void record(uint64_t id, const char *name, uint64_t start, uint64_t end,
+                   const struct trace_arg *args, size_t n_args) {
+  struct trace_ring *ring = ring_get();
+  uint64_t head = ring->head;
+  struct trace_event *e = &ring->events[head % TRACE_RING_SIZE];
+  /* Readers that see the new contents must also see that the slot was
+   * handed out */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->id, id, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->start, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->end, end, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < TRACE_MAX_ARGS; i++) {
+    __atomic_store_n(&e->arg_names[i], i < n_args ? args[i].name : NULL,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg_ns[i], i < n_args ? args[i].ns : 0,
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_end(const char *name, uint64_t start) {
+  trace_end_args(name, start, NULL, 0);
+}
+
+void trace_end_args(const char *name, uint64_t start,
+                    const struct trace_arg *args, size_t n_args) {
+  if (start == 0 || current_id == 0) {
+    return;
+  }
+  record(current_id, name, start, clock_now_ns(), args, n_args);
+}
+
+void trace_record(uint64_t id, const char *name, uint64_t start,
+                  uint64_t end) {
+  if (id != 0) {
+    record(id, name, start, end, NULL, 0);
+  }
+}
+
+static bool event_load(const struct trace_ring *ring, uint64_t index,
+                       struct trace_event *out) {
+  const struct trace_event *e = &ring->events[index % TRACE_RING_SIZE];
+  out->name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+  out->id = __atomic_load_n(&e->id, __ATOMIC_RELAXED);
+  out->start = __atomic_load_n(&e->start, __ATOMIC_RELAXED);
+  out->end = __atomic_load_n(&e->end, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < TRACE_MAX_ARGS; i++) {
+    out->arg_names[i] = __atomic_load_n(&e->arg_names[i], __ATOMIC_RELAXED);
+    out->arg_ns[i] = __atomic_load_n(&e->arg_ns[i], __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return index + TRACE_RING_SIZE >
+         __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+}
+
+void trace_format_json(struct vector_char *out) {
+  vector_char_printf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  bool first = true;
+  int pid = (int)getpid();
+  for (struct trace_ring *ring =
+           __atomic_load_n(&tracer.rings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t index = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (; index < head; index++) {
+      struct trace_event e;
+      if (!event_load(ring, index, &e)) {
+        /* Overwritten while we were reading it */
+        continue;
+      }
+      vector_char_printf(out,
+                         "%s\n{\"name\":\"%s\",\"cat\":\"bprogbot\","
+                         "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                         "\"tid\":%d,\"args\":{\"request\":\"%llu\"",
+                         first ? "" : ",", e.name, e.start / 1e3,
+                         (e.end - e.start) / 1e3, pid, (int)ring->tid,
+                         (unsigned long long)e.id);
+      for (size_t i = 0; i < TRACE_MAX_ARGS && e.arg_names[i] != NULL; i++) {
+        vector_char_printf(out, ",\"%s_us\":%.3f", e.arg_names[i],
+                           e.arg_ns[i] / 1e3);
+      }
+      vector_char_printf(out, "}}");
+      first = false;
+    }
+  }
+  vector_char_printf(out, "\n]}\n");
+}
@@ -1,3 +1,5 @@
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 
@@ -12,3 +14,25 @@ VECTOR_FUNC_DEF(char, char);
 VECTOR_FUNC_DEF(Token, token);
 
 VECTOR_FUNC_DEF(double, double);
+
+VECTOR_SBO_FUNC_DEF(double, small_double);
+
+VECTOR_SBO_FUNC_DEF(Token, small_token);
+
+void vector_char_printf(struct vector_char *v, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  assert(len >= 0);
+
+  /* vsnprintf() always writes the null byte, which is left out of `len` */
+  size_t needed = v->len + (size_t)len + 1;
+  if (needed > v->cap) {
+    vector_reserve_char(v, vector_next_capacity(v->cap, needed));
+  }
+  va_start(args, fmt);
+  vsnprintf(v->buf + v->len, (size_t)len + 1, fmt, args);
+  va_end(args);
+  v->len += (size_t)len;
+}
@@ -0,0 +1,285 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/evaluator.h"
+#include "include/functions.h"
+#include "include/mem.h"
+#include "include/parser.h"
+#include "include/vm.h"
+
+/* While compiling, operands referring to the constant pool or to a variable
+ * carry one of these flags, everything else is a stack slot. They are mapped
+ * to registers at the end once the size of the constant pool is known. */
+#define REG_CONST 0x8000
+#define REG_VAR 0x4000
+
+static void *program_alloc(struct arena *arena, size_t size) {
+  return arena != NULL ? arena_alloc(arena, size) : malloc_checked(size);
+}
+
+static uint16_t add_const(struct vm_program *program, double value) {
+  program->consts[program->n_consts] = value;
+  return program->n_consts++;
+}
+
+static inline void emit(struct vm_program *program, Opcode op, uint16_t dst,
+                        uint16_t a, uint16_t b) {
+  program->code[program->len++] =
+      (Instruction){.op = op, .dst = dst, .a = a, .b = b};
+}
+
+static inline uint16_t to_register(const struct vm_program *program,
+                                   uint16_t operand) {
+  if (operand & REG_CONST) {
+    return operand & ~REG_CONST;
+  }
+  if (operand & REG_VAR) {
+    return program->n_consts + (operand & ~REG_VAR);
+  }
+  return program->n_consts + program->n_vars + operand;
+}
+
+EvaluatorResult vm_compile(const struct rpn_program *rpn, struct arena *arena,
+                           struct vm_program *program) {
+  *program = (struct vm_program){.arena = arena};
+
+  if (rpn->header.result != ER_OK) {
+    return rpn->header.result;
+  }
+  /* Every token adds at most one constant or one temporary */
+  if (rpn->len * 2 + N_VARIABLES + 1 > VM_MAX_REGISTERS) {
+    return ER_TOO_COMPLEX;
+  }
+
+  MemTag tag = mem_tag_swap(MT_EVALUATOR);
+  size_t n = rpn->len > 0 ? rpn->len : 1;
+  program->code = program_alloc(arena, (n + 1) * sizeof(Instruction));
+  program->consts = program_alloc(arena, n * sizeof(double));
+  uint16_t stack_buf[VM_INLINE_REGISTERS];
+  uint16_t *stack = n <= VM_INLINE_REGISTERS
+                        ? stack_buf
+                        : program_alloc(arena, n * sizeof(uint16_t));
+
+  EvaluatorResult res = ER_OK;
+  uint16_t depth = 0;
+  uint16_t max_depth = 0;
+  const union rpn_const *operand = rpn->consts;
+
+  for (size_t i = 0; i < rpn->len && res == ER_OK; i++) {
+    TokenType tt = (TokenType)rpn->ops[i];
+    switch (tt) {
+    case TT_NUM:
+      stack[depth++] = REG_CONST | add_const(program, (operand++)->num);
+      break;
+    case TT_INT:
+      stack[depth++] =
+          REG_CONST | add_const(program, (double)(operand++)->integer);
+      break;
+    case TT_VAR: {
+      uint16_t var = (uint16_t)(operand++)->integer;
+      if (var >= program->n_vars) {
+        program->n_vars = var + 1;
+      }
+      stack[depth++] = REG_VAR | var;
+      break;
+    }
+    case TT_NEG:
+      if (depth < 1) {
+        res = ER_MISSING_OPERAND;
+        break;
+      }
+      emit(program, OP_NEG, depth - 1, stack[depth - 1], stack[depth - 1]);
+      stack[depth - 1] = depth - 1;
+      break;
+    case TT_ADD:
+    case TT_SUB:
+    case TT_MULTIPLY:
+    case TT_DIVIDE:
+    case TT_POW:
+      if (depth < 2) {
+        res = ER_MISSING_OPERAND;
+        break;
+      }
+      Opcode op = tt == TT_ADD        ? OP_ADD
+                  : tt == TT_SUB      ? OP_SUB
+                  : tt == TT_MULTIPLY ? OP_MUL
+                  : tt == TT_DIVIDE   ? OP_DIV
+                                      : OP_POW;
+      emit(program, op, depth - 2, stack[depth - 2], stack[depth - 1]);
+      stack[depth - 2] = depth - 2;
+      depth--;
+      break;
+#define FUNCTION(__name, __tt, __arity, __expr)                                \
+  case __tt:                                                                   \
+    if (depth < (__arity)) {                                                   \
+      res = ER_MISSING_OPERAND;                                                \
+      break;                                                                   \
+    }                                                                          \
+    emit(program, OP_##__tt, depth - (__arity), stack[depth - (__arity)],      \
+         stack[depth - 1]);                                                    \
+    stack[depth - (__arity)] = depth - (__arity);                              \
+    depth -= (__arity) - 1;                                                    \
+    break;
+#include "include/functions.def"
+#undef FUNCTION
+    case TT_EOF:
+    case TT_EMPTY:
+    case TT_ERROR:
+    case TT_OPENPAR:
+    case TT_CLOSEPAR:
+    case TT_COMMA:
+    default:
+      res = ER_INVALID_OPERATOR;
+      break;
+    }
+
+    if (depth > max_depth) {
+      max_depth = depth;
+    }
+  }
+
+  if (res == ER_OK && depth != 1) {
+    res = ER_MULTIPLE_RESULTS;
+  }
+
+  if (res == ER_OK) {
+    emit(program, OP_RET, 0, stack[0], stack[0]);
+    for (size_t i = 0; i < program->len; i++) {
+      Instruction *insn = &program->code[i];
+      insn->dst = to_register(program, insn->dst);
+      insn->a = to_register(program, insn->a);
+      insn->b = to_register(program, insn->b);
+    }
+    program->n_regs = program->n_consts + program->n_vars + max_depth;
+  }
+
+  if (arena == NULL && stack != stack_buf) {
+    free_checked(stack);
+  }
+  if (res != ER_OK) {
+    vm_program_free(program);
+    *program = (struct vm_program){.arena = arena};
+  }
+
+  mem_tag_swap(tag);
+  return res;
+}
+
+#define NEXT()                                                                 \
+  ip++;                                                                        \
+  goto *dispatch[ip->op]
+
+double vm_run(const struct vm_program *program, double *regs) {
+  /* Threaded dispatch: every handler jumps straight to the next one */
+  static const void *const dispatch[N_OPCODES] = {
+      [OP_RET] = &&op_ret, [OP_NEG] = &&op_neg, [OP_ADD] = &&op_add,
+      [OP_SUB] = &&op_sub, [OP_MUL] = &&op_mul, [OP_DIV] = &&op_div,
+      [OP_POW] = &&op_pow,
+#define FUNCTION(__name, __tt, __arity, __expr) [OP_##__tt] = &&op_##__tt,
+#include "include/functions.def"
+#undef FUNCTION
+  };
+
+  if (program->len == 0) {
+    return NAN;
+  }
+
+  memcpy(regs, program->consts, program->n_consts * sizeof(double));
+
+  const Instruction *ip = program->code;
+  goto *dispatch[ip->op];
+
+op_ret:
+  return regs[ip->a];
+op_neg:
+  regs[ip->dst] = -regs[ip->a];
+  NEXT();
+op_add:
+  regs[ip->dst] = regs[ip->a] + regs[ip->b];
+  NEXT();
+op_sub:
+  regs[ip->dst] = regs[ip->a] - regs[ip->b];
+  NEXT();
+op_mul:
+  regs[ip->dst] = regs[ip->a] * regs[ip->b];
+  NEXT();
+op_div:
+  regs[ip->dst] = regs[ip->a] / regs[ip->b];
+  NEXT();
+op_pow:
+  regs[ip->dst] = pow(regs[ip->a], regs[ip->b]);
+  NEXT();
+#define FUNCTION(__name, __tt, __arity, __expr)                                \
+  op_##__tt : {                                                                \
+    const double a = regs[ip->a];                                              \
+    const double b = regs[ip->b];                                              \
+    (void)b;                                                                   \
+    regs[ip->dst] = (__expr);                                                  \
+  }                                                                            \
+  NEXT();
+#include "include/functions.def"
+#undef FUNCTION
+}
+
+double vm_execute(const struct vm_program *program, const double *vars) {
+  if (program->n_regs <= VM_INLINE_REGISTERS) {
+    double regs[VM_INLINE_REGISTERS];
+    if (program->n_vars > 0) {
+      memcpy(regs + program->n_consts, vars, program->n_vars * sizeof(double));
+    }
+    return vm_run(program, regs);
+  }
+
+  MemTag tag = mem_tag_swap(MT_EVALUATOR);
+  double *regs = malloc_checked(program->n_regs * sizeof(double));
+  mem_tag_swap(tag);
+  if (program->n_vars > 0) {
+    memcpy(regs + program->n_consts, vars, program->n_vars * sizeof(double));
+  }
+  double res = vm_run(program, regs);
+  free_checked(regs);
+  return res;
+}
+
+void vm_program_to_heap(struct vm_program *program) {
+  size_t code_size = program->len * sizeof(Instruction);
+  size_t consts_size = program->n_consts * sizeof(double);
+
+  if (program->code == NULL) {
+    program->arena = NULL;
+    return;
+  }
+
+  if (program->arena == NULL) {
+    program->code =
+        realloc_checked(program->code, code_size > 0 ? code_size : 1);
+    program->consts =
+        realloc_checked(program->consts, consts_size > 0 ? consts_size : 1);
+    return;
+  }
+
+  MemTag tag = mem_tag_swap(MT_EVALUATOR);
+  Instruction *code = malloc_checked(code_size > 0 ? code_size : 1);
+  memcpy(code, program->code, code_size);
+  double *consts = malloc_checked(consts_size > 0 ? consts_size : 1);
+  memcpy(consts, program->consts, consts_size);
+  mem_tag_swap(tag);
+
+  program->code = code;
+  program->consts = consts;
+  program->arena = NULL;
+}
+
+void vm_program_free(struct vm_program *program) {
+  if (program->arena == NULL) {
+    free_checked(program->code);
+    free_checked(program->consts);
+  }
+  program->code = NULL;
+  program->consts = NULL;
+  program->len = 0;
+  program->n_consts = 0;
+  program->n_vars = 0;
+  program->n_regs = 0;
+}